@@ -0,0 +1,85 @@
+// Adaptive concurrency limiter (AIMD)
+//   by BOT Man & ZhangHan, 2018
+
+#include "aimd_limiter.h"
+
+#include <assert.h>
+
+#define LATENCY_WEIGHT 0.125    // smoothing of recent latency
+#define BASELINE_WEIGHT 0.01    // smoothing of baseline latency
+#define LATENCY_TOLERANCE 2.0   // steady if under baseline * tolerance
+#define DECREASE_FACTOR 0.5
+
+void InitAimdLimiter(AimdLimiter* limiter,
+                     size_t initial_limit,
+                     size_t min_limit,
+                     size_t max_limit) {
+  assert(limiter);
+  assert(min_limit);
+  assert(min_limit <= initial_limit && initial_limit <= max_limit);
+
+  limiter->limit = (double)initial_limit;
+  limiter->min_limit = min_limit;
+  limiter->max_limit = max_limit;
+  limiter->slow_start_threshold = (double)max_limit;
+  limiter->latency_us = 0;
+  limiter->baseline_latency_us = 0;
+
+  // allow decreasing on the first congestion
+  limiter->finished_count = max_limit;
+}
+
+void AimdLimiterOnDone(AimdLimiter* limiter, long latency_us) {
+  assert(limiter);
+
+  ++limiter->finished_count;
+
+  if (latency_us >= 0) {
+    if (limiter->baseline_latency_us <= 0) {
+      limiter->latency_us = (double)latency_us;
+      limiter->baseline_latency_us = (double)latency_us;
+    } else {
+      limiter->latency_us +=
+          LATENCY_WEIGHT * ((double)latency_us - limiter->latency_us);
+      limiter->baseline_latency_us +=
+          BASELINE_WEIGHT * ((double)latency_us - limiter->baseline_latency_us);
+
+      // follow the lowest latency immediately
+      if (limiter->latency_us < limiter->baseline_latency_us)
+        limiter->baseline_latency_us = limiter->latency_us;
+    }
+  }
+
+  // hold while latency is rising (queueing somewhere)
+  if (limiter->latency_us > limiter->baseline_latency_us * LATENCY_TOLERANCE)
+    return;
+
+  if (limiter->limit < limiter->slow_start_threshold)
+    limiter->limit += 1;
+  else
+    limiter->limit += 1 / limiter->limit;
+
+  if (limiter->limit > (double)limiter->max_limit)
+    limiter->limit = (double)limiter->max_limit;
+}
+
+void AimdLimiterOnCongestion(AimdLimiter* limiter) {
+  assert(limiter);
+
+  // requests started before last decrease may still fail,
+  // so decrease at most once per |limit| finished requests
+  ++limiter->finished_count;
+  if ((double)limiter->finished_count < limiter->limit)
+    return;
+  limiter->finished_count = 0;
+
+  limiter->limit *= DECREASE_FACTOR;
+  if (limiter->limit < (double)limiter->min_limit)
+    limiter->limit = (double)limiter->min_limit;
+  limiter->slow_start_threshold = limiter->limit;
+}
+
+size_t GetAimdLimit(const AimdLimiter* limiter) {
+  assert(limiter);
+  return (size_t)limiter->limit;
+}
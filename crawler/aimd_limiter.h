@@ -0,0 +1,44 @@
+// Adaptive concurrency limiter (AIMD)
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef AIMD_LIMITER
+#define AIMD_LIMITER
+
+#include <stddef.h>
+
+// limit of in-flight requests, adapted by results of finished ones:
+// - grow by 1 per done request (slow start) until the first congestion,
+//   then by 1 per |limit| done requests while latency holds steady
+// - halve on congestion (timeouts or connection errors),
+//   at most once per |limit| finished requests
+
+typedef struct {
+  // current limit (fractional for additive increase) and its range
+  double limit;
+  size_t min_limit;
+  size_t max_limit;
+
+  // slow start until |limit| reaches it
+  double slow_start_threshold;
+
+  // smoothed latency of recent requests, and of long term (baseline)
+  double latency_us;
+  double baseline_latency_us;
+
+  // finished requests since last decrease
+  size_t finished_count;
+} AimdLimiter;
+
+void InitAimdLimiter(AimdLimiter* limiter,
+                     size_t initial_limit,
+                     size_t min_limit,
+                     size_t max_limit);
+
+// report a finished request with its latency (negative if unknown),
+// or a congested one
+void AimdLimiterOnDone(AimdLimiter* limiter, long latency_us);
+void AimdLimiterOnCongestion(AimdLimiter* limiter);
+
+size_t GetAimdLimit(const AimdLimiter* limiter);
+
+#endif  // AIMD_LIMITER
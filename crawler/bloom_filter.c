@@ -156,7 +156,8 @@ BloomFilter* CreateBloomFilter(size_t size) {
 
   ret->size = size;
 
-  ++g_bloom_filter_count;
+  // filters may be created/freed in several threads
+  __sync_add_and_fetch(&g_bloom_filter_count, 1);
   return ret;
 }
 
@@ -168,7 +169,7 @@ void FreeBloomFilter(BloomFilter* filter) {
     free(filter->bits);
 
   free((void*)filter);
-  --g_bloom_filter_count;
+  __sync_sub_and_fetch(&g_bloom_filter_count, 1);
 }
 
 void AssertBloomFilterNoLeak() {
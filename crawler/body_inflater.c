@@ -0,0 +1,178 @@
+// Inflate gzip/deflate encoded http body incrementally
+//   by BOT Man & ZhangHan, 2018
+
+#include "body_inflater.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// For inflate functions
+#include <zlib.h>
+
+#include "string_helper.h"
+
+#define INFLATE_BUFFER_SIZE 16384
+
+// detect gzip or zlib header automatically
+#define WINDOW_BITS_AUTO (15 + 32)
+// raw deflate data without zlib header
+#define WINDOW_BITS_RAW (-15)
+
+#define ENCODING_GZIP "gzip"
+#define ENCODING_X_GZIP "x-gzip"
+#define ENCODING_DEFLATE "deflate"
+#define ENCODING_IDENTITY "identity"
+
+struct _BodyInflater {
+  ContentEncoding encoding;
+  z_stream stream;
+  unsigned char is_stream_init;
+  unsigned char is_stream_end;
+
+  // inflated data (since last cleared)
+  char* data;
+  size_t len;
+  size_t cap;
+
+  // limit of total inflated data
+  size_t max_len;
+};
+
+unsigned char IsEncodingEqual(const char* value,
+                              size_t value_len,
+                              const char* encoding) {
+  return value_len == strlen(encoding) &&
+         FindrStringIgnoreCase(value, value + value_len, encoding);
+}
+
+ContentEncoding ParseContentEncoding(const char* value, size_t value_len) {
+  if (!value || !value_len ||
+      IsEncodingEqual(value, value_len, ENCODING_IDENTITY))
+    return Content_Encoding_Identity;
+  if (IsEncodingEqual(value, value_len, ENCODING_GZIP) ||
+      IsEncodingEqual(value, value_len, ENCODING_X_GZIP))
+    return Content_Encoding_Gzip;
+  if (IsEncodingEqual(value, value_len, ENCODING_DEFLATE))
+    return Content_Encoding_Deflate;
+  return Content_Encoding_Unknown;
+}
+
+BodyInflater* CreateBodyInflater(ContentEncoding encoding, size_t max_len) {
+  assert(encoding == Content_Encoding_Gzip ||
+         encoding == Content_Encoding_Deflate);
+
+  BodyInflater* ret = (BodyInflater*)malloc(sizeof(BodyInflater));
+  if (!ret)
+    return NULL;
+  memset(ret, 0, sizeof(BodyInflater));
+
+  ret->encoding = encoding;
+  ret->max_len = max_len;
+  return ret;
+}
+
+void FreeBodyInflater(BodyInflater* inflater) {
+  assert(inflater);
+
+  if (inflater->is_stream_init)
+    inflateEnd(&inflater->stream);
+  if (inflater->data)
+    free((void*)inflater->data);
+  free((void*)inflater);
+}
+
+// init |stream| by the first byte of data
+unsigned char InitStream(BodyInflater* inflater, unsigned char first_byte) {
+  // some servers send raw deflate data for "deflate" encoding,
+  // and zlib data always starts with 0x?8 (CM = 8)
+  int window_bits = WINDOW_BITS_AUTO;
+  if (inflater->encoding == Content_Encoding_Deflate &&
+      (first_byte & 0x0f) != 8)
+    window_bits = WINDOW_BITS_RAW;
+
+  if (inflateInit2(&inflater->stream, window_bits) != Z_OK)
+    return 0;
+
+  inflater->is_stream_init = 1;
+  return 1;
+}
+
+InflateResult InflateBody(BodyInflater* inflater,
+                          const char* data,
+                          size_t len) {
+  assert(inflater);
+  assert(data || !len);
+
+  if (!len)
+    return inflater->is_stream_end ? Inflate_Done : Inflate_Ok;
+
+  // ignore data after the end of stream
+  if (inflater->is_stream_end)
+    return Inflate_Done;
+
+  if (!inflater->is_stream_init &&
+      !InitStream(inflater, (unsigned char)data[0]))
+    return Inflate_Data_Err;
+
+  z_stream* stream = &inflater->stream;
+  stream->next_in = (Bytef*)data;
+  stream->avail_in = (uInt)len;
+
+  // keep inflating while |data| is filled up, since zlib may still hold
+  // output after consuming all input
+  for (;;) {
+    // grow |data| to hold at least |INFLATE_BUFFER_SIZE| more bytes
+    if (inflater->cap - inflater->len < INFLATE_BUFFER_SIZE) {
+      size_t new_cap = inflater->cap ? inflater->cap * 2 : INFLATE_BUFFER_SIZE;
+
+      // reserve 1 more byte to make |data| C-style string
+      char* new_data = (char*)realloc(inflater->data, new_cap + 1);
+      if (!new_data)
+        return Inflate_Data_Err;
+
+      inflater->data = new_data;
+      inflater->cap = new_cap;
+    }
+
+    stream->next_out = (Bytef*)(inflater->data + inflater->len);
+    stream->avail_out = (uInt)(inflater->cap - inflater->len);
+
+    int ret = inflate(stream, Z_NO_FLUSH);
+    inflater->len = inflater->cap - stream->avail_out;
+    inflater->data[inflater->len] = 0;
+
+    if (stream->total_out > inflater->max_len)
+      return Inflate_Too_Large;
+
+    if (ret == Z_STREAM_END) {
+      inflater->is_stream_end = 1;
+      return Inflate_Done;
+    }
+    // no progress is possible until more input
+    if (ret == Z_BUF_ERROR)
+      break;
+    if (ret != Z_OK)
+      return Inflate_Data_Err;
+    if (!stream->avail_in && stream->avail_out)
+      break;
+  }
+
+  return Inflate_Ok;
+}
+
+const char* GetInflatedBody(BodyInflater* inflater, size_t* len) {
+  assert(inflater);
+
+  if (len)
+    *len = inflater->len;
+  return inflater->data ? inflater->data : "";
+}
+
+void ClearInflatedBody(BodyInflater* inflater) {
+  assert(inflater);
+
+  inflater->len = 0;
+  if (inflater->data)
+    inflater->data[0] = 0;
+}
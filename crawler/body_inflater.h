@@ -0,0 +1,41 @@
+// Inflate gzip/deflate encoded http body incrementally
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef BODY_INFLATER
+#define BODY_INFLATER
+
+#include <stddef.h>
+
+typedef enum {
+  Content_Encoding_Identity,
+  Content_Encoding_Gzip,
+  Content_Encoding_Deflate,
+  Content_Encoding_Unknown,
+} ContentEncoding;
+
+typedef enum {
+  Inflate_Ok,         // consumed all data (stream not ended yet)
+  Inflate_Done,       // end of compressed stream
+  Inflate_Data_Err,   // corrupted data or out of memory
+  Inflate_Too_Large,  // inflated data exceeds |max_len|
+} InflateResult;
+
+struct _BodyInflater;
+typedef struct _BodyInflater BodyInflater;
+
+ContentEncoding ParseContentEncoding(const char* value, size_t value_len);
+
+BodyInflater* CreateBodyInflater(ContentEncoding encoding, size_t max_len);
+void FreeBodyInflater(BodyInflater* inflater);
+
+InflateResult InflateBody(BodyInflater* inflater,
+                          const char* data,
+                          size_t len);
+
+// inflated data as C-style string
+const char* GetInflatedBody(BodyInflater* inflater, size_t* len);
+
+// drop inflated data (e.g. passed on already), but keep inflating
+void ClearInflatedBody(BodyInflater* inflater);
+
+#endif  // BODY_INFLATER
@@ -0,0 +1,195 @@
+// Idle keep-alive connection pool
+//   by BOT Man & ZhangHan, 2018
+
+#include "conn_pool.h"
+
+#include <assert.h>
+
+// For struct event (embedded in IdleConn)
+#include <event2/event_struct.h>
+
+// use C++ string, list & map to store idle connections
+#include <list>
+#include <map>
+#include <string>
+
+#include "transport.h"
+
+#define CONN_POOL_IDLE_TIMEOUT_SEC 30
+#define CONN_POOL_MAX_IDLE_PER_HOST 8
+#define CONN_POOL_MAX_IDLE 1024
+
+struct IdleConn;
+
+// idle connections, the most recently put at back
+typedef std::list<IdleConn*> IdleConnList;
+
+// host -> idle connections to host
+typedef std::map<std::string, IdleConnList> IdleConnMap;
+
+struct IdleConn {
+  evutil_socket_t fd;
+
+  // watch peer closing or idle timeout
+  struct event event;
+
+  // position in |g_idle_conn_map| and |g_idle_conn_lru|
+  IdleConnMap::iterator host_iter;
+  IdleConnList::iterator host_list_iter;
+  IdleConnList::iterator lru_iter;
+};
+
+// host -> request accepting pipelined requests
+typedef std::map<std::string, void*> PipelineMap;
+
+// host -> HTTP/2 session multiplexing requests
+typedef std::map<std::string, void*> SessionMap;
+
+// pools are per thread, since connections are bound to thread's event base
+
+IdleConnMap& g_idle_conn_map() {
+  static thread_local IdleConnMap idle_conn_map;
+  return idle_conn_map;
+}
+
+IdleConnList& g_idle_conn_lru() {
+  static thread_local IdleConnList idle_conn_lru;
+  return idle_conn_lru;
+}
+
+PipelineMap& g_pipeline_map() {
+  static thread_local PipelineMap pipeline_map;
+  return pipeline_map;
+}
+
+SessionMap& g_session_map() {
+  static thread_local SessionMap session_map;
+  return session_map;
+}
+
+// detach |conn| from pool and free it, return its socket
+evutil_socket_t RemoveIdleConn(IdleConn* conn) {
+  assert(conn);
+  evutil_socket_t fd = conn->fd;
+
+  IdleConnList& host_list = conn->host_iter->second;
+  host_list.erase(conn->host_list_iter);
+  if (host_list.empty())
+    g_idle_conn_map().erase(conn->host_iter);
+  g_idle_conn_lru().erase(conn->lru_iter);
+
+  event_del(&conn->event);
+  delete conn;
+  return fd;
+}
+
+void CloseIdleConn(IdleConn* conn) {
+  TransportClose(RemoveIdleConn(conn));
+}
+
+// idle connection is readable (peer closed) or timeout
+void OnIdleConnEvent(evutil_socket_t fd, short events, void* context) {
+  (void)(fd);
+  (void)(events);
+  assert(context);
+
+  CloseIdleConn((IdleConn*)context);
+}
+
+evutil_socket_t ConnPoolGet(const char* host) {
+  assert(host);
+
+  IdleConnMap::iterator iter = g_idle_conn_map().find(host);
+  if (iter == g_idle_conn_map().end())
+    return -1;
+
+  // reuse the most recently used connection
+  assert(!iter->second.empty());
+  return RemoveIdleConn(iter->second.back());
+}
+
+void ConnPoolPut(struct event_base* base,
+                 const char* host,
+                 evutil_socket_t fd) {
+  assert(base);
+  assert(host);
+
+  IdleConn* conn = new IdleConn;
+  conn->fd = fd;
+  if (event_assign(&conn->event, base, fd, EV_READ, OnIdleConnEvent, conn) <
+      0) {
+    delete conn;
+    TransportClose(fd);
+    return;
+  }
+
+  conn->host_iter =
+      g_idle_conn_map().insert(std::make_pair(host, IdleConnList())).first;
+  IdleConnList& host_list = conn->host_iter->second;
+  conn->host_list_iter = host_list.insert(host_list.end(), conn);
+  conn->lru_iter = g_idle_conn_lru().insert(g_idle_conn_lru().end(), conn);
+
+  // use common timeout queue, since all idle connections share the timeout
+  struct timeval tv = {CONN_POOL_IDLE_TIMEOUT_SEC, 0};
+  const struct timeval* common_tv = event_base_init_common_timeout(base, &tv);
+  event_add(&conn->event, common_tv ? common_tv : &tv);
+
+  // close the least recently used connections if reach limits
+  if (host_list.size() > CONN_POOL_MAX_IDLE_PER_HOST)
+    CloseIdleConn(host_list.front());
+  if (g_idle_conn_lru().size() > CONN_POOL_MAX_IDLE)
+    CloseIdleConn(g_idle_conn_lru().front());
+}
+
+void ConnPoolClear() {
+  while (!g_idle_conn_lru().empty())
+    CloseIdleConn(g_idle_conn_lru().front());
+}
+
+size_t GetConnPoolIdleCount() {
+  return g_idle_conn_lru().size();
+}
+
+void* ConnPoolGetPipeline(const char* host) {
+  assert(host);
+
+  PipelineMap::iterator iter = g_pipeline_map().find(host);
+  return iter != g_pipeline_map().end() ? iter->second : NULL;
+}
+
+void ConnPoolSetPipeline(const char* host, void* request) {
+  assert(host);
+  assert(request);
+
+  g_pipeline_map()[host] = request;
+}
+
+void ConnPoolUnsetPipeline(const char* host, void* request) {
+  assert(host);
+
+  PipelineMap::iterator iter = g_pipeline_map().find(host);
+  if (iter != g_pipeline_map().end() && iter->second == request)
+    g_pipeline_map().erase(iter);
+}
+
+void* ConnPoolGetSession(const char* host) {
+  assert(host);
+
+  SessionMap::iterator iter = g_session_map().find(host);
+  return iter != g_session_map().end() ? iter->second : NULL;
+}
+
+unsigned char ConnPoolSetSession(const char* host, void* session) {
+  assert(host);
+  assert(session);
+
+  return g_session_map().insert(std::make_pair(host, session)).second;
+}
+
+void ConnPoolUnsetSession(const char* host, void* session) {
+  assert(host);
+
+  SessionMap::iterator iter = g_session_map().find(host);
+  if (iter != g_session_map().end() && iter->second == session)
+    g_session_map().erase(iter);
+}
@@ -0,0 +1,47 @@
+// Idle keep-alive connection pool
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef CONN_POOL
+#define CONN_POOL
+
+#include <stddef.h>
+
+// For libevent types
+#include <event2/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// return an idle connection to |host|, or -1 if there is none
+evutil_socket_t ConnPoolGet(const char* host);
+
+// take over |fd|: keep it idle for later |ConnPoolGet|,
+// or close it if reach limits
+void ConnPoolPut(struct event_base* base, const char* host, evutil_socket_t fd);
+
+// close all idle connections
+void ConnPoolClear();
+
+// the request (opaque to pool) whose connection to |host| accepts
+// pipelined requests now, or NULL if there is none
+void* ConnPoolGetPipeline(const char* host);
+void ConnPoolSetPipeline(const char* host, void* request);
+void ConnPoolUnsetPipeline(const char* host, void* request);
+
+// the HTTP/2 session (opaque to pool) multiplexing requests to |host|,
+// or NULL if there is none
+void* ConnPoolGetSession(const char* host);
+
+// keep |session| as the session to |host|,
+// or return 0 if there is one already
+unsigned char ConnPoolSetSession(const char* host, void* session);
+void ConnPoolUnsetSession(const char* host, void* session);
+
+size_t GetConnPoolIdleCount();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CONN_POOL
@@ -3,21 +3,50 @@
 //   by BOT Man & ZhangHan, 2018
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
 
+// For worker threads
+#include <pthread.h>
+// For pipe, read and write
+#include <unistd.h>
+// For signal
+#include <signal.h>
+// For getopt_long
+#include <getopt.h>
+// For getrlimit
+#include <sys/resource.h>
+
+// For event_new (watching worker inbox)
+#include <event2/event.h>
+
+#include "aimd_limiter.h"
 #include "bloom_filter.h"
+#include "dns_cache.h"
+#include "host_scheduler.h"
 #include "html_parser.h"
+#include "http2_session.h"
 #include "http_client.h"
+#include "page_cache.h"
+#include "retry_queue.h"
 #include "string_helper.h"
 #include "third_party/HTParse.h"
+#include "tls_session_cache.h"
+#include "transport.h"
 #include "url_map.h"
 
 #define URL_HTTP_SCHEME "http://"
+#define URL_HTTPS_SCHEME "https://"
 #define HANDLED_URL_SET_SIZE (16000000 * 100)
 #define PAGE_URL_SET_SIZE (1000 * 100)
+#define MAX_WORKER_COUNT 256
+#define NOTIFY_READ_SIZE 64
+#define DEFAULT_MAX_REQUEST_COUNT 4096
+#define INITIAL_INFLIGHT_LIMIT 8
+#define RESERVED_FD_COUNT 64  // for dns, pipes, pooled connections and output
 
 void RequestCallback(const char* url,
                      RequestStatus status,
@@ -29,9 +58,52 @@ struct PendingRequest {
   TAILQ_ENTRY(PendingRequest) _entries;
 };
 
-unsigned char g_is_fd_reach_limits;
-size_t g_pending_request_count;
-TAILQ_HEAD(, PendingRequest) g_pending_request_queue;
+// pending requests wait for admission in |HostSchedulerPush|,
+// and for politeness delay of their hosts by |g_politeness_timer|
+__thread unsigned char g_is_fd_reach_limits;
+__thread struct event* g_politeness_timer;
+
+// failed requests wait for their backoff in |RetryQueuePush|,
+// and are queued again by |g_retry_timer|
+__thread struct event* g_retry_timer;
+
+// in-flight requests of current worker, admitted under the limit
+// adapted by |g_inflight_limiter| (up to the max set by
+// |SetMaxInflightRequestCount|, shared by all workers)
+size_t g_max_inflight_request_count;
+__thread AimdLimiter g_inflight_limiter;
+__thread size_t g_inflight_request_count;
+__thread unsigned char g_is_admitting;
+
+typedef struct {
+  pthread_t thread;
+
+  // urls posted by other threads
+  pthread_mutex_t inbox_lock;
+  pthread_cond_t inbox_cond;
+  TAILQ_HEAD(, PendingRequest) inbox;
+
+  // set when crawl is done
+  unsigned char is_done;
+
+  // wake up event loop of worker when posting urls
+  int notify_fds[2];
+} Worker;
+
+// each worker runs its own event loop for hosts routed to it
+Worker* g_workers;
+size_t g_worker_count;
+__thread Worker* g_current_worker;
+
+// transport requested for all workers (may fallback to libevent)
+TransportType g_worker_transport_type = Transport_Libevent;
+
+// count of urls dispatched but not finished (crawl is done if 0)
+size_t g_unfinished_url_count;
+
+// file of page cache to revalidate pages of the last crawl, and to save
+// pages of this crawl (NULL if not recrawling)
+const char* g_page_cache_path;
 
 typedef struct {
   // referred source url
@@ -43,6 +115,65 @@ typedef struct {
 
 // global url-set for crawling pages to avoid dup |Request|
 BloomFilter* g_handled_url_set;
+pthread_mutex_t g_handled_url_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// test and add |url| to |g_handled_url_set| atomically,
+// return whether |url| is not handled before
+unsigned char AddHandledUrl(const char* url) {
+  pthread_mutex_lock(&g_handled_url_lock);
+  unsigned char is_new = !BloomFilterTest(g_handled_url_set, url);
+  if (is_new)
+    BloomFilterAdd(g_handled_url_set, url);
+  pthread_mutex_unlock(&g_handled_url_lock);
+  return is_new;
+}
+
+unsigned char IsHandledUrl(const char* url) {
+  pthread_mutex_lock(&g_handled_url_lock);
+  unsigned char ret = BloomFilterTest(g_handled_url_set, url);
+  pthread_mutex_unlock(&g_handled_url_lock);
+  return ret;
+}
+
+typedef struct {
+  // parse <a> tags of current page while receiving
+  AtagParser atag_parser;
+
+  // local url-set for current page (created when body arrives)
+  BloomFilter* page_url_set;
+} PageContext;
+
+PageContext* CreatePageContext() {
+  PageContext* ret = (PageContext*)malloc(sizeof(PageContext));
+  if (!ret)
+    return NULL;
+
+  InitAtagParser(&ret->atag_parser);
+  ret->page_url_set = NULL;
+  return ret;
+}
+
+void FreePageContext(PageContext* page) {
+  if (!page)
+    return;
+
+  FreeAtagParser(&page->atag_parser);
+  if (page->page_url_set)
+    FreeBloomFilter(page->page_url_set);
+  free((void*)page);
+}
+
+void RequestPage(const char* url);
+char* ParseUrlHost(const char* url);
+unsigned char IsUrlWithPort(const char* url);
+unsigned long long GetNowMs();
+HostFetchResult GetHostFetchResult(RequestStatus status);
+unsigned char IsRetryableStatus(RequestStatus status);
+void QueueDueRetries();
+void UpdateInflightLimit(RequestStatus status);
+void AdmitPendingRequests();
+void DispatchUrl(const char* url);
+void FinishUrl();
 
 void ProcessUrl(const char* raw_url, void* context) {
   assert(raw_url);
@@ -53,8 +184,11 @@ void ProcessUrl(const char* raw_url, void* context) {
                       PARSE_ALL & ~PARSE_VIEW);
   HTSimplify(&url);
 
-  // ignore non-http url
-  if (strstr(url, URL_HTTP_SCHEME) != url) {
+  // ignore non-http(s) url, and url with explicit port (unsupported,
+  // since connections are made to default port of scheme)
+  if ((strstr(url, URL_HTTP_SCHEME) != url &&
+       strstr(url, URL_HTTPS_SCHEME) != url) ||
+      IsUrlWithPort(url)) {
     free((void*)url);
     return;
   }
@@ -65,60 +199,580 @@ void ProcessUrl(const char* raw_url, void* context) {
     assert(page_context->page_url_set);
 
     // ensure |src_url| in |g_handled_url_set| already
-    assert(BloomFilterTest(g_handled_url_set, page_context->src_url));
+    assert(IsHandledUrl(page_context->src_url));
 
     if (!BloomFilterTest(page_context->page_url_set, url)) {
       BloomFilterAdd(page_context->page_url_set, url);
 
-      // connect |src_url| to |url|
+      // connect |src_url| to |url|, and cache it as a link of |src_url|
       ConnectUrls(page_context->src_url, url);
+      if (g_page_cache_path)
+        PageCacheAddLink(page_context->src_url, url);
     }
   }
 
   // handle crawl tasks (test g_handled_url_set, handle by Request)
-  if (!BloomFilterTest(g_handled_url_set, url)) {
-    BloomFilterAdd(g_handled_url_set, url);
-
+  if (AddHandledUrl(url)) {
     // use |url| as start node to crawl pages
-    // async once call |RequestCallback|
-    Request(url, RequestCallback, NULL);
+    DispatchUrl(url);
   }
 
   free((void*)url);
 }
 
+void RequestBodyCallback(const char* url,
+                         const char* data,
+                         size_t len,
+                         void* context) {
+  assert(url);
+  assert(context);
+  PageContext* page = (PageContext*)context;
+
+  if (!page->page_url_set) {
+    page->page_url_set = CreateBloomFilter(PAGE_URL_SET_SIZE);
+    assert(page->page_url_set);
+  }
+  ProcessUrlContext page_context = {url, page->page_url_set};
+
+  // sync multi call |ProcessUrl| for urls completed in |data|
+  ParseAtagUrlsPartial(&page->atag_parser, data, len, ProcessUrl,
+                       &page_context);
+}
+
 void RequestCallback(const char* url,
                      RequestStatus status,
                      const char* html,
                      void* context) {
   assert(url);
-  (void)(context);
+  PageContext* page = (PageContext*)context;
+
+  // release admission of |url|, and adapt limit by its result
+  assert(g_inflight_request_count);
+  --g_inflight_request_count;
+  UpdateInflightLimit(status);
+
+  char* host = ParseUrlHost(url);
+  HostSchedulerDone(host, GetHostFetchResult(status), GetNowMs());
+
+  // retry |url| first when another in-flight request finishes
+  // (fail if there is none to wait for)
+  if (status == Request_Fd_Limit && g_inflight_request_count) {
+    g_is_fd_reach_limits = 1;
+    if (g_page_cache_path)
+      PageCacheAbort(url);
+    HostSchedulerPush(host, url, 1);
+
+    free((void*)host);
+    FreePageContext(page);
+    return;
+  }
+  free((void*)host);
+
+  // retry transient failures after backoff, within budget of |url|
+  // (dup |ConnectUrls| of partial page are ignored then)
+  if (IsRetryableStatus(status) && RetryQueuePush(url, GetNowMs())) {
+    if (g_page_cache_path)
+      PageCacheAbort(url);
+    QueueDueRetries();
+  } else {
+    if (status == Request_Not_Modified) {
+      BloomFilter* page_url_set = CreateBloomFilter(PAGE_URL_SET_SIZE);
+      ProcessUrlContext page_context = {url, page_url_set};
+
+      // sync multi call |ProcessUrl| for links cached by the last crawl
+      // (which are pending again, so drop them)
+      if (!PageCacheYieldLinks(url, ProcessUrl, &page_context))
+        fprintf(stderr, "failed to fetch %s (not cached)\n", url);
+      PageCacheAbort(url);
+
+      FreeBloomFilter(page_url_set);
+    } else if (status != Request_Succ || !(html || page)) {
+      // urls are processed while receiving if |page| exists
+      fprintf(stderr, "failed to fetch %s (%d)\n", url, status);
+      if (g_page_cache_path)
+        PageCacheRemove(url);
+    } else if (!page) {
+      BloomFilter* page_url_set = CreateBloomFilter(PAGE_URL_SET_SIZE);
+      ProcessUrlContext page_context = {url, page_url_set};
+
+      // sync multi call |ProcessUrl|
+      ParseAtagUrls(html, ProcessUrl, &page_context);
+
+      FreeBloomFilter(page_url_set);
+    }
+
+    // cache validators and links of fetched page for the next crawl
+    if (status == Request_Succ && g_page_cache_path) {
+      const RequestValidators* validators = GetResponseValidators();
+      PageCacheCommit(url, validators ? validators->etag : NULL,
+                      validators ? validators->last_modified : NULL);
+    }
+    RetryQueueForget(url);
+
+    // urls of current page are dispatched already
+    FinishUrl();
+  }
+
+  FreePageContext(page);
+
+  // start next pending request in the same dispatch
+  g_is_fd_reach_limits = 0;
+  AdmitPendingRequests();
+}
+
+void RequestPage(const char* url) {
+  assert(url);
 
-  // set flag |g_is_fd_reach_limits|
-  g_is_fd_reach_limits = (status == Request_Fd_Limit);
+  // stream page body to |RequestBodyCallback| if possible,
+  // or parse the whole page in |RequestCallback|
+  PageContext* page = CreatePageContext();
 
-  if (g_is_fd_reach_limits) {
-    struct PendingRequest* pending_request =
-        (struct PendingRequest*)malloc(sizeof(struct PendingRequest));
-    pending_request->url = CopyString(url);
+  // revalidate page cached by the last crawl by conditional GET
+  char* etag = NULL;
+  char* last_modified = NULL;
+  if (g_page_cache_path &&
+      PageCacheGetValidators(url, &etag, &last_modified)) {
+    RequestValidators validators = {etag, last_modified};
 
-    TAILQ_INSERT_TAIL(&g_pending_request_queue, pending_request, _entries);
-    ++g_pending_request_count;
+    // async once call |RequestCallback|
+    RequestConditional(url, &validators,
+                       page ? RequestBodyCallback : NULL, RequestCallback,
+                       page);
+    if (etag)
+      free((void*)etag);
+    if (last_modified)
+      free((void*)last_modified);
     return;
   }
 
-  if (status != Request_Succ || !html) {
-    fprintf(stderr, "failed to fetch %s (%d)\n", url, status);
+  // async once call |RequestCallback|
+  RequestStream(url, page ? RequestBodyCallback : NULL, RequestCallback,
+                page);
+}
+
+//
+// admission
+//
+
+void SetMaxInflightRequestCount(size_t count) {
+  assert(count);
+  g_max_inflight_request_count = count;
+}
+
+size_t GetDefaultMaxRequestCount(size_t worker_count) {
+  struct rlimit fd_limit;
+  if (getrlimit(RLIMIT_NOFILE, &fd_limit) < 0 ||
+      fd_limit.rlim_cur == RLIM_INFINITY)
+    return DEFAULT_MAX_REQUEST_COUNT;
+  if (fd_limit.rlim_cur < RESERVED_FD_COUNT + worker_count)
+    return worker_count;
+  return (size_t)fd_limit.rlim_cur - RESERVED_FD_COUNT;
+}
+
+void InitInflightLimit() {
+  size_t initial_limit = INITIAL_INFLIGHT_LIMIT;
+  if (initial_limit > g_max_inflight_request_count)
+    initial_limit = g_max_inflight_request_count;
+
+  InitAimdLimiter(&g_inflight_limiter, initial_limit, 1,
+                  g_max_inflight_request_count);
+}
+
+// cut limit on timeouts and connection errors (including fd limits),
+// or raise it while connect/ttfb latency holds steady
+void UpdateInflightLimit(RequestStatus status) {
+  switch (status) {
+    case Request_Fd_Limit:
+    case Request_Conn_Err:
+    case Request_Conn_Timeout:
+    case Request_Send_Timeout:
+    case Request_Recv_Timeout:
+      AimdLimiterOnCongestion(&g_inflight_limiter);
+      break;
+
+    default: {
+      const RequestTiming* timing = GetRequestTiming();
+      long latency_us = -1;
+      if (timing)
+        latency_us = timing->ttfb_us >= 0 ? timing->ttfb_us : timing->conn_us;
+      AimdLimiterOnDone(&g_inflight_limiter, latency_us);
+      break;
+    }
+  }
+}
+
+// host of |url| to schedule by (free it by caller)
+char* ParseUrlHost(const char* url) {
+  assert(url);
+
+  char* host = HTParse(url, NULL, PARSE_HOST);
+  return host ? host : CopyString("");
+}
+
+// host of |url| has explicit port (default port of http is removed by
+// |HTParse| already), e.g. "a.com:8080" or "[::1]:8080"
+unsigned char IsUrlWithPort(const char* url) {
+  assert(url);
+
+  char* host = ParseUrlHost(url);
+  const char* userinfo_end = strrchr(host, '@');
+  const char* port = strrchr(userinfo_end ? userinfo_end + 1 : host, ':');
+  unsigned char ret = port && !strchr(port, ']');
+  free((void*)host);
+  return ret;
+}
+
+// cached time of current event loop
+unsigned long long GetNowMs() {
+  struct timeval now;
+  event_base_gettimeofday_cached(GetLibEventBase(), &now);
+  return (unsigned long long)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// track connection failures by circuit breaker of host
+HostFetchResult GetHostFetchResult(RequestStatus status) {
+  switch (status) {
+    case Request_Conn_Err:
+    case Request_Conn_Timeout:
+    case Request_Bad_Sock_Opt:  // e.g. connection refused
+      return Host_Fetch_Conn_Failed;
+
+    case Request_Fd_Limit:
+    case Request_Socket_Err:
+    case Request_Out_Of_Mem:
+    case Request_Event_New_Err:
+    case Request_Bad_Hostname:
+      return Host_Fetch_Not_Tried;
+
+    default:
+      return Host_Fetch_Responded;
+  }
+}
+
+// retry transient failures (which may pass next time),
+// but not errors of url, response or local resources
+unsigned char IsRetryableStatus(RequestStatus status) {
+  switch (status) {
+    case Request_Conn_Timeout:
+    case Request_Send_Timeout:
+    case Request_Recv_Timeout:
+    case Request_Recv_Err:  // e.g. connection reset
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+// queue urls whose backoff passes back to their hosts (at front),
+// and wake up when the next one is due
+void QueueDueRetries() {
+  long long wait_ms = -1;
+  char* url;
+  while ((url = RetryQueuePop(GetNowMs(), &wait_ms))) {
+    char* host = ParseUrlHost(url);
+    HostSchedulerPush(host, url, 1);
+    free((void*)host);
+    free((void*)url);
+  }
+
+  if (wait_ms > 0) {
+    struct timeval timeout = {(time_t)(wait_ms / 1000),
+                              (suseconds_t)(wait_ms % 1000 * 1000)};
+    evtimer_add(g_retry_timer, &timeout);
+  }
+}
+
+void OnRetryTimer(evutil_socket_t fd, short events, void* context) {
+  (void)(fd);
+  (void)(events);
+  (void)(context);
+
+  QueueDueRetries();
+  AdmitPendingRequests();
+}
+
+// start requests of hosts allowed to fetch, until reaching the limit
+// (like semaphore release)
+void AdmitPendingRequests() {
+  // callback of a request may be called synchronously by |RequestPage|,
+  // so let the outermost call start the rest
+  if (g_is_admitting)
     return;
+  g_is_admitting = 1;
+
+  long long wait_ms = -1;
+  while (g_inflight_request_count < GetAimdLimit(&g_inflight_limiter) &&
+         !g_is_fd_reach_limits) {
+    unsigned char is_dropped = 0;
+    char* url = HostSchedulerPop(GetNowMs(), &wait_ms, &is_dropped);
+    if (!url)
+      break;
+
+    // don't waste sockets on hosts keeping failing
+    if (is_dropped) {
+      fprintf(stderr, "failed to fetch %s (host is down)\n", url);
+      RetryQueueForget(url);
+      free((void*)url);
+      FinishUrl();
+      continue;
+    }
+
+    ++g_inflight_request_count;
+    RequestPage(url);
+    free((void*)url);
+  }
+
+  // wake up when the next host is allowed to fetch
+  if (wait_ms > 0) {
+    struct timeval timeout = {(time_t)(wait_ms / 1000),
+                              (suseconds_t)(wait_ms % 1000 * 1000)};
+    evtimer_add(g_politeness_timer, &timeout);
   }
 
-  BloomFilter* page_url_set = CreateBloomFilter(PAGE_URL_SET_SIZE);
-  ProcessUrlContext page_context = {url, page_url_set};
+  g_is_admitting = 0;
+}
+
+void OnPolitenessTimer(evutil_socket_t fd, short events, void* context) {
+  (void)(fd);
+  (void)(events);
+  (void)(context);
+
+  AdmitPendingRequests();
+}
+
+// queue |url| to its host, and request it if admitted
+// (like semaphore acquire)
+void AdmitPage(const char* url) {
+  assert(url);
 
-  // sync multi call |ProcessUrl|
-  ParseAtagUrls(html, ProcessUrl, &page_context);
+  char* host = ParseUrlHost(url);
+  HostSchedulerPush(host, url, 0);
+  free((void*)host);
 
-  FreeBloomFilter(page_url_set);
+  AdmitPendingRequests();
+}
+
+//
+// workers
+//
+
+// route |url| to worker by hash of its host,
+// so connections to the same host are pooled by one worker
+Worker* GetUrlWorker(const char* url) {
+  assert(url);
+
+  if (g_worker_count == 1)
+    return &g_workers[0];
+
+  unsigned hash = 5381;
+  char* host = HTParse(url, NULL, PARSE_HOST);
+  if (host) {
+    for (const char* p = host; *p; ++p)
+      hash = hash * 33 + (unsigned char)*p;
+    free((void*)host);
+  }
+  return &g_workers[hash % g_worker_count];
+}
+
+// post |url| to inbox of |worker|, or return 0 if failed
+unsigned char PostUrl(Worker* worker, const char* url) {
+  assert(worker);
+  assert(url);
+
+  struct PendingRequest* request =
+      (struct PendingRequest*)malloc(sizeof(struct PendingRequest));
+  if (!request)
+    return 0;
+  request->url = CopyString(url);
+  if (!request->url) {
+    free((void*)request);
+    return 0;
+  }
+
+  pthread_mutex_lock(&worker->inbox_lock);
+  TAILQ_INSERT_TAIL(&worker->inbox, request, _entries);
+  pthread_cond_signal(&worker->inbox_cond);
+  pthread_mutex_unlock(&worker->inbox_lock);
+
+  // ignore EAGAIN, since there is unread notification already
+  ssize_t result = write(worker->notify_fds[1], "", 1);
+  (void)(result);
+  return 1;
+}
+
+void DispatchUrl(const char* url) {
+  assert(url);
+
+  __sync_add_and_fetch(&g_unfinished_url_count, 1);
+
+  // request in current worker directly, or post to another worker
+  Worker* worker = GetUrlWorker(url);
+  if (worker == g_current_worker) {
+    AdmitPage(url);
+  } else if (!PostUrl(worker, url)) {
+    fprintf(stderr, "failed to fetch %s (%d)\n", url, Request_Out_Of_Mem);
+    FinishUrl();
+  }
+}
+
+void FinishUrl() {
+  if (__sync_sub_and_fetch(&g_unfinished_url_count, 1))
+    return;
+
+  // wake up all workers to quit
+  for (size_t i = 0; i < g_worker_count; ++i) {
+    Worker* worker = &g_workers[i];
+
+    pthread_mutex_lock(&worker->inbox_lock);
+    worker->is_done = 1;
+    pthread_cond_signal(&worker->inbox_cond);
+    pthread_mutex_unlock(&worker->inbox_lock);
+  }
+}
+
+// request urls posted to |worker|
+void ProcessInbox(Worker* worker) {
+  assert(worker);
+
+  pthread_mutex_lock(&worker->inbox_lock);
+  while (!TAILQ_EMPTY(&worker->inbox)) {
+    struct PendingRequest* request = TAILQ_FIRST(&worker->inbox);
+    TAILQ_REMOVE(&worker->inbox, request, _entries);
+    pthread_mutex_unlock(&worker->inbox_lock);
+
+    AdmitPage(request->url);
+
+    free((void*)request->url);
+    free((void*)request);
+    pthread_mutex_lock(&worker->inbox_lock);
+  }
+  pthread_mutex_unlock(&worker->inbox_lock);
+}
+
+// wait until urls are posted to |worker|, or return 0 if crawl is done
+unsigned char WaitInbox(Worker* worker) {
+  assert(worker);
+
+  pthread_mutex_lock(&worker->inbox_lock);
+  while (TAILQ_EMPTY(&worker->inbox) && !worker->is_done)
+    pthread_cond_wait(&worker->inbox_cond, &worker->inbox_lock);
+  unsigned char ret = !TAILQ_EMPTY(&worker->inbox);
+  pthread_mutex_unlock(&worker->inbox_lock);
+  return ret;
+}
+
+// urls are posted while dispatching requests
+void OnWorkerNotify(evutil_socket_t fd, short events, void* context) {
+  (void)(events);
+  assert(context);
+
+  char buffer[NOTIFY_READ_SIZE];
+  while (read(fd, buffer, sizeof buffer) > 0)
+    continue;
+
+  ProcessInbox((Worker*)context);
+}
+
+// dispatch requests of current worker
+// (pending requests are admitted as soon as in-flight ones finish,
+// or when politeness delay of their hosts or retry backoff passes)
+void DispatchRequests() {
+  DispatchLibEvent();
+
+  // no request in flight, wait for |g_politeness_timer| or |g_retry_timer|
+  while (GetHostSchedulerUrlCount() || GetRetryQueueUrlCount()) {
+    event_base_loop(GetLibEventBase(), EVLOOP_ONCE);
+    DispatchLibEvent();
+  }
+
+  assert(!g_inflight_request_count);
+}
+
+void* RunWorker(void* context) {
+  assert(context);
+  Worker* worker = (Worker*)context;
+
+  g_current_worker = worker;
+  InitInflightLimit();
+
+  g_politeness_timer = evtimer_new(GetLibEventBase(), OnPolitenessTimer, NULL);
+  assert(g_politeness_timer);
+  g_retry_timer = evtimer_new(GetLibEventBase(), OnRetryTimer, NULL);
+  assert(g_retry_timer);
+
+  // watch inbox in event loop (as well as requests)
+  struct event* notify_event =
+      event_new(GetLibEventBase(), worker->notify_fds[0], EV_READ | EV_PERSIST,
+                OnWorkerNotify, worker);
+  assert(notify_event);
+  event_add(notify_event, NULL);
+
+  // io_uring may be unsupported by kernel
+  if (GetTransportType() != g_worker_transport_type)
+    fprintf(stderr, "worker %lu: io_uring unavailable, use libevent\n",
+            (size_t)(worker - g_workers));
+
+  while (WaitInbox(worker)) {
+    ProcessInbox(worker);
+    DispatchRequests();
+  }
+
+  fprintf(stderr, "worker %lu: in-flight limit %lu\n",
+          (size_t)(worker - g_workers), GetAimdLimit(&g_inflight_limiter));
+
+  event_free(g_politeness_timer);
+  event_free(g_retry_timer);
+  event_free(notify_event);
+  FreeLibEvent();
+  return NULL;
+}
+
+void StartWorkers(size_t worker_count) {
+  assert(worker_count);
+
+  g_workers = (Worker*)malloc(sizeof(Worker) * worker_count);
+  assert(g_workers);
+  g_worker_count = worker_count;
+
+  // init all inboxes before any worker posts urls
+  for (size_t i = 0; i < worker_count; ++i) {
+    Worker* worker = &g_workers[i];
+
+    pthread_mutex_init(&worker->inbox_lock, NULL);
+    pthread_cond_init(&worker->inbox_cond, NULL);
+    TAILQ_INIT(&worker->inbox);
+    worker->is_done = 0;
+
+    int result = pipe(worker->notify_fds);
+    assert(result == 0);
+    (void)(result);
+    evutil_make_socket_nonblocking(worker->notify_fds[0]);
+    evutil_make_socket_nonblocking(worker->notify_fds[1]);
+  }
+
+  for (size_t i = 0; i < worker_count; ++i) {
+    int result =
+        pthread_create(&g_workers[i].thread, NULL, RunWorker, &g_workers[i]);
+    assert(result == 0);
+    (void)(result);
+  }
+}
+
+void JoinWorkers() {
+  for (size_t i = 0; i < g_worker_count; ++i) {
+    Worker* worker = &g_workers[i];
+    pthread_join(worker->thread, NULL);
+
+    pthread_mutex_destroy(&worker->inbox_lock);
+    pthread_cond_destroy(&worker->inbox_cond);
+    close(worker->notify_fds[0]);
+    close(worker->notify_fds[1]);
+  }
+
+  free((void*)g_workers);
+  g_workers = NULL;
+  g_worker_count = 0;
 }
 
 void YieldUrlConnectionIndexCallback(const char* url,
@@ -141,62 +795,316 @@ void YieldUrlConnectionPairCallback(size_t src, size_t dst, void* context) {
   fprintf(output_file, "%-6lu %lu\n", src, dst);
 }
 
+// named options of command line (also index of their values)
+typedef enum {
+  Option_Output,
+  Option_Timeout,
+  Option_Workers,
+  Option_Transport,
+  Option_Max_Requests,
+  Option_Host_Delay,
+  Option_Host_Max_Requests,
+  Option_Max_Retries,
+  Option_Min_Timeout,
+  Option_Max_Timeout,
+  Option_Max_Body_Size,
+  Option_Http2,
+  Option_Cache_File,
+  Option_Insecure,
+  Option_Help,
+  Option_Count,
+} CrawlerOption;
+
+const struct option g_crawler_options[] = {
+    {"output", required_argument, NULL, Option_Output},
+    {"timeout", required_argument, NULL, Option_Timeout},
+    {"workers", required_argument, NULL, Option_Workers},
+    {"transport", required_argument, NULL, Option_Transport},
+    {"max-requests", required_argument, NULL, Option_Max_Requests},
+    {"host-delay", required_argument, NULL, Option_Host_Delay},
+    {"host-max-requests", required_argument, NULL, Option_Host_Max_Requests},
+    {"max-retries", required_argument, NULL, Option_Max_Retries},
+    {"min-timeout", required_argument, NULL, Option_Min_Timeout},
+    {"max-timeout", required_argument, NULL, Option_Max_Timeout},
+    {"max-body-size", required_argument, NULL, Option_Max_Body_Size},
+    {"http2", required_argument, NULL, Option_Http2},
+    {"cache-file", required_argument, NULL, Option_Cache_File},
+    {"insecure", no_argument, NULL, Option_Insecure},
+    {"help", no_argument, NULL, Option_Help},
+    {NULL, 0, NULL, 0},
+};
+
+void PrintUsage(FILE* file) {
+  fprintf(file,
+          "usage: ./crawler [OPTION]... URL\n"
+          "  --output=FILE          write crawled urls and links to FILE "
+          "(default stdout)\n"
+          "  --timeout=MS           connect/send/recv timeout before rtt "
+          "is measured\n"
+          "  --workers=N            worker threads (1 ~ %d, default 1)\n"
+          "  --transport=NAME       libevent (default) or io_uring\n"
+          "  --max-requests=N       in-flight requests of all workers "
+          "(by RLIMIT_NOFILE)\n"
+          "  --host-delay=MS        delay between requests to a host "
+          "(default 0)\n"
+          "  --host-max-requests=N  in-flight requests per host "
+          "(default 8)\n"
+          "  --max-retries=N        retries of each url failed transiently "
+          "(default 3)\n"
+          "  --min-timeout=MS       range of timeouts adapted by rtt of "
+          "each host\n"
+          "  --max-timeout=MS       (default 1000 ~ 30000)\n"
+          "  --max-body-size=BYTES  size limit of page body "
+          "(default 64MB)\n"
+          "  --http2=MODE           HTTP/2 by ALPN of https (tls, default), "
+          "also by\n"
+          "                         prior knowledge of http (h2c), or never "
+          "(off)\n"
+          "  --cache-file=FILE      revalidate pages of the last crawl "
+          "saved in FILE,\n"
+          "                         and save pages of this crawl to it\n"
+          "  --insecure             accept any certificate of https hosts\n"
+          "                         (e.g. self-signed)\n",
+          MAX_WORKER_COUNT);
+}
+
+// parse given value of |option| in |options| as decimal number,
+// or return 0 if invalid
+unsigned char ParseOptionNumber(const char* const* options,
+                                CrawlerOption option,
+                                unsigned long* number) {
+  assert(options);
+  assert(options[option]);
+  assert(number);
+
+  const char* value = options[option];
+  char* end = NULL;
+  *number = strtoul(value, &end, 10);
+  if (!isdigit((unsigned char)*value) || *end) {
+    fprintf(stderr, "invalid --%s: %s (not a number)\n",
+            g_crawler_options[option].name, value);
+    return 0;
+  }
+  return 1;
+}
+
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
-    fprintf(stderr, "usage: ./crawler URL [OUTPUT_FILE]\n");
+  // values of options (NULL if not given, empty if given without value)
+  const char* options[Option_Count] = {NULL};
+  int option = 0;
+  while ((option = getopt_long(argc, argv, "", g_crawler_options, NULL)) !=
+         -1) {
+    if (option < 0 || option >= Option_Count || option == Option_Help) {
+      PrintUsage(option == Option_Help ? stdout : stderr);
+      return option == Option_Help ? 0 : 1;
+    }
+    options[option] = optarg ? optarg : "";
+  }
+
+  // take the only non-option argument as url to start from
+  if (optind != argc - 1) {
+    PrintUsage(stderr);
     return 1;
   }
+  const char* start_url = argv[optind];
 
-  TAILQ_INIT(&g_pending_request_queue);
+  unsigned long number = 0;
 
-  g_handled_url_set = CreateBloomFilter(HANDLED_URL_SET_SIZE);
-  assert(g_handled_url_set);
+  // use --timeout as connect/send/recv timeout if given (0 for default)
+  if (options[Option_Timeout]) {
+    if (!ParseOptionNumber(options, Option_Timeout, &number))
+      return 1;
+    if (number)
+      SetRequestTimeout((unsigned)number, (unsigned)number, (unsigned)number);
+  }
 
-  // use |argv[1]| to start crawl tasks
-  ProcessUrl(argv[1], NULL);
+  // use --workers as count of worker threads if given
+  size_t worker_count = 1;
+  if (options[Option_Workers]) {
+    if (!ParseOptionNumber(options, Option_Workers, &number))
+      return 1;
+    worker_count = (size_t)number;
+    if (!worker_count || worker_count > MAX_WORKER_COUNT) {
+      fprintf(stderr, "invalid --workers: %s (1 ~ %d)\n",
+              options[Option_Workers], MAX_WORKER_COUNT);
+      return 1;
+    }
+  }
 
-  // record how-many pending request in previous round
-  static size_t previous_pending_request_count = 0;
+  // use --transport if given (libevent by default)
+  if (options[Option_Transport]) {
+    if (!strcmp(options[Option_Transport], "io_uring")) {
+      g_worker_transport_type = Transport_Io_Uring;
+    } else if (strcmp(options[Option_Transport], "libevent")) {
+      fprintf(stderr, "invalid --transport: %s (libevent or io_uring)\n",
+              options[Option_Transport]);
+      return 1;
+    }
+    SetTransportType(g_worker_transport_type);
+  }
 
-  while (1) {
-    // dispatch crawl tasks
-    DispatchLibEvent();
+  // use --max-requests as max count of in-flight requests if given (0 for
+  // default), or keep fd usage under RLIMIT_NOFILE (shared by all workers)
+  size_t max_request_count = GetDefaultMaxRequestCount(worker_count);
+  if (options[Option_Max_Requests]) {
+    if (!ParseOptionNumber(options, Option_Max_Requests, &number))
+      return 1;
+    if (number) {
+      max_request_count = (size_t)number;
+      if (max_request_count < worker_count) {
+        fprintf(stderr, "invalid --max-requests: %s (at least --workers)\n",
+                options[Option_Max_Requests]);
+        return 1;
+      }
+    }
+  }
+  SetMaxInflightRequestCount(max_request_count / worker_count);
 
-    // break if
-    // - there is no pending request
-    // - remaining pending requests are the same as in previous round
-    if (TAILQ_EMPTY(&g_pending_request_queue) ||
-        previous_pending_request_count == g_pending_request_count)
-      break;
+  // use --host-delay as delay between requests to the same host if given
+  if (options[Option_Host_Delay]) {
+    if (!ParseOptionNumber(options, Option_Host_Delay, &number))
+      return 1;
+    SetHostDelay((unsigned)number);
+  }
 
-    // record |previous_pending_request_count|
-    previous_pending_request_count = g_pending_request_count;
+  // use --host-max-requests as max in-flight requests per host if given
+  if (options[Option_Host_Max_Requests]) {
+    if (!ParseOptionNumber(options, Option_Host_Max_Requests, &number))
+      return 1;
+    if (!number) {
+      fprintf(stderr, "invalid --host-max-requests: %s (at least 1)\n",
+              options[Option_Host_Max_Requests]);
+      return 1;
+    }
+    SetHostMaxInflight((size_t)number);
+  }
 
-    // reset flag |g_is_fd_reach_limits|
-    g_is_fd_reach_limits = 0;
+  // use --output as output file if given (stdout by default)
+  FILE* output_file = stdout;
+  if (options[Option_Output]) {
+    output_file = fopen(options[Option_Output], "w");
+    if (!output_file) {
+      fprintf(stderr, "invalid --output: %s (failed to open)\n",
+              options[Option_Output]);
+      return 1;
+    }
+  }
 
-    // try start pending requests if not |g_is_fd_reach_limits|
-    while (!TAILQ_EMPTY(&g_pending_request_queue) && !g_is_fd_reach_limits) {
-      struct PendingRequest* request = TAILQ_FIRST(&g_pending_request_queue);
-      TAILQ_REMOVE(&g_pending_request_queue, request, _entries);
-      --g_pending_request_count;
+  // use --max-retries as max retries of each url if given (0 for no retry)
+  if (options[Option_Max_Retries]) {
+    if (!ParseOptionNumber(options, Option_Max_Retries, &number))
+      return 1;
+    SetRetryBudget((unsigned)number);
+  }
 
-      // update flag |g_is_fd_reach_limits| here
-      Request(request->url, RequestCallback, NULL);
+  // use --min-timeout and --max-timeout as range of timeouts adapted by
+  // rtt of each host if given (0 for default)
+  if (options[Option_Min_Timeout] || options[Option_Max_Timeout]) {
+    unsigned min_timeout_ms = 0, max_timeout_ms = 0;
+    if (options[Option_Min_Timeout]) {
+      if (!ParseOptionNumber(options, Option_Min_Timeout, &number))
+        return 1;
+      min_timeout_ms = (unsigned)number;
+    }
+    if (options[Option_Max_Timeout]) {
+      if (!ParseOptionNumber(options, Option_Max_Timeout, &number))
+        return 1;
+      max_timeout_ms = (unsigned)number;
+    }
+    if (!SetRequestTimeoutRange(min_timeout_ms, max_timeout_ms)) {
+      fprintf(stderr, "invalid --min-timeout: %u (at most --max-timeout)\n",
+              min_timeout_ms);
+      return 1;
+    }
+  }
 
-      free((void*)request->url);
-      free((void*)request);
+  // use --max-body-size as size limit of page body in bytes if given
+  // (0 for default)
+  if (options[Option_Max_Body_Size]) {
+    if (!ParseOptionNumber(options, Option_Max_Body_Size, &number))
+      return 1;
+    SetRequestMaxBodySize((size_t)number);
+  }
+
+  // use --http2 as when to use HTTP/2 if given (by ALPN of https by
+  // default, or also by prior knowledge of http)
+  if (options[Option_Http2]) {
+    if (!strcmp(options[Option_Http2], "off")) {
+      SetRequestHttp2Mode(Http2_Off);
+    } else if (!strcmp(options[Option_Http2], "h2c")) {
+      SetRequestHttp2Mode(Http2_Prior_Knowledge);
+    } else if (strcmp(options[Option_Http2], "tls")) {
+      fprintf(stderr, "invalid --http2: %s (off, tls or h2c)\n",
+              options[Option_Http2]);
+      return 1;
     }
   }
 
-  FreeLibEvent();
+  // use --cache-file as page cache file if given, to revalidate pages
+  // fetched by the last crawl, and save pages of this crawl to it
+  if (options[Option_Cache_File]) {
+    g_page_cache_path = options[Option_Cache_File];
+    if (!LoadPageCache(g_page_cache_path)) {
+      fprintf(stderr, "invalid --cache-file: %s (failed to read)\n",
+              g_page_cache_path);
+      return 1;
+    }
+  }
+
+  // verify certificates of https hosts unless --insecure is given
+  SetTransportTlsVerify(!options[Option_Insecure]);
+
+  // don't raise SIGPIPE if peer closed, since openssl writes sockets
+  // without MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
+
+  g_handled_url_set = CreateBloomFilter(HANDLED_URL_SET_SIZE);
+  assert(g_handled_url_set);
+
+  StartWorkers(worker_count);
+
+  // use |start_url| to start crawl tasks
+  // (hold an unfinished count, in case |start_url| is ignored)
+  __sync_add_and_fetch(&g_unfinished_url_count, 1);
+  ProcessUrl(start_url, NULL);
+  FinishUrl();
+
+  // wait for all workers quiting
+  JoinWorkers();
+
   FreeBloomFilter(g_handled_url_set);
   AssertBloomFilterNoLeak();
 
-  // discard remaining requests in |g_pending_request_queue|
+  // report dns cache efficiency
+  size_t dns_hit_count = 0, dns_miss_count = 0;
+  GetDnsCacheStats(&dns_hit_count, &dns_miss_count);
+  fprintf(stderr, "dns cache: %lu hits, %lu misses\n", dns_hit_count,
+          dns_miss_count);
+
+  // report tls session resumption
+  size_t tls_resumed_count = 0, tls_full_count = 0;
+  GetTlsSessionCacheStats(&tls_resumed_count, &tls_full_count);
+  if (tls_resumed_count || tls_full_count)
+    fprintf(stderr, "tls sessions: %lu resumed, %lu full handshakes\n",
+            tls_resumed_count, tls_full_count);
 
-  // use output_file if exists
-  FILE* output_file = argc >= 3 ? fopen(argv[2], "w") : stdout;
+  // report multiplexing of HTTP/2
+  size_t http2_session_count = 0, http2_stream_count = 0;
+  GetHttp2SessionStats(&http2_session_count, &http2_stream_count);
+  if (http2_session_count)
+    fprintf(stderr, "http2: %lu streams on %lu sessions\n",
+            http2_stream_count, http2_session_count);
+
+  // save page cache and report revalidation
+  if (g_page_cache_path) {
+    if (!SavePageCache(g_page_cache_path))
+      fprintf(stderr, "failed to save page cache %s\n", g_page_cache_path);
+
+    size_t not_modified_count = 0, fetched_count = 0;
+    GetPageCacheStats(&not_modified_count, &fetched_count);
+    fprintf(stderr, "page cache: %lu not modified, %lu fetched\n",
+            not_modified_count, fetched_count);
+  }
 
   // output results
   YieldUrlConnectionIndex(YieldUrlConnectionIndexCallback, output_file);
@@ -0,0 +1,117 @@
+// Process-wide host -> address cache
+//   by BOT Man & ZhangHan, 2018
+
+#include "dns_cache.h"
+
+#include <assert.h>
+#include <time.h>
+
+// use C++ string & map to store host mapping
+#include <map>
+#include <string>
+
+// use C++ mutex to share cache between threads
+#include <mutex>
+
+#define DNS_CACHE_TTL_SEC 300
+#define DNS_CACHE_BAD_HOST_TTL_SEC 60
+#define DNS_CACHE_MAX_HOST_COUNT 100000
+
+struct DnsCacheEntry {
+  time_t expire_time;
+
+  // empty for cached resolving failure
+  HostAddrList addr_list;
+};
+
+// host -> cached entry
+typedef std::map<std::string, DnsCacheEntry> DnsCacheMap;
+
+DnsCacheMap& g_dns_cache_map() {
+  static DnsCacheMap dns_cache_map;
+  return dns_cache_map;
+}
+
+// guard |g_dns_cache_map| and stats below
+std::mutex& g_dns_cache_lock() {
+  static std::mutex dns_cache_lock;
+  return dns_cache_lock;
+}
+
+size_t g_dns_cache_hit_count;
+size_t g_dns_cache_miss_count;
+
+void InsertEntry(const char* host, const DnsCacheEntry& entry) {
+  assert(host);
+  time_t now = time(NULL);
+
+  // drop expired entries if reach limits, or any entry if still full
+  if (g_dns_cache_map().size() >= DNS_CACHE_MAX_HOST_COUNT) {
+    for (DnsCacheMap::iterator iter = g_dns_cache_map().begin();
+         iter != g_dns_cache_map().end();) {
+      if (iter->second.expire_time <= now)
+        g_dns_cache_map().erase(iter++);
+      else
+        ++iter;
+    }
+  }
+  if (g_dns_cache_map().size() >= DNS_CACHE_MAX_HOST_COUNT)
+    g_dns_cache_map().erase(g_dns_cache_map().begin());
+
+  g_dns_cache_map()[host] = entry;
+}
+
+DnsCacheResult DnsCacheLookup(const char* host, HostAddrList* addr_list) {
+  assert(host);
+  assert(addr_list);
+  std::lock_guard<std::mutex> lock(g_dns_cache_lock());
+
+  DnsCacheMap::iterator iter = g_dns_cache_map().find(host);
+  if (iter == g_dns_cache_map().end()) {
+    ++g_dns_cache_miss_count;
+    return Dns_Cache_Miss;
+  }
+
+  if (iter->second.expire_time <= time(NULL)) {
+    g_dns_cache_map().erase(iter);
+    ++g_dns_cache_miss_count;
+    return Dns_Cache_Miss;
+  }
+
+  ++g_dns_cache_hit_count;
+  if (!iter->second.addr_list.count)
+    return Dns_Cache_Bad_Host;
+
+  *addr_list = iter->second.addr_list;
+  return Dns_Cache_Hit;
+}
+
+void DnsCacheAdd(const char* host, const HostAddrList* addr_list) {
+  assert(addr_list);
+  assert(addr_list->count);
+
+  DnsCacheEntry entry;
+  entry.expire_time = time(NULL) + DNS_CACHE_TTL_SEC;
+  entry.addr_list = *addr_list;
+
+  std::lock_guard<std::mutex> lock(g_dns_cache_lock());
+  InsertEntry(host, entry);
+}
+
+void DnsCacheAddBadHost(const char* host) {
+  DnsCacheEntry entry;
+  entry.expire_time = time(NULL) + DNS_CACHE_BAD_HOST_TTL_SEC;
+  entry.addr_list.count = 0;
+
+  std::lock_guard<std::mutex> lock(g_dns_cache_lock());
+  InsertEntry(host, entry);
+}
+
+void GetDnsCacheStats(size_t* hit_count, size_t* miss_count) {
+  std::lock_guard<std::mutex> lock(g_dns_cache_lock());
+
+  if (hit_count)
+    *hit_count = g_dns_cache_hit_count;
+  if (miss_count)
+    *miss_count = g_dns_cache_miss_count;
+}
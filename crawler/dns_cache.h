@@ -0,0 +1,41 @@
+// Process-wide host -> address cache
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef DNS_CACHE
+#define DNS_CACHE
+
+#include <stddef.h>
+
+// For sockaddr_storage
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HOST_ADDR_LIST_SIZE 8
+
+typedef struct {
+  size_t count;
+  socklen_t addr_lens[HOST_ADDR_LIST_SIZE];
+  struct sockaddr_storage addrs[HOST_ADDR_LIST_SIZE];
+} HostAddrList;
+
+typedef enum {
+  Dns_Cache_Miss,      // not cached or expired
+  Dns_Cache_Hit,       // |addr_list| is filled
+  Dns_Cache_Bad_Host,  // cached resolving failure
+} DnsCacheResult;
+
+DnsCacheResult DnsCacheLookup(const char* host, HostAddrList* addr_list);
+
+void DnsCacheAdd(const char* host, const HostAddrList* addr_list);
+void DnsCacheAddBadHost(const char* host);
+
+void GetDnsCacheStats(size_t* hit_count, size_t* miss_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // DNS_CACHE
@@ -0,0 +1,250 @@
+// Per-host politeness scheduler
+//   by BOT Man & ZhangHan, 2018
+
+#include "host_scheduler.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// use C++ string, deque, map & priority_queue to store back queues
+#include <deque>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define DEFAULT_HOST_DELAY_MS 0
+#define DEFAULT_HOST_MAX_INFLIGHT 8
+#define HOST_FAILURE_THRESHOLD 3  // consecutive failures to open circuit
+#define HOST_INITIAL_BACKOFF_MS 1000
+#define HOST_MAX_TRIP_COUNT 5  // drop urls of host after that
+
+// back queue of one host
+struct HostQueue {
+  std::deque<std::string> urls;
+  size_t inflight_count = 0;
+
+  // allowed time to start next request
+  unsigned long long next_fetch_ms = 0;
+
+  // in |g_host_heap| iff it has urls and free in-flight slots
+  // (with key |next_fetch_ms| or an earlier one)
+  bool is_in_heap = false;
+
+  // circuit breaker: consecutive failures while closed, backoff of
+  // last trip (0 if closed), and whether a probe request is in flight
+  size_t failure_count = 0;
+  size_t trip_count = 0;
+  unsigned backoff_ms = 0;
+  bool is_probing = false;
+  bool is_dead = false;
+};
+
+// host -> back queue of host
+typedef std::map<std::string, HostQueue> HostQueueMap;
+
+// (next fetch time, host) with the earliest on top
+typedef std::pair<unsigned long long, HostQueueMap::iterator> HostHeapEntry;
+
+struct HostHeapEntryGreater {
+  bool operator()(const HostHeapEntry& lhs, const HostHeapEntry& rhs) const {
+    return lhs.first > rhs.first;
+  }
+};
+
+typedef std::priority_queue<HostHeapEntry,
+                            std::vector<HostHeapEntry>,
+                            HostHeapEntryGreater>
+    HostHeap;
+
+// politeness settings (shared by all threads)
+unsigned g_host_delay_ms = DEFAULT_HOST_DELAY_MS;
+size_t g_host_max_inflight = DEFAULT_HOST_MAX_INFLIGHT;
+
+// back queues are per thread, since hosts are routed to threads
+
+HostQueueMap& g_host_queue_map() {
+  static thread_local HostQueueMap host_queue_map;
+  return host_queue_map;
+}
+
+HostHeap& g_host_heap() {
+  static thread_local HostHeap host_heap;
+  return host_heap;
+}
+
+size_t& g_host_url_count() {
+  static thread_local size_t host_url_count = 0;
+  return host_url_count;
+}
+
+// only one probe request at once if circuit is not closed
+// (no limit if host is down, since its urls are dropped)
+bool IsHostFull(const HostQueue& queue) {
+  if (queue.is_dead)
+    return false;
+  size_t max_inflight = queue.backoff_ms ? 1 : g_host_max_inflight;
+  return queue.inflight_count >= max_inflight;
+}
+
+// push |iter| into heap if it can start a request
+void ScheduleHost(HostQueueMap::iterator iter) {
+  HostQueue& queue = iter->second;
+  if (queue.is_in_heap || queue.urls.empty() || IsHostFull(queue))
+    return;
+
+  queue.is_in_heap = true;
+  g_host_heap().push(std::make_pair(queue.next_fetch_ms, iter));
+}
+
+void SetHostDelay(unsigned delay_ms) {
+  g_host_delay_ms = delay_ms;
+}
+
+void SetHostMaxInflight(size_t max_inflight_per_host) {
+  assert(max_inflight_per_host);
+  g_host_max_inflight = max_inflight_per_host;
+}
+
+void HostSchedulerPush(const char* host,
+                       const char* url,
+                       unsigned char is_retry) {
+  assert(host);
+  assert(url);
+
+  HostQueueMap::iterator iter =
+      g_host_queue_map().insert(std::make_pair(host, HostQueue())).first;
+  if (is_retry)
+    iter->second.urls.push_front(url);
+  else
+    iter->second.urls.push_back(url);
+  ++g_host_url_count();
+
+  ScheduleHost(iter);
+}
+
+// open circuit of |queue| for doubled backoff (or drop its urls)
+void TripHost(HostQueue& queue, unsigned long long now_ms) {
+  queue.failure_count = 0;
+  queue.is_probing = false;
+
+  if (++queue.trip_count > HOST_MAX_TRIP_COUNT) {
+    queue.is_dead = true;
+    return;
+  }
+
+  queue.backoff_ms =
+      queue.backoff_ms ? queue.backoff_ms * 2 : HOST_INITIAL_BACKOFF_MS;
+  if (queue.next_fetch_ms < now_ms + queue.backoff_ms)
+    queue.next_fetch_ms = now_ms + queue.backoff_ms;
+}
+
+void CloseHostCircuit(HostQueue& queue) {
+  queue.failure_count = 0;
+  queue.trip_count = 0;
+  queue.backoff_ms = 0;
+  queue.is_probing = false;
+}
+
+char* HostSchedulerPop(unsigned long long now_ms,
+                       long long* wait_ms,
+                       unsigned char* is_dropped) {
+  assert(wait_ms);
+  assert(is_dropped);
+
+  HostHeap& heap = g_host_heap();
+  HostQueueMap::iterator iter;
+  while (1) {
+    if (heap.empty()) {
+      *wait_ms = -1;
+      return NULL;
+    }
+
+    // circuit opened while in heap: wait for in-flight requests,
+    // and re-key host by its backoff
+    iter = heap.top().second;
+    if (IsHostFull(iter->second)) {
+      heap.pop();
+      iter->second.is_in_heap = false;
+      continue;
+    }
+    if (heap.top().first < iter->second.next_fetch_ms &&
+        !iter->second.is_dead) {
+      heap.pop();
+      heap.push(std::make_pair(iter->second.next_fetch_ms, iter));
+      continue;
+    }
+
+    if (heap.top().first > now_ms && !iter->second.is_dead) {
+      *wait_ms = (long long)(heap.top().first - now_ms);
+      return NULL;
+    }
+    heap.pop();
+    break;
+  }
+
+  HostQueue& queue = iter->second;
+  assert(queue.is_in_heap && !queue.urls.empty());
+  queue.is_in_heap = false;
+
+  const std::string& url = queue.urls.front();
+  char* ret = (char*)malloc(url.size() + 1);
+  assert(ret);
+  memcpy(ret, url.c_str(), url.size() + 1);
+  queue.urls.pop_front();
+  --g_host_url_count();
+
+  *wait_ms = 0;
+  *is_dropped = queue.is_dead;
+  if (!queue.is_dead) {
+    ++queue.inflight_count;
+    queue.next_fetch_ms = now_ms + g_host_delay_ms;
+    if (queue.backoff_ms)
+      queue.is_probing = true;
+  }
+
+  ScheduleHost(iter);
+  return ret;
+}
+
+void HostSchedulerDone(const char* host,
+                       HostFetchResult result,
+                       unsigned long long now_ms) {
+  assert(host);
+
+  HostQueueMap::iterator iter = g_host_queue_map().find(host);
+  assert(iter != g_host_queue_map().end());
+  if (iter == g_host_queue_map().end())
+    return;
+
+  HostQueue& queue = iter->second;
+  assert(queue.inflight_count);
+  --queue.inflight_count;
+
+  if (result == Host_Fetch_Responded) {
+    CloseHostCircuit(queue);
+  } else if (result == Host_Fetch_Conn_Failed && !queue.is_dead) {
+    // count failures only while closed (ignore requests started before
+    // last trip), or trip again if probe failed
+    if (queue.is_probing ||
+        (!queue.backoff_ms &&
+         ++queue.failure_count >= HOST_FAILURE_THRESHOLD))
+      TripHost(queue, now_ms);
+  }
+
+  // forget idle host after its delay (unless circuit is not closed)
+  if (queue.urls.empty() && !queue.inflight_count && !queue.backoff_ms &&
+      !queue.is_dead && queue.next_fetch_ms <= now_ms) {
+    g_host_queue_map().erase(iter);
+    return;
+  }
+
+  ScheduleHost(iter);
+}
+
+size_t GetHostSchedulerUrlCount() {
+  return g_host_url_count();
+}
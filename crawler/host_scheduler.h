@@ -0,0 +1,57 @@
+// Per-host politeness scheduler
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef HOST_SCHEDULER
+#define HOST_SCHEDULER
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// urls wait in per-host back queues (like Mercator), and hosts are
+// popped from a min-heap keyed on their next allowed fetch time;
+// queues are per thread (hosts are routed to threads)
+
+// circuit breaker of each host: after consecutive connection failures,
+// park its urls with exponential backoff, then probe it by one request;
+// drop its urls if it keeps failing
+
+typedef enum {
+  Host_Fetch_Responded,    // host responded (or connected at least)
+  Host_Fetch_Conn_Failed,  // failed to connect host (refused or timeout)
+  Host_Fetch_Not_Tried,    // failed before connecting host
+} HostFetchResult;
+
+// set delay between starting requests to the same host (0 by default),
+// and max in-flight requests per host (8 by default)
+// (call before any thread schedules urls)
+void SetHostDelay(unsigned delay_ms);
+void SetHostMaxInflight(size_t max_inflight_per_host);
+
+// queue |url| to |host| (at front if |is_retry|)
+void HostSchedulerPush(const char* host,
+                       const char* url,
+                       unsigned char is_retry);
+
+// pop a url (free it by caller) whose host is allowed to fetch at |now_ms|
+// (set |is_dropped| if its host is down, don't fetch it),
+// or return NULL and set |wait_ms| to time until the next host is allowed
+// (-1 if all hosts with queued urls reach max in-flight requests)
+char* HostSchedulerPop(unsigned long long now_ms,
+                       long long* wait_ms,
+                       unsigned char* is_dropped);
+
+// request to |host| (popped before) finished with |result|
+void HostSchedulerDone(const char* host,
+                       HostFetchResult result,
+                       unsigned long long now_ms);
+
+size_t GetHostSchedulerUrlCount();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // HOST_SCHEDULER
@@ -4,19 +4,81 @@
 
 #include "html_parser.h"
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "string_helper.h"
+#define URL_BUFFER_SIZE 256
+#define URL_MAX_LEN (64 * 1024)
+
+void InitAtagParser(AtagParser* parser) {
+  assert(parser);
+  memset(parser, 0, sizeof(AtagParser));
+}
+
+void FreeAtagParser(AtagParser* parser) {
+  assert(parser);
+
+  if (parser->url)
+    free((void*)parser->url);
+  InitAtagParser(parser);
+}
+
+// append [beg, end) to |url| of |parser|
+void AppendUrl(AtagParser* parser, const char* beg, const char* end) {
+  size_t len = (size_t)(end - beg);
+  if (!len || parser->is_url_overflow)
+    return;
+
+  if (parser->url_len + len > URL_MAX_LEN) {
+    parser->is_url_overflow = 1;
+    return;
+  }
+
+  if (parser->url_cap - parser->url_len < len) {
+    size_t new_cap = parser->url_cap ? parser->url_cap : URL_BUFFER_SIZE;
+    while (new_cap - parser->url_len < len)
+      new_cap *= 2;
+
+    // reserve 1 more byte to make |url| C-style string
+    char* new_url = (char*)realloc(parser->url, new_cap + 1);
+    if (!new_url) {
+      parser->is_url_overflow = 1;
+      return;
+    }
+
+    parser->url = new_url;
+    parser->url_cap = new_cap;
+  }
+
+  memcpy(parser->url + parser->url_len, beg, len);
+  parser->url_len += len;
+}
 
 void ParseAtagUrls(const char* html,
                    yeild_atag_urls_callback_fn callback,
                    void* context) {
-  int state = 0;
-  const char* url_beg = NULL;
-  const char* url_end = NULL;
+  AtagParser parser;
+  InitAtagParser(&parser);
+  ParseAtagUrlsPartial(&parser, html, strlen(html), callback, context);
+  FreeAtagParser(&parser);
+}
+
+void ParseAtagUrlsPartial(AtagParser* parser,
+                          const char* html,
+                          size_t len,
+                          yeild_atag_urls_callback_fn callback,
+                          void* context) {
+  assert(parser);
+  assert(html || !len);
+
+  int state = parser->state;
+  const char* end = html + len;
 
-  for (const char* p = html; *p != '\0'; p++) {
+  // url continues from previous piece of html
+  const char* url_beg = state == 9 ? html : NULL;
+
+  for (const char* p = html; p < end; p++) {
     switch (state) {
       case 0:
         if (*p == '<')
@@ -100,6 +162,8 @@ void ParseAtagUrls(const char* html,
         if (*p == '"') {
           state = 9;
           url_beg = p + 1;
+          parser->url_len = 0;
+          parser->is_url_overflow = 0;
         } else if (*p == 'h')
           state = 4;
         else if (*p == '>')
@@ -113,7 +177,8 @@ void ParseAtagUrls(const char* html,
       case 9:
         if (*p == '"') {
           state = 10;
-          url_end = p;
+          AppendUrl(parser, url_beg, p);
+          url_beg = NULL;
         } else
           state = 9;
         break;
@@ -121,30 +186,25 @@ void ParseAtagUrls(const char* html,
       case 10:
         if (*p == '>') {
           state = 0;
-
-          const char* first_space = strchr(url_beg, ' ');
-          if (first_space && first_space < url_end)
-              url_end = first_space;
-
-          const char* first_return = strchr(url_beg, '\r');
-          if (first_return && first_return < url_end)
-              url_end = first_return;
-
-          const char* first_newline = strchr(url_beg, '\n');
-          if (first_newline && first_newline < url_end)
-              url_end = first_newline;
-
-          char* url = CopyrString(url_beg, url_end);
-          if (url) {
-            callback(url, context);
-            free((void*)url);
+          if (parser->is_url_overflow)
+            break;
+
+          // url ends before the first space or newline
+          const char* url = "";
+          if (parser->url) {
+            parser->url[parser->url_len] = 0;
+            parser->url[strcspn(parser->url, " \r\n")] = 0;
+            url = parser->url;
           }
-
-          url_beg = NULL;
-          url_end = NULL;
+          callback(url, context);
         } else
           state = 10;
         break;
     }
   }
+
+  // keep url of unfinished <a> tag
+  if (state == 9)
+    AppendUrl(parser, url_beg, end);
+  parser->state = state;
 }
@@ -5,6 +5,8 @@
 #ifndef HTML_PARSER
 #define HTML_PARSER
 
+#include <stddef.h>
+
 // sync multi callback
 typedef void (*yeild_atag_urls_callback_fn)(const char* url, void* context);
 
@@ -12,4 +14,28 @@ void ParseAtagUrls(const char* html,
                    yeild_atag_urls_callback_fn callback,
                    void* context);
 
+typedef struct {
+  // dfa state
+  int state;
+
+  // url being parsed (may span several pieces of html)
+  char* url;
+  size_t url_len;
+  size_t url_cap;
+
+  // whether |url| is too long (dropped when parsed)
+  unsigned char is_url_overflow;
+} AtagParser;
+
+void InitAtagParser(AtagParser* parser);
+void FreeAtagParser(AtagParser* parser);
+
+// parse |len| bytes of html following the pieces fed before,
+// so urls are yielded as soon as their <a> tags are complete
+void ParseAtagUrlsPartial(AtagParser* parser,
+                          const char* html,
+                          size_t len,
+                          yeild_atag_urls_callback_fn callback,
+                          void* context);
+
 #endif  // HTML_PARSER
@@ -0,0 +1,790 @@
+// HTTP/2 client session multiplexing requests on one connection
+//   by BOT Man & ZhangHan, 2018
+
+#include "http2_session.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// For struct event (embedded in Http2Session)
+#include <event2/event_struct.h>
+// For nghttp2 functions
+#include <nghttp2/nghttp2.h>
+
+#include "conn_pool.h"
+#include "string_helper.h"
+#include "transport.h"
+
+#define RECV_BUFFER_SIZE 16384
+#define SEND_BATCH_SIZE 16384                // frames copied before sending
+#define STREAM_WINDOW_SIZE (1024 * 1024)      // of each stream
+#define CONN_WINDOW_SIZE (16 * 1024 * 1024)  // of all streams
+#define IDLE_TIMEOUT_MS 30000                // close session without streams
+
+#define SCHEME_HTTP "http"
+#define SCHEME_HTTPS "https"
+
+// response of a request, and its callbacks
+typedef struct _Http2Stream {
+  int32_t id;
+
+  // callback data
+  yeild_response_header_callback_fn header_callback;
+  http2_stream_callback_fn callback;
+  void* context;
+
+  // body data is recved (headers after it are trailers), and end of
+  // stream is recved (closing without it is a reset)
+  unsigned char has_data;
+  unsigned char is_ended;
+
+  // reset stream if nothing of it is recved within |timeout|,
+  // i.e. until |deadline| (extended when its frames are recved)
+  struct timeval timeout;
+  struct timeval deadline;
+
+  // siblings in |streams| of session
+  struct _Http2Stream* prev;
+  struct _Http2Stream* next;
+} Http2Stream;
+
+struct _Http2Session {
+  nghttp2_session* nghttp2;
+  evutil_socket_t fd;
+
+  // key in conn pool (if pooled), and :authority/:scheme of requests
+  char* conn_key;
+  char* authority;
+  unsigned char is_https;
+  unsigned char is_pooled;
+
+  // open streams (callbacks not done yet)
+  Http2Stream* streams;
+
+  // recv is always waited (for frames of peer), and send is waited
+  // while |send_buffer| isn't drained
+  TransportOp recv_op;
+  TransportOp send_op;
+  unsigned char is_recv_waiting;
+  unsigned char is_send_waiting;
+  char recv_buffer[RECV_BUFFER_SIZE];
+
+  // frames serialized by nghttp2, and length sent
+  // (kept until all sent, since io_uring may send it later)
+  char* send_buffer;
+  size_t send_len;
+  size_t send_cap;
+  size_t n_sent;
+
+  // send frames queued by callers in the next loop (never inside
+  // callbacks of nghttp2)
+  struct event flush_event;
+
+  // fire at the earliest deadline of |streams|
+  struct event deadline_event;
+
+  // timeout of waiting send (of the latest stream)
+  struct timeval timeout;
+
+  // time of the last data recved, and the last stream submitted or data
+  // recved
+  struct timeval recv_time;
+  struct timeval active_time;
+
+  // connection is closed, and count of its ops still pending
+  unsigned char is_closed;
+  size_t pending_op_count;
+
+  // siblings in |g_http2_sessions|
+  struct _Http2Session* prev;
+  struct _Http2Session* next;
+};
+
+// sessions of current thread (not closed yet)
+__thread Http2Session* g_http2_sessions;
+
+// closed sessions waiting for their pending operations
+__thread size_t g_http2_closing_session_count;
+
+// count of sessions and streams started (shared by all threads)
+size_t g_http2_session_total;
+size_t g_http2_stream_total;
+
+//
+// stream helpers
+//
+
+// unlink |stream| from |session|, and drop callbacks of nghttp2 to it
+void DetachHttp2Stream(Http2Session* session, Http2Stream* stream) {
+  assert(session);
+  assert(stream);
+
+  if (stream->prev)
+    stream->prev->next = stream->next;
+  else
+    session->streams = stream->next;
+  if (stream->next)
+    stream->next->prev = stream->prev;
+
+  if (session->nghttp2)
+    nghttp2_session_set_stream_user_data(session->nghttp2, stream->id, NULL);
+}
+
+// pass terminal |event| to |stream| of |session|, and free it
+void FinishHttp2Stream(Http2Session* session,
+                       Http2Stream* stream,
+                       Http2StreamEvent event) {
+  assert(session);
+  assert(stream);
+
+  DetachHttp2Stream(session, stream);
+  stream->callback(event, NULL, 0, stream->context);
+  free((void*)stream);
+}
+
+// reset |stream| of |session| (by callback returning 0), and free it
+void CancelHttp2Stream(Http2Session* session, Http2Stream* stream) {
+  assert(session);
+  assert(stream);
+
+  nghttp2_submit_rst_stream(session->nghttp2, NGHTTP2_FLAG_NONE, stream->id,
+                            NGHTTP2_CANCEL);
+  DetachHttp2Stream(session, stream);
+  free((void*)stream);
+}
+
+// pass |event| of |stream| to its callback, or cancel it if refused
+void YieldHttp2Stream(Http2Session* session,
+                      Http2Stream* stream,
+                      Http2StreamEvent event,
+                      const char* data,
+                      size_t len) {
+  assert(session);
+  assert(stream);
+
+  if (!stream->callback(event, data, len, stream->context))
+    CancelHttp2Stream(session, stream);
+}
+
+// extend deadline of |stream| of |session| since data is recved
+void RefreshHttp2StreamDeadline(Http2Session* session, Http2Stream* stream) {
+  assert(session);
+  assert(stream);
+
+  evutil_timeradd(&session->recv_time, &stream->timeout, &stream->deadline);
+}
+
+//
+// nghttp2 callbacks (|user_data| is session)
+//
+
+int OnHttp2Header(nghttp2_session* nghttp2,
+                  const nghttp2_frame* frame,
+                  const uint8_t* name,
+                  size_t name_len,
+                  const uint8_t* value,
+                  size_t value_len,
+                  uint8_t flags,
+                  void* user_data) {
+  (void)(flags);
+  (void)(user_data);
+
+  Http2Stream* stream = (Http2Stream*)nghttp2_session_get_stream_user_data(
+      nghttp2, frame->hd.stream_id);
+  if (frame->hd.type != NGHTTP2_HEADERS || !stream || stream->has_data)
+    return 0;
+
+  stream->header_callback((const char*)name, name_len, (const char*)value,
+                          value_len, stream->context);
+  return 0;
+}
+
+int OnHttp2FrameRecv(nghttp2_session* nghttp2,
+                     const nghttp2_frame* frame,
+                     void* user_data) {
+  assert(user_data);
+  Http2Session* session = (Http2Session*)user_data;
+
+  Http2Stream* stream = (Http2Stream*)nghttp2_session_get_stream_user_data(
+      nghttp2, frame->hd.stream_id);
+  if (!stream ||
+      (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA))
+    return 0;
+
+  // closed with NO_ERROR later
+  if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+    stream->is_ended = 1;
+  RefreshHttp2StreamDeadline(session, stream);
+
+  // a block of headers (several if informational) before body
+  if (frame->hd.type == NGHTTP2_HEADERS && !stream->has_data)
+    YieldHttp2Stream(session, stream, Http2_Stream_Headers, NULL, 0);
+  return 0;
+}
+
+int OnHttp2DataChunkRecv(nghttp2_session* nghttp2,
+                         uint8_t flags,
+                         int32_t stream_id,
+                         const uint8_t* data,
+                         size_t len,
+                         void* user_data) {
+  (void)(flags);
+  assert(user_data);
+  Http2Session* session = (Http2Session*)user_data;
+
+  Http2Stream* stream =
+      (Http2Stream*)nghttp2_session_get_stream_user_data(nghttp2, stream_id);
+  if (!stream)
+    return 0;
+
+  stream->has_data = 1;
+  RefreshHttp2StreamDeadline(session, stream);
+  YieldHttp2Stream(session, stream, Http2_Stream_Data, (const char*)data,
+                   len);
+  return 0;
+}
+
+int OnHttp2StreamClose(nghttp2_session* nghttp2,
+                       int32_t stream_id,
+                       uint32_t error_code,
+                       void* user_data) {
+  assert(user_data);
+  Http2Session* session = (Http2Session*)user_data;
+
+  Http2Stream* stream =
+      (Http2Stream*)nghttp2_session_get_stream_user_data(nghttp2, stream_id);
+  if (!stream)
+    return 0;
+
+  // streams above last id of GOAWAY are also refused
+  Http2StreamEvent event = Http2_Stream_Reset;
+  if (error_code == NGHTTP2_NO_ERROR && stream->is_ended)
+    event = Http2_Stream_Done;
+  else if (error_code == NGHTTP2_REFUSED_STREAM)
+    event = Http2_Stream_Refused;
+  FinishHttp2Stream(session, stream, event);
+  return 0;
+}
+
+nghttp2_session* CreateNghttp2Session(Http2Session* session) {
+  assert(session);
+
+  nghttp2_session_callbacks* callbacks = NULL;
+  if (nghttp2_session_callbacks_new(&callbacks))
+    return NULL;
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, OnHttp2Header);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+                                                       OnHttp2FrameRecv);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(
+      callbacks, OnHttp2DataChunkRecv);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+                                                         OnHttp2StreamClose);
+
+  nghttp2_session* ret = NULL;
+  int result = nghttp2_session_client_new(&ret, callbacks, session);
+  nghttp2_session_callbacks_del(callbacks);
+  if (result)
+    return NULL;
+
+  // no server push, and larger windows than 64KB to recv pages at once
+  nghttp2_settings_entry settings[] = {
+      {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+      {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, STREAM_WINDOW_SIZE},
+  };
+  if (nghttp2_submit_settings(ret, NGHTTP2_FLAG_NONE, settings,
+                              sizeof settings / sizeof settings[0]) ||
+      nghttp2_session_set_local_window_size(ret, NGHTTP2_FLAG_NONE, 0,
+                                            CONN_WINDOW_SIZE)) {
+    nghttp2_session_del(ret);
+    return NULL;
+  }
+  return ret;
+}
+
+//
+// session helpers
+//
+
+void FreeHttp2Session(Http2Session* session) {
+  assert(session);
+  assert(!session->streams);
+  assert(!session->pending_op_count);
+
+  if (session->nghttp2)
+    nghttp2_session_del(session->nghttp2);
+  if (session->send_buffer)
+    free((void*)session->send_buffer);
+  if (session->conn_key)
+    free((void*)session->conn_key);
+  if (session->authority)
+    free((void*)session->authority);
+  free((void*)session);
+}
+
+// close connection of |session| and fail its streams with |event|,
+// then free it (or when its pending operations are done)
+void CloseHttp2Session(Http2Session* session, Http2StreamEvent event) {
+  assert(session);
+  assert(!session->is_closed);
+
+  // stop accepting streams (of requests started by callbacks)
+  session->is_closed = 1;
+  if (session->is_pooled)
+    ConnPoolUnsetSession(session->conn_key, session);
+  if (session->prev)
+    session->prev->next = session->next;
+  else
+    g_http2_sessions = session->next;
+  if (session->next)
+    session->next->prev = session->prev;
+
+  // drop nghttp2 first, which never calls back streams then
+  nghttp2_session_del(session->nghttp2);
+  session->nghttp2 = NULL;
+  while (session->streams)
+    FinishHttp2Stream(session, session->streams, event);
+
+  event_del(&session->flush_event);
+  event_del(&session->deadline_event);
+  session->pending_op_count = TransportCancel(&session->recv_op) +
+                              TransportCancel(&session->send_op);
+  TransportClose(session->fd);
+
+  if (session->pending_op_count)
+    ++g_http2_closing_session_count;
+  else
+    FreeHttp2Session(session);
+}
+
+// pending operation of closed |session| is done, free it if it's the last
+void OnClosedHttp2SessionOp(Http2Session* session) {
+  assert(session);
+  assert(session->is_closed);
+  assert(session->pending_op_count);
+
+  if (--session->pending_op_count)
+    return;
+  --g_http2_closing_session_count;
+  FreeHttp2Session(session);
+}
+
+// elapsed milliseconds since |start| (by system time)
+long GetHttp2ElapsedMs(const struct timeval* start) {
+  assert(start);
+
+  struct timeval now, elapsed;
+  evutil_gettimeofday(&now, NULL);
+  evutil_timersub(&now, start, &elapsed);
+  return elapsed.tv_sec * 1000L + elapsed.tv_usec / 1000;
+}
+
+// wait for frames of peer (streams time out by their own deadlines)
+unsigned char WaitHttp2Recv(Http2Session* session) {
+  assert(session);
+
+  struct timeval idle_timeout = {IDLE_TIMEOUT_MS / 1000, 0};
+  session->is_recv_waiting =
+      TransportWaitRecv(&session->recv_op, session->recv_buffer,
+                        sizeof session->recv_buffer, &idle_timeout);
+  return session->is_recv_waiting;
+}
+
+// fire |deadline_event| at the earliest deadline of streams (if any)
+void ScheduleHttp2Deadline(Http2Session* session) {
+  assert(session);
+
+  const struct timeval* earliest = NULL;
+  for (Http2Stream* stream = session->streams; stream;
+       stream = stream->next) {
+    if (!earliest || evutil_timercmp(&stream->deadline, earliest, <))
+      earliest = &stream->deadline;
+  }
+  if (!earliest) {
+    event_del(&session->deadline_event);
+    return;
+  }
+
+  struct timeval now, delay = {0, 0};
+  evutil_gettimeofday(&now, NULL);
+  if (evutil_timercmp(earliest, &now, >))
+    evutil_timersub(earliest, &now, &delay);
+  evtimer_add(&session->deadline_event, &delay);
+}
+
+// copy frames serialized by nghttp2 into |send_buffer| (up to a batch),
+// or return 0 if failed
+unsigned char FillHttp2SendBuffer(Http2Session* session) {
+  assert(session);
+  assert(session->n_sent == session->send_len);
+
+  session->send_len = 0;
+  session->n_sent = 0;
+  while (session->send_len < SEND_BATCH_SIZE) {
+    const uint8_t* data = NULL;
+    ssize_t len = nghttp2_session_mem_send(session->nghttp2, &data);
+    if (len < 0)
+      return 0;
+    if (!len)
+      break;
+
+    if (session->send_len + (size_t)len > session->send_cap) {
+      size_t new_cap = session->send_cap ? session->send_cap : SEND_BATCH_SIZE;
+      while (new_cap < session->send_len + (size_t)len)
+        new_cap *= 2;
+      char* new_buffer = (char*)realloc(session->send_buffer, new_cap);
+      if (!new_buffer)
+        return 0;
+      session->send_buffer = new_buffer;
+      session->send_cap = new_cap;
+    }
+    memcpy(session->send_buffer + session->send_len, data, (size_t)len);
+    session->send_len += (size_t)len;
+  }
+  return 1;
+}
+
+// send frames queued by nghttp2 until all sent or waiting,
+// or close |session| and return 0 if failed
+unsigned char SendHttp2Session(Http2Session* session) {
+  assert(session);
+  assert(!session->is_closed);
+
+  if (session->is_send_waiting)
+    return 1;
+
+  for (;;) {
+    if (session->n_sent == session->send_len) {
+      if (!FillHttp2SendBuffer(session)) {
+        CloseHttp2Session(session, Http2_Stream_Send_Err);
+        return 0;
+      }
+      if (!session->send_len)
+        return 1;
+    }
+
+    ssize_t result = TransportSend(&session->send_op, session->fd,
+                                   session->send_buffer + session->n_sent,
+                                   session->send_len - session->n_sent);
+    if (result < 0) {
+      // continue in next term
+      if (EVUTIL_SOCKET_ERROR() == EAGAIN) {
+        session->is_send_waiting = TransportWaitSend(
+            &session->send_op, session->send_buffer + session->n_sent,
+            session->send_len - session->n_sent, &session->timeout);
+        if (!session->is_send_waiting) {
+          CloseHttp2Session(session, Http2_Stream_Send_Err);
+          return 0;
+        }
+        return 1;
+      }
+
+      CloseHttp2Session(session, EVUTIL_SOCKET_ERROR() == EPROTO
+                                     ? Http2_Stream_Tls_Err
+                                     : Http2_Stream_Send_Err);
+      return 0;
+    }
+    session->n_sent += (size_t)result;
+  }
+}
+
+// send queued frames, then close |session| if it's done,
+// or wait for recv if not waiting
+void FlushHttp2Session(Http2Session* session) {
+  assert(session);
+  assert(!session->is_closed);
+
+  if (!SendHttp2Session(session))
+    return;
+
+  // going away (or not pooled) and all streams are done
+  if (!session->streams &&
+      (!session->is_pooled ||
+       !nghttp2_session_check_request_allowed(session->nghttp2) ||
+       (!nghttp2_session_want_read(session->nghttp2) &&
+        !nghttp2_session_want_write(session->nghttp2)))) {
+    CloseHttp2Session(session, Http2_Stream_Recv_Err);
+    return;
+  }
+
+  if (!session->is_recv_waiting && !WaitHttp2Recv(session))
+    CloseHttp2Session(session, Http2_Stream_Recv_Err);
+}
+
+//
+// event callbacks (|context| is session)
+//
+
+void OnHttp2Flush(evutil_socket_t fd, short events, void* context) {
+  (void)(fd);
+  (void)(events);
+  assert(context);
+
+  FlushHttp2Session((Http2Session*)context);
+}
+
+void OnHttp2Recv(evutil_socket_t fd, short events, void* context) {
+  assert(context);
+  Http2Session* session = (Http2Session*)context;
+
+  if (session->is_closed) {
+    OnClosedHttp2SessionOp(session);
+    return;
+  }
+  session->is_recv_waiting = 0;
+
+  if (events & EV_TIMEOUT) {
+    // streams are failed by |OnHttp2Deadline|,
+    // and idle session is kept for a while
+    if (!session->streams &&
+        GetHttp2ElapsedMs(&session->active_time) >= IDLE_TIMEOUT_MS) {
+      CloseHttp2Session(session, Http2_Stream_Timeout);
+      return;
+    }
+    if (!WaitHttp2Recv(session))
+      CloseHttp2Session(session, Http2_Stream_Recv_Err);
+    return;
+  }
+  assert(events & EV_READ);
+
+  for (;;) {
+    ssize_t result = TransportRecv(&session->recv_op, fd, session->recv_buffer,
+                                   sizeof session->recv_buffer);
+    if (result < 0) {
+      // continue in next term
+      if (EVUTIL_SOCKET_ERROR() == EAGAIN)
+        break;
+
+      CloseHttp2Session(session, EVUTIL_SOCKET_ERROR() == EPROTO
+                                     ? Http2_Stream_Tls_Err
+                                     : Http2_Stream_Recv_Err);
+      return;
+    }
+    if (result == 0) {
+      // closed by peer
+      CloseHttp2Session(session, Http2_Stream_Recv_Err);
+      return;
+    }
+    evutil_gettimeofday(&session->recv_time, NULL);
+    session->active_time = session->recv_time;
+
+    // callbacks of streams are called inside
+    if (nghttp2_session_mem_recv(session->nghttp2,
+                                 (const uint8_t*)session->recv_buffer,
+                                 (size_t)result) < 0) {
+      CloseHttp2Session(session, Http2_Stream_Recv_Err);
+      return;
+    }
+  }
+
+  // send frames in reply (e.g. settings ack and window updates)
+  FlushHttp2Session(session);
+}
+
+void OnHttp2Deadline(evutil_socket_t fd, short events, void* context) {
+  (void)(fd);
+  (void)(events);
+  assert(context);
+  Http2Session* session = (Http2Session*)context;
+  assert(!session->is_closed);
+
+  struct timeval now;
+  evutil_gettimeofday(&now, NULL);
+  for (Http2Stream* stream = session->streams; stream;) {
+    Http2Stream* next = stream->next;
+    if (evutil_timercmp(&stream->deadline, &now, >)) {
+      stream = next;
+      continue;
+    }
+
+    // connection recved nothing since the stream started waiting,
+    // so fail all streams on it
+    struct timeval wait_start;
+    evutil_timersub(&stream->deadline, &stream->timeout, &wait_start);
+    if (evutil_timercmp(&session->recv_time, &wait_start, <)) {
+      CloseHttp2Session(session, Http2_Stream_Timeout);
+      return;
+    }
+
+    // only the stream stalls, so reset it
+    // (streams submitted by its callback are added before |next|)
+    nghttp2_submit_rst_stream(session->nghttp2, NGHTTP2_FLAG_NONE,
+                              stream->id, NGHTTP2_CANCEL);
+    FinishHttp2Stream(session, stream, Http2_Stream_Timeout);
+    stream = next;
+  }
+
+  ScheduleHttp2Deadline(session);
+  FlushHttp2Session(session);
+}
+
+void OnHttp2Send(evutil_socket_t fd, short events, void* context) {
+  (void)(fd);
+  assert(context);
+  Http2Session* session = (Http2Session*)context;
+
+  if (session->is_closed) {
+    OnClosedHttp2SessionOp(session);
+    return;
+  }
+  session->is_send_waiting = 0;
+
+  if (events & EV_TIMEOUT) {
+    CloseHttp2Session(session, Http2_Stream_Timeout);
+    return;
+  }
+  assert(events & EV_WRITE);
+
+  FlushHttp2Session(session);
+}
+
+//
+// export functions
+//
+
+Http2Session* CreateHttp2Session(struct event_base* base,
+                                 evutil_socket_t fd,
+                                 const char* conn_key,
+                                 const char* authority,
+                                 unsigned char is_https) {
+  assert(base);
+  assert(fd >= 0);
+  assert(conn_key);
+  assert(authority);
+
+  Http2Session* ret = (Http2Session*)malloc(sizeof(Http2Session));
+  if (!ret)
+    return NULL;
+  memset(ret, 0, sizeof(Http2Session));
+  ret->fd = fd;
+  ret->is_https = is_https;
+  ret->timeout.tv_sec = IDLE_TIMEOUT_MS / 1000;
+  evutil_gettimeofday(&ret->recv_time, NULL);
+  ret->active_time = ret->recv_time;
+
+  // connection preface (with settings) is sent in the next loop
+  ret->conn_key = CopyString(conn_key);
+  ret->authority = CopyString(authority);
+  if (!ret->conn_key || !ret->authority ||
+      !(ret->nghttp2 = CreateNghttp2Session(ret)) ||
+      evtimer_assign(&ret->flush_event, base, OnHttp2Flush, ret) < 0 ||
+      evtimer_assign(&ret->deadline_event, base, OnHttp2Deadline, ret) < 0 ||
+      !TransportAssign(&ret->recv_op, fd, EV_READ, OnHttp2Recv, ret) ||
+      !TransportAssign(&ret->send_op, fd, EV_WRITE, OnHttp2Send, ret)) {
+    TransportReset(&ret->recv_op);
+    FreeHttp2Session(ret);
+    return NULL;
+  }
+  event_active(&ret->flush_event, EV_TIMEOUT, 1);
+
+  ret->next = g_http2_sessions;
+  if (g_http2_sessions)
+    g_http2_sessions->prev = ret;
+  g_http2_sessions = ret;
+
+  ret->is_pooled = ConnPoolSetSession(conn_key, ret);
+  __atomic_fetch_add(&g_http2_session_total, 1, __ATOMIC_RELAXED);
+  return ret;
+}
+
+Http2Session* GetHttp2Session(const char* conn_key) {
+  assert(conn_key);
+
+  Http2Session* session = (Http2Session*)ConnPoolGetSession(conn_key);
+  if (!session ||
+      !nghttp2_session_check_request_allowed(session->nghttp2))
+    return NULL;
+  return session;
+}
+
+unsigned char Http2SessionSubmit(Http2Session* session,
+                                 const char* path,
+                                 const Http2Header* headers,
+                                 size_t header_count,
+                                 yeild_response_header_callback_fn
+                                     header_callback,
+                                 http2_stream_callback_fn callback,
+                                 void* context,
+                                 const struct timeval* timeout) {
+  assert(session);
+  assert(!session->is_closed);
+  assert(path);
+  assert(header_callback);
+  assert(callback);
+  assert(timeout);
+
+  // pseudo headers go first
+  nghttp2_nv* nva =
+      (nghttp2_nv*)malloc((header_count + 4) * sizeof(nghttp2_nv));
+  Http2Stream* stream = (Http2Stream*)malloc(sizeof(Http2Stream));
+  if (!nva || !stream) {
+    if (nva)
+      free((void*)nva);
+    if (stream)
+      free((void*)stream);
+    return 0;
+  }
+  memset(stream, 0, sizeof(Http2Stream));
+  stream->header_callback = header_callback;
+  stream->callback = callback;
+  stream->context = context;
+  stream->timeout = *timeout;
+
+  const char* pseudo_headers[][2] = {
+      {":method", "GET"},
+      {":scheme", session->is_https ? SCHEME_HTTPS : SCHEME_HTTP},
+      {":authority", session->authority},
+      {":path", path},
+  };
+  for (size_t i = 0; i < header_count + 4; ++i) {
+    const char* name = i < 4 ? pseudo_headers[i][0] : headers[i - 4].name;
+    const char* value = i < 4 ? pseudo_headers[i][1] : headers[i - 4].value;
+    nva[i].name = (uint8_t*)name;
+    nva[i].namelen = strlen(name);
+    nva[i].value = (uint8_t*)value;
+    nva[i].valuelen = strlen(value);
+    nva[i].flags = NGHTTP2_NV_FLAG_NONE;
+  }
+
+  // headers are copied (and compressed with previous ones when sending)
+  stream->id = nghttp2_submit_request(session->nghttp2, NULL, nva,
+                                      header_count + 4, NULL, stream);
+  free((void*)nva);
+  if (stream->id < 0) {
+    free((void*)stream);
+    return 0;
+  }
+
+  stream->next = session->streams;
+  if (session->streams)
+    session->streams->prev = stream;
+  session->streams = stream;
+
+  session->timeout = *timeout;
+  evutil_gettimeofday(&session->active_time, NULL);
+  evutil_timeradd(&session->active_time, timeout, &stream->deadline);
+  ScheduleHttp2Deadline(session);
+  event_active(&session->flush_event, EV_TIMEOUT, 1);
+
+  __atomic_fetch_add(&g_http2_stream_total, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+void CloseHttp2Sessions() {
+  while (g_http2_sessions)
+    CloseHttp2Session(g_http2_sessions, Http2_Stream_Recv_Err);
+}
+
+size_t GetHttp2ClosingSessionCount() {
+  return g_http2_closing_session_count;
+}
+
+void GetHttp2SessionStats(size_t* session_count, size_t* stream_count) {
+  assert(session_count);
+  assert(stream_count);
+
+  *session_count = __atomic_load_n(&g_http2_session_total, __ATOMIC_RELAXED);
+  *stream_count = __atomic_load_n(&g_http2_stream_total, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,81 @@
+// HTTP/2 client session multiplexing requests on one connection
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef HTTP2_SESSION
+#define HTTP2_SESSION
+
+#include <stddef.h>
+
+// For libevent types
+#include <event2/event.h>
+
+#include "response_parser.h"
+
+// frames are handled by nghttp2, and sent/recved by transport;
+// sessions are per thread (bound to thread's event base)
+
+typedef struct _Http2Session Http2Session;
+
+typedef enum {
+  Http2_Stream_Headers,   // a block of response headers recved
+  Http2_Stream_Data,      // a piece of response body recved
+  Http2_Stream_Done,      // response is complete
+  Http2_Stream_Refused,   // not processed by peer (refused or going away)
+  Http2_Stream_Reset,     // reset by peer, or malformed response
+  Http2_Stream_Send_Err,  // connection failed to send
+  Http2_Stream_Recv_Err,  // connection failed to recv, or closed by peer
+  Http2_Stream_Tls_Err,   // TLS of connection failed
+  Http2_Stream_Timeout,   // stream (or connection) recved nothing in time
+} Http2StreamEvent;
+
+// sync multi callback of a stream (|data| is body of |Http2_Stream_Data|),
+// return 0 to cancel the stream
+// (not called any more after returning 0 or events after data)
+typedef unsigned char (*http2_stream_callback_fn)(Http2StreamEvent event,
+                                                 const char* data,
+                                                 size_t len,
+                                                 void* context);
+
+// name/value of request header (name must be lowercase)
+typedef struct {
+  const char* name;
+  const char* value;
+} Http2Header;
+
+// start HTTP/2 on connected |fd| (taken over if succeeded) to |conn_key|,
+// for requests to |authority| (over TLS if |is_https|),
+// and pool it as the session to |conn_key| if there's none
+// (or close it after its streams are done), or return NULL if failed
+Http2Session* CreateHttp2Session(struct event_base* base,
+                                 evutil_socket_t fd,
+                                 const char* conn_key,
+                                 const char* authority,
+                                 unsigned char is_https);
+
+// the session to |conn_key| accepting new streams, or NULL if none
+Http2Session* GetHttp2Session(const char* conn_key);
+
+// submit GET |path| (with |headers|) as a new stream of |session|, and
+// pass headers of response (":status" included) to |header_callback|
+// and events to |callback| later, resetting and failing it if nothing of
+// it is recved within |timeout|, or return 0 if failed
+unsigned char Http2SessionSubmit(Http2Session* session,
+                                 const char* path,
+                                 const Http2Header* headers,
+                                 size_t header_count,
+                                 yeild_response_header_callback_fn
+                                     header_callback,
+                                 http2_stream_callback_fn callback,
+                                 void* context,
+                                 const struct timeval* timeout);
+
+// close all sessions of current thread (failing their streams)
+void CloseHttp2Sessions();
+
+// count of closed sessions waiting for their pending io_uring operations
+size_t GetHttp2ClosingSessionCount();
+
+// count of sessions and streams started (shared by all threads)
+void GetHttp2SessionStats(size_t* session_count, size_t* stream_count);
+
+#endif  // HTTP2_SESSION
@@ -10,53 +10,151 @@
 #include <stdlib.h>
 #include <string.h>
 
-// For inet_pton
-#include <arpa/inet.h>
 // For libevent functions
 #include <event2/event.h>
-// For getaddrinfo
-#include <netdb.h>
+// For evdns_getaddrinfo
+#include <event2/dns.h>
 // For sockaddr_in
 #include <netinet/in.h>
 // For socket functions
 #include <sys/socket.h>
 
+#include "body_inflater.h"
+#include "conn_pool.h"
+#include "dns_cache.h"
+#include "http2_session.h"
+#include "mem_pool.h"
+#include "response_parser.h"
+#include "rtt_estimator.h"
 #include "string_helper.h"
 #include "third_party/HTParse.h"
-
-#define CONN_TIMEOUT_SEC 5
-#define SEND_TIMEOUT_SEC 5
-#define RECV_TIMEOUT_SEC 5
-#define SEND_BUFFER_SIZE 512
-#define RECV_BUFFER_SIZE 64
+#include "transport.h"
+
+#define URL_HTTPS_SCHEME "https://"
+#define HTTP_PORT 80
+#define HTTPS_PORT 443
+#define DEFAULT_TIMEOUT_MS 5000
+#define RECV_BUFFER_SIZE 16384
+#define PIPELINE_MAX_DEPTH 4
+#define CONN_ATTEMPT_DELAY_MS 250  // stagger of racing connects (RFC 8305)
+#define DEFAULT_MAX_BODY_SIZE (64 * 1024 * 1024)
+#define STATE_POOL_SLAB_SIZE 64
+#define STATE_ARENA_SIZE 1024  // url and send buffer
+#define ARENA_BLOCK_SIZE (RECV_BUFFER_SIZE + 1024)  // first recv chunk
+#define ARENA_BLOCK_POOL_SLAB_SIZE 16
+
+#define HEADER_CONTENT_ENCODING "Content-Encoding"
+#define HEADER_CONTENT_TYPE "Content-Type"
+#define HEADER_CONTENT_LENGTH "Content-Length"
+#define HEADER_STATUS ":status"  // HTTP/2 pseudo header
+#define HEADER_ETAG "ETag"
+#define HEADER_LAST_MODIFIED "Last-Modified"
+#define HEADER_IF_NONE_MATCH "If-None-Match"
+#define HEADER_IF_MODIFIED_SINCE "If-Modified-Since"
+
+// media types of html (others are aborted before recving body)
+#define CONTENT_TYPE_HTML "text/html"
+#define CONTENT_TYPE_XHTML "application/xhtml+xml"
+
+#define USER_AGENT \
+  "Mozilla/5.0 (Windows NT 10.0; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/70.0.3538.102 Safari/537.36"
+#define ACCEPT_TYPES "text/html,application/xhtml+xml,application/xml"
+#define ACCEPT_ENCODINGS "gzip, deflate"
 
 #define HTTP_GET_TEMPLATE \
   "GET %s HTTP/1.1\r\n\
 Host: %s\r\n\
-User-Agent: Mozilla/5.0 (Windows NT 10.0; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/70.0.3538.102 Safari/537.36\r\n\
-Accept: text/html,application/xhtml+xml,application/xml\r\n\
+User-Agent: " USER_AGENT "\r\n\
+Accept: " ACCEPT_TYPES "\r\n\
+Accept-Encoding: " ACCEPT_ENCODINGS "\r\n\
+Connection: keep-alive\r\n\
+%s%s%s%s%s%s\
 \r\n\
 "
 
-#define CONTENT_LENGTH_START "Content-Length: "
-#define CONTENT_LENGTH_END "\r\n"
-#define CONTENT_LENGTH_TEMPLATE "Content-Length: %lu\r\n"
-#define CONTENT_START "\r\n\r\n"
-#define RESPONSE_STATUS_TEMPLATE "%*s%u"
+// optional header line of HTTP_GET_TEMPLATE (3 args, empty if NULL)
+#define OPTIONAL_HEADER_ARGS(name, value) \
+  (value) ? name ": " : "", (value) ? (value) : "", (value) ? "\r\n" : ""
+
+// headers of HTTP/2 requests (besides pseudo headers), compressed by
+// HPACK after the first stream of a session
+const Http2Header g_http2_get_headers[] = {
+    {"user-agent", USER_AGENT},
+    {"accept", ACCEPT_TYPES},
+    {"accept-encoding", ACCEPT_ENCODINGS},
+};
+#define HTTP2_GET_HEADER_COUNT \
+  (sizeof g_http2_get_headers / sizeof g_http2_get_headers[0])
+
+// one event base for each thread (states below are also per thread)
+__thread struct event_base* g_event_base;
+
+// async dns resolver bound to |g_event_base|
+__thread struct evdns_base* g_evdns_base;
+
+// timeouts of waiting states before rtt of host is measured
+// (set by |SetRequestTimeout|, shared)
+unsigned g_conn_timeout_ms = DEFAULT_TIMEOUT_MS;
+unsigned g_send_timeout_ms = DEFAULT_TIMEOUT_MS;
+unsigned g_recv_timeout_ms = DEFAULT_TIMEOUT_MS;
+
+// size limit of body (set by |SetRequestMaxBodySize|, shared)
+size_t g_max_body_size = DEFAULT_MAX_BODY_SIZE;
+
+// when to use HTTP/2 (set by |SetRequestHttp2Mode|, shared)
+Http2Mode g_http2_mode = Http2_Tls;
+
+// recycle |RequestState| (with its first arena block) and arena blocks
+__thread SlabPool* g_state_pool;
+__thread SlabPool* g_arena_block_pool;
+
+//
+// timeout helpers
+//
+
+void SetTimeval(struct timeval* tv, unsigned ms) {
+  tv->tv_sec = ms / 1000;
+  tv->tv_usec = (ms % 1000) * 1000;
+}
+
+// elapsed microseconds since |start| (by cached time of |g_event_base|)
+long GetElapsedUs(const struct timeval* start) {
+  assert(start);
+
+  struct timeval now, elapsed;
+  event_base_gettimeofday_cached(g_event_base, &now);
+  evutil_timersub(&now, start, &elapsed);
+  return elapsed.tv_sec * 1000000L + elapsed.tv_usec;
+}
 
 //
 // url helpers
 //
 
-char* ConstructSendBuffer(const char* url) {
+// GET |url| (conditional if |validators| are set)
+char* ConstructSendBuffer(Arena* arena,
+                          const char* url,
+                          const RequestValidators* validators) {
+  assert(validators);
+
   char* ret = NULL;
   char* host = HTParse(url, NULL, PARSE_HOST);
   char* path = HTParse(url, NULL, PARSE_PATH | PARSE_PUNCTUATION);
 
   if (host && path) {
-    char buffer[SEND_BUFFER_SIZE];
-    sprintf(buffer, HTTP_GET_TEMPLATE, path, host);
-    ret = CopyString(buffer);
+    // measure first, since path and validators may be long
+    int len = snprintf(
+        NULL, 0, HTTP_GET_TEMPLATE, path, host,
+        OPTIONAL_HEADER_ARGS(HEADER_IF_NONE_MATCH, validators->etag),
+        OPTIONAL_HEADER_ARGS(HEADER_IF_MODIFIED_SINCE,
+                             validators->last_modified));
+    if (len >= 0)
+      ret = (char*)ArenaAlloc(arena, (size_t)len + 1);
+    if (ret)
+      sprintf(ret, HTTP_GET_TEMPLATE, path, host,
+              OPTIONAL_HEADER_ARGS(HEADER_IF_NONE_MATCH, validators->etag),
+              OPTIONAL_HEADER_ARGS(HEADER_IF_MODIFIED_SINCE,
+                                   validators->last_modified));
   }
 
   if (host)
@@ -66,61 +164,235 @@ char* ConstructSendBuffer(const char* url) {
   return ret;
 }
 
+//
+// socket helpers
+//
+
+// create non-blocking socket of |family|, or return -1 and set |status|
+evutil_socket_t CreateSocket(int family, RequestStatus* status) {
+  assert(status);
+
+  evutil_socket_t fd = socket(family, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) {
+    if (EVUTIL_SOCKET_ERROR() == EMFILE || EVUTIL_SOCKET_ERROR() == ENFILE) {
+      // reach fd limit
+      *status = Request_Fd_Limit;
+    } else {
+      // unexpected socket error
+      *status = Request_Socket_Err;
+    }
+    return -1;
+  }
+
+  // make socket non-blocking
+  assert(0 == evutil_make_socket_nonblocking(fd));
+  return fd;
+}
+
 //
 // state definitions
 //
 
 typedef struct {
+  // parse status line and headers
+  ResponseParser parser;
+
+  // decode chunked body in place
+  ChunkedDecoder chunked_decoder;
+
+  // length of decoded body data (undecoded data follows it)
+  size_t body_len;
+
+  // length of body data streamed and dropped from recv buffer
+  size_t body_streamed_len;
+
+  // content encoding from headers, and length of body data inflated
+  ContentEncoding content_encoding;
+  size_t inflated_len;
+
+  // content type from headers is not html (html if not given)
+  unsigned char is_not_html;
+
+  // reason of |Response_Parse_Error|
+  RequestStatus error_status;
+
+  // length of the first complete response in recv data
+  size_t response_len;
+} ResponseScan;
+
+// connect attempt to one address of host
+// (allocated alone, since pending io_uring connect may be done
+// after its request goes on or is freed)
+typedef struct {
+  TransportOp op;
+  evutil_socket_t fd;
+
+  // start time (to measure rtt of host)
+  struct timeval start_time;
+
+  // request racing this attempt (NULL if aborted)
+  struct _RequestState* state;
+} ConnAttempt;
+
+// staggered connect attempts to all addresses of host (Happy Eyeballs),
+// the first connected one wins and the others are aborted
+typedef struct {
+  // addresses interleaved by family, and index of the next to try
+  HostAddrList addr_list;
+  size_t next_addr;
+
+  // attempts not failed yet (NULL if failed)
+  ConnAttempt* attempts[HOST_ADDR_LIST_SIZE];
+  size_t active_count;
+
+  // start the next attempt if none connects in time
+  struct event delay_timer;
+
+  // reason of the last failed attempt
+  RequestStatus status;
+} ConnRace;
+
+typedef struct _RequestState {
+  // own |url|, send buffer and the first recv chunk
+  // (the first block follows |RequestState| in |g_state_pool|)
+  Arena arena;
+
   // requested url
   char* url;
 
-  // callback data
+  // host parsed from |url|
+  char* host;
+
+  // scheme and host parsed from |url| (key of pooled connections),
+  // and whether it's sent over TLS
+  char* conn_key;
+  unsigned char is_https;
+
+  // validators of cached page (sent if set), and ones of response
+  RequestValidators validators;
+  RequestValidators response_validators;
+
+  // callback data (|body_callback| is optional)
+  yeild_body_data_callback_fn body_callback;
   request_callback_fn callback;
   void* context;
 
-  // event/buffer of current state
-  struct event* event;
+  // whether connection is taken from idle connection pool
+  unsigned char is_reused;
+
+  // whether connection can be put back to idle connection pool
+  unsigned char is_keep_alive;
+
+  // next request pipelined on the same connection (sent after this one)
+  struct _RequestState* pipeline_next;
+
+  // count of requests pipelined after this one
+  size_t pipeline_depth;
+
+  // next request resolving host (Resolve state only)
+  struct _RequestState* resolve_next;
+
+  // connect attempts if host has multiple addresses (Conn state only)
+  ConnRace* race;
+
+  // op/buffer of current state (|op| is re-assigned for each state)
+  TransportOp op;
   char* buffer;
 
+  // timeout of current state (adapted by rtt of |host|),
+  // and start time of its round trip (not set if not measured)
+  struct timeval timeout;
+  struct timeval rtt_start_time;
+
+  // used/allocated length of recv |buffer|
+  size_t buffer_len;
+  size_t buffer_cap;
+
+  // inflate encoded body of recv |buffer| (NULL if not encoded)
+  BodyInflater* inflater;
+
+  // start time, and timing of phases (passed by |GetRequestTiming|)
+  struct timeval start_time;
+  RequestTiming timing;
+
   // event specific data
   union {
     // used to track sent data
     size_t n_sent;
 
-    // used to check recv data
-    size_t content_length;
+    // used to scan recv data incrementally
+    ResponseScan scan;
   };
 } RequestState;
 
-size_t g_request_state_count;
+__thread size_t g_request_state_count;
+
+// count of |ConnAttempt| (including aborted ones not done yet)
+__thread size_t g_conn_attempt_count;
+
+// requests resolving host (joined by |resolve_next|), so requests to
+// the same host wait for the one lookup in flight
+__thread RequestState* g_resolving_states;
+
+// timing and validators of the request being called back
+__thread const RequestTiming* g_callback_timing;
+__thread const RequestValidators* g_callback_validators;
 
 RequestState* CreateState(const char* url,
                           request_callback_fn callback,
                           void* context) {
-  RequestState* ret = (RequestState*)malloc(sizeof(RequestState));
+  RequestState* ret = (RequestState*)SlabPoolAlloc(g_state_pool);
   if (!ret)
     return NULL;
   memset(ret, 0, sizeof(RequestState));
+  InitArena(&ret->arena, (char*)(ret + 1), STATE_ARENA_SIZE,
+            g_arena_block_pool, ARENA_BLOCK_SIZE);
 
-  ret->url = CopyString(url);
+  ret->url = ArenaCopyString(&ret->arena, url);
   if (!ret->url) {
-    free((void*)ret);
+    SlabPoolFree(g_state_pool, (void*)ret);
     return NULL;
   }
 
   ret->callback = callback;
   ret->context = context;
 
+  event_base_gettimeofday_cached(g_event_base, &ret->start_time);
+  ret->timing.conn_us = -1;
+  ret->timing.ttfb_us = -1;
+
   ++g_request_state_count;
   return ret;
 }
 
+// callback on terminal state (with timing of |state|)
+void CallbackState(RequestState* state,
+                   RequestStatus status,
+                   const char* html) {
+  assert(state);
+
+  // restore after nested callbacks (of requests started by |callback|)
+  const RequestTiming* previous_timing = g_callback_timing;
+  const RequestValidators* previous_validators = g_callback_validators;
+  g_callback_timing = &state->timing;
+  g_callback_validators = &state->response_validators;
+  state->callback(state->url, status, html, state->context);
+  g_callback_timing = previous_timing;
+  g_callback_validators = previous_validators;
+}
+
 void FreeState(RequestState* state) {
   assert(state);
   assert(state->url);
 
-  free((void*)state->url);
-  free((void*)state);
+  if (state->inflater)
+    FreeBodyInflater(state->inflater);
+  if (state->host)
+    free((void*)state->host);
+  if (state->conn_key)
+    free((void*)state->conn_key);
+  FreeArena(&state->arena);
+  SlabPoolFree(g_state_pool, (void*)state);
 
   --g_request_state_count;
 }
@@ -135,17 +407,21 @@ typedef enum {
   DontFree,     // don't free previous state's event/buffer (assert empty)
 } TransformAction;
 
-void TransformStateEvent(RequestState* state,
-                         struct event* new_event,
-                         TransformAction action) {
+// re-assign |op| of |state| to |fd| and |callback| for new state,
+// or only delete previous op if |callback| is NULL
+unsigned char TransformStateEvent(RequestState* state,
+                                  evutil_socket_t fd,
+                                  short events,
+                                  event_callback_fn callback,
+                                  TransformAction action) {
   assert(state);
 
   switch (action) {
     case RequireFree:
-      assert(state->event);
+      assert(state->op.has_event);
       break;
     case DontFree:
-      assert(!state->event);
+      assert(!state->op.has_event);
       break;
     case MaybeFree:
     default:
@@ -153,9 +429,11 @@ void TransformStateEvent(RequestState* state,
       break;
   }
 
-  if (state->event)
-    event_free(state->event);
-  state->event = new_event;
+  TransportReset(&state->op);
+
+  if (!callback)
+    return 1;
+  return TransportAssign(&state->op, fd, events, callback, state);
 }
 
 void TransformStateBuffer(RequestState* state,
@@ -176,402 +454,1769 @@ void TransformStateBuffer(RequestState* state,
       break;
   }
 
-  if (state->buffer)
+  if (state->buffer && !IsArenaOwned(&state->arena, state->buffer))
     free((void*)state->buffer);
   state->buffer = new_buffer;
+  state->buffer_len = 0;
+  state->buffer_cap = 0;
 }
 
-/*
-  State Transformation:
+//
+// rtt helpers
+//
 
-                     DoInit   DoConn   DoSend   DoRecv
-                        \        \        \        \
- (CreateState) --> Init --> Conn --> Send --> Recv --> Succ --:
-                    :        :        :        :              :--> (FreeState)
-                    :--------:--------:--------:-----> Fail --:
-*/
+// set |timeout| of |state| by rtt of its host, for waiting |kind|
+// (start measuring rtt if |is_measured|)
+void SetStateTimeout(RequestState* state,
+                     RttKind kind,
+                     unsigned default_ms,
+                     unsigned char is_measured) {
+  assert(state);
 
-// trans-state functions
+  unsigned timeout_ms = state->host
+                            ? GetRttTimeoutMs(state->host, kind, default_ms)
+                            : default_ms;
+  SetTimeval(&state->timeout, timeout_ms);
 
-void StateInitToConn(evutil_socket_t fd, RequestState* state);
-void StateConnToSend(evutil_socket_t fd, RequestState* state);
-void StateSendToRecv(evutil_socket_t fd, RequestState* state);
-void StateRecvToSucc(evutil_socket_t fd, RequestState* state);
-void StateToFail(evutil_socket_t fd, RequestState* state, RequestStatus status);
+  if (is_measured)
+    event_base_gettimeofday_cached(g_event_base, &state->rtt_start_time);
+  else
+    evutil_timerclear(&state->rtt_start_time);
+}
 
-// in-state functions
+// add measured round trip of |state| since |SetStateTimeout|
+void AddStateRttSample(RequestState* state, RttKind kind) {
+  assert(state);
 
-void DoInit(evutil_socket_t fd, short events, void* context);
-void DoConn(evutil_socket_t fd, short events, void* context);
-void DoSend(evutil_socket_t fd, short events, void* context);
-void DoRecv(evutil_socket_t fd, short events, void* context);
+  if (state->host && evutil_timerisset(&state->rtt_start_time))
+    RttAddSample(state->host, kind, GetElapsedUs(&state->rtt_start_time));
+  evutil_timerclear(&state->rtt_start_time);
+}
+
+// back off timeout of |kind| for host of |state|
+void OnStateTimeout(RequestState* state, RttKind kind) {
+  assert(state);
 
-// one event base for single thread
-struct event_base* g_event_base;
+  if (state->host)
+    RttOnTimeout(state->host, kind,
+                 (unsigned)(state->timeout.tv_sec * 1000 +
+                            state->timeout.tv_usec / 1000));
+}
 
 //
-// trans-state functions
+// recv helpers
 //
 
-void StateInitToConn(evutil_socket_t fd, RequestState* state) {
+// grow |buffer| of |state| to hold at least |RECV_BUFFER_SIZE| more bytes
+unsigned char ReserveRecvBuffer(RequestState* state) {
   assert(state);
 
-  // create new event
-  struct event* new_event =
-      event_new(g_event_base, fd, EV_WRITE, DoConn, state);
-  if (!new_event) {
-    StateToFail(fd, state, Request_Event_New_Err);
-    return;
-  }
+  if (state->buffer_cap - state->buffer_len >= RECV_BUFFER_SIZE)
+    return 1;
 
-  // set up new state
-  TransformStateEvent(state, new_event, DontFree);
-  TransformStateBuffer(state, NULL, DontFree);
+  size_t new_cap = state->buffer_cap ? state->buffer_cap : RECV_BUFFER_SIZE;
+  while (new_cap - state->buffer_len < RECV_BUFFER_SIZE)
+    new_cap *= 2;
 
-  // start new state
-  struct timeval tv = {CONN_TIMEOUT_SEC, 0};
-  event_add(state->event, &tv);
+  // reserve 1 more byte to make |buffer| C-style string
+  char* new_buffer = NULL;
+  if (state->buffer && !IsArenaOwned(&state->arena, state->buffer)) {
+    new_buffer = (char*)realloc(state->buffer, new_cap + 1);
+  } else {
+    // take the first chunk from arena, and move larger ones to heap
+    new_buffer = new_cap == RECV_BUFFER_SIZE
+                     ? (char*)ArenaAlloc(&state->arena, new_cap + 1)
+                     : (char*)malloc(new_cap + 1);
+    if (new_buffer && state->buffer)
+      memcpy(new_buffer, state->buffer, state->buffer_len);
+  }
+  if (!new_buffer)
+    return 0;
+
+  state->buffer = new_buffer;
+  state->buffer_cap = new_cap;
+  return 1;
 }
 
-void StateConnToSend(evutil_socket_t fd, RequestState* state) {
+// wait for sending the rest of |buffer| (or |fd| writable)
+unsigned char WaitSend(RequestState* state) {
   assert(state);
+  assert(state->buffer);
 
-  // create new event
-  struct event* new_event =
-      event_new(g_event_base, fd, EV_WRITE, DoSend, state);
-  if (!new_event) {
-    StateToFail(fd, state, Request_Event_New_Err);
-    return;
-  }
+  size_t send_upto = strlen(state->buffer);
+  return TransportWaitSend(&state->op, state->buffer + state->n_sent,
+                           send_upto - state->n_sent, &state->timeout);
+}
 
-  // create new buffer
-  char* new_buffer = ConstructSendBuffer(state->url);
-  if (!new_buffer) {
-    StateToFail(fd, state, Request_Out_Of_Mem);
-    return;
-  }
+// wait for recving into |buffer| reserved by |ReserveRecvBuffer|
+// (or |fd| readable)
+unsigned char WaitRecv(RequestState* state) {
+  assert(state);
+  assert(state->buffer_cap > state->buffer_len);
 
-  // set up new state
-  TransformStateEvent(state, new_event, RequireFree);
-  TransformStateBuffer(state, new_buffer, DontFree);
-  state->n_sent = 0;
+  return TransportWaitRecv(&state->op, state->buffer + state->buffer_len,
+                           state->buffer_cap - state->buffer_len,
+                           &state->timeout);
+}
 
-  // start new state
-  struct timeval tv = {SEND_TIMEOUT_SEC, 0};
-  event_add(state->event, &tv);
+// if media type of Content-Type |value| (before parameters) is html
+unsigned char IsHtmlContentType(const char* value, size_t value_len) {
+  size_t type_len = 0;
+  while (type_len < value_len && value[type_len] != ';' &&
+         value[type_len] != ' ' && value[type_len] != '\t')
+    ++type_len;
+
+  return (type_len == sizeof CONTENT_TYPE_HTML - 1 &&
+          FindrStringIgnoreCase(value, value + type_len,
+                                CONTENT_TYPE_HTML)) ||
+         (type_len == sizeof CONTENT_TYPE_XHTML - 1 &&
+          FindrStringIgnoreCase(value, value + type_len,
+                                CONTENT_TYPE_XHTML));
 }
 
-void StateSendToRecv(evutil_socket_t fd, RequestState* state) {
+// copy header |value| into arena of |state| (NULL if failed)
+const char* CopyHeaderValue(RequestState* state,
+                            const char* value,
+                            size_t value_len) {
   assert(state);
 
-  // create new event
-  struct event* new_event = event_new(g_event_base, fd, EV_READ, DoRecv, state);
-  if (!new_event) {
-    StateToFail(fd, state, Request_Event_New_Err);
-    return;
+  char* ret = (char*)ArenaAlloc(&state->arena, value_len + 1);
+  if (ret) {
+    memcpy(ret, value, value_len);
+    ret[value_len] = 0;
   }
+  return ret;
+}
 
-  // set up new state
-  TransformStateEvent(state, new_event, RequireFree);
-  TransformStateBuffer(state, NULL, RequireFree);
-  state->content_length = 0;
+void OnResponseHeader(const char* name,
+                      size_t name_len,
+                      const char* value,
+                      size_t value_len,
+                      void* context) {
+  assert(context);
+  RequestState* state = (RequestState*)context;
 
-  // start new state
-  struct timeval tv = {RECV_TIMEOUT_SEC, 0};
-  event_add(state->event, &tv);
+  if (name_len == sizeof HEADER_CONTENT_ENCODING - 1 &&
+      FindrStringIgnoreCase(name, name + name_len, HEADER_CONTENT_ENCODING))
+    state->scan.content_encoding = ParseContentEncoding(value, value_len);
+
+  if (name_len == sizeof HEADER_CONTENT_TYPE - 1 &&
+      FindrStringIgnoreCase(name, name + name_len, HEADER_CONTENT_TYPE))
+    state->scan.is_not_html = !IsHtmlContentType(value, value_len);
+
+  // validators to revalidate the page later
+  if (name_len == sizeof HEADER_ETAG - 1 &&
+      FindrStringIgnoreCase(name, name + name_len, HEADER_ETAG))
+    state->response_validators.etag =
+        CopyHeaderValue(state, value, value_len);
+
+  if (name_len == sizeof HEADER_LAST_MODIFIED - 1 &&
+      FindrStringIgnoreCase(name, name + name_len, HEADER_LAST_MODIFIED))
+    state->response_validators.last_modified =
+        CopyHeaderValue(state, value, value_len);
 }
 
-void StateRecvToSucc(evutil_socket_t fd, RequestState* state) {
+// if response of |state| is 304 to its conditional request
+unsigned char IsNotModified(const RequestState* state) {
   assert(state);
 
-  // free event
-  TransformStateEvent(state, NULL, RequireFree);
+  return state->scan.parser.status_code == 304 &&
+         (state->validators.etag || state->validators.last_modified);
+}
 
-  // shutdown and close socket
-  shutdown(fd, SHUT_RDWR);
-  EVUTIL_CLOSESOCKET(fd);
+// check headers of response before recving its body, and body recved,
+// or set |error_status| if it should be aborted
+unsigned char CheckResponseContent(RequestState* state) {
+  assert(state);
+  ResponseScan* scan = &state->scan;
 
-  // callback on terminal state
-  const char* html = strstr(state->buffer, CONTENT_START);
-  if (html) {
-    html += sizeof CONTENT_START - 1;
+  // skip pages of other types (body of other responses is dropped anyway)
+  if (scan->parser.status_code == 200 && scan->is_not_html) {
+    scan->error_status = Request_Not_Html;
+    return 0;
   }
-  state->callback(state->url, Request_Succ, html, state->context);
 
-  // free buffer
-  TransformStateBuffer(state, NULL, RequireFree);
+  if ((scan->parser.framing == Response_Framing_Length &&
+       scan->parser.content_length > g_max_body_size) ||
+      scan->body_streamed_len + scan->body_len > g_max_body_size) {
+    // body of other responses is drained only if it's small
+    scan->error_status = scan->parser.status_code == 200
+                             ? Request_Too_Large
+                             : Request_Response_Err;
+    return 0;
+  }
+  return 1;
+}
 
-  // clear state
-  FreeState(state);
+// prepare |scan| of |state| for a new response
+void InitResponseScan(RequestState* state) {
+  assert(state);
+
+  memset(&state->scan, 0, sizeof state->scan);
+  InitResponseParser(&state->scan.parser, OnResponseHeader, state);
+  InitChunkedDecoder(&state->scan.chunked_decoder);
 }
 
-void StateToFail(evutil_socket_t fd,
-                 RequestState* state,
-                 RequestStatus status) {
+// inflate body data received since last time if it's encoded
+unsigned char InflateNewBody(RequestState* state) {
   assert(state);
+  ResponseScan* scan = &state->scan;
 
-  // free buffer/event
-  TransformStateEvent(state, NULL, MaybeFree);
-  TransformStateBuffer(state, NULL, MaybeFree);
+  if (scan->content_encoding == Content_Encoding_Identity)
+    return 1;
 
-  // shutdown and close socket
-  shutdown(fd, SHUT_RDWR);
-  EVUTIL_CLOSESOCKET(fd);
+  if (!state->inflater) {
+    if (scan->content_encoding == Content_Encoding_Unknown) {
+      scan->error_status = Request_Decode_Err;
+      return 0;
+    }
 
-  // callback on terminal state
-  state->callback(state->url, status, NULL, state->context);
+    state->inflater =
+        CreateBodyInflater(scan->content_encoding, g_max_body_size);
+    if (!state->inflater) {
+      scan->error_status = Request_Out_Of_Mem;
+      return 0;
+    }
+  }
 
-  // clear state
-  FreeState(state);
+  const char* body = state->buffer + scan->parser.body_offset;
+  InflateResult result =
+      InflateBody(state->inflater, body + scan->inflated_len,
+                  scan->body_len - scan->inflated_len);
+  scan->inflated_len = scan->body_len;
+
+  switch (result) {
+    case Inflate_Data_Err:
+      scan->error_status = Request_Decode_Err;
+      return 0;
+    case Inflate_Too_Large:
+      scan->error_status = Request_Too_Large;
+      return 0;
+    case Inflate_Ok:
+    case Inflate_Done:
+    default:
+      return 1;
+  }
 }
 
-//
-// in-state functions
-//
+// if encoded body of complete response is inflated to the end of stream
+// (a truncated stream may be inflated well until it's cut off)
+unsigned char IsBodyInflated(RequestState* state) {
+  assert(state);
 
-void DoInit(evutil_socket_t fd, short events, void* context) {
-  assert(!events);
-  assert(context);
-  RequestState* state = (RequestState*)context;
+  return !state->inflater ||
+         InflateBody(state->inflater, NULL, 0) == Inflate_Done;
+}
 
-  // parse |host| from |url|
-  char* host = HTParse(state->url, NULL, PARSE_HOST);
-  if (!host) {
-    // Init -> Fail
-    StateToFail(fd, state, Request_Bad_Hostname);
-    return;
+// drop body data decoded since last time from recv |buffer|
+// (so the whole body is never kept)
+void DropNewBody(RequestState* state) {
+  assert(state);
+  ResponseScan* scan = &state->scan;
+
+  // keep undecoded data and data after the end of body
+  char* body = state->buffer + scan->parser.body_offset;
+  size_t streamed_len = scan->body_len;
+  size_t tail_len =
+      state->buffer_len - scan->parser.body_offset - streamed_len;
+  memmove(body, body + streamed_len, tail_len);
+  state->buffer_len -= streamed_len;
+  state->buffer[state->buffer_len] = 0;
+
+  if (scan->response_len)
+    scan->response_len -= streamed_len;
+  scan->body_streamed_len += streamed_len;
+  scan->body_len = 0;
+  scan->inflated_len = 0;
+}
+
+// pass body data decoded since last time to |body_callback|,
+// and drop it from recv |buffer|
+void StreamNewBody(RequestState* state) {
+  assert(state);
+  assert(state->body_callback);
+  ResponseScan* scan = &state->scan;
+
+  if (state->inflater) {
+    size_t inflated_len = 0;
+    const char* inflated = GetInflatedBody(state->inflater, &inflated_len);
+    if (inflated_len)
+      state->body_callback(state->url, inflated, inflated_len,
+                           state->context);
+    ClearInflatedBody(state->inflater);
+  } else if (scan->body_len) {
+    state->body_callback(state->url,
+                         state->buffer + scan->parser.body_offset,
+                         scan->body_len, state->context);
   }
 
-  // get |addrinfo|
-  struct addrinfo* addr_list = NULL;
-  struct addrinfo hints = {0};
-  hints.ai_flags = 0;
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_RAW;
-  hints.ai_protocol = IPPROTO_ICMP;
-  if (getaddrinfo(host, NULL, &hints, &addr_list) != 0)
-    addr_list = NULL;
+  DropNewBody(state);
+}
+
+// check body data decoded since last time, then inflate and stream it,
+// or set |error_status| if failed
+unsigned char ScanNewBody(RequestState* state) {
+  assert(state);
 
-  free((void*)host);
+  if (!CheckResponseContent(state))
+    return 0;
 
-  if (!addr_list) {
-    // Init -> Fail
-    StateToFail(fd, state, Request_Bad_Hostname);
-    return;
+  // body of other responses is not used, so drop it without decoding,
+  // but still recv it to keep connection alive
+  if (state->scan.parser.status_code != 200) {
+    DropNewBody(state);
+    return 1;
   }
 
-  // try connect to host
-  unsigned char is_connect_ok = 0;
-  for (struct addrinfo* rp = addr_list; rp; rp = rp->ai_next) {
-    char host[NI_MAXHOST];
-    getnameinfo(rp->ai_addr, rp->ai_addrlen, host, sizeof(host), NULL, 0,
-                NI_NUMERICHOST);
+  if (!InflateNewBody(state))
+    return 0;
+
+  if (state->body_callback)
+    StreamNewBody(state);
+  return 1;
+}
 
-    struct sockaddr_in sa = {0};
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(80);  // TODO: read port from url
-    inet_pton(sa.sin_family, host, (void*)&sa.sin_addr);
+// scan new recv data from where it stopped last time,
+// set |response_len| if the first response is complete,
+// or set |error_status| if failed
+ResponseParseResult ScanResponse(RequestState* state) {
+  assert(state);
+  ResponseScan* scan = &state->scan;
+
+  ResponseParseResult result =
+      ParseResponse(&scan->parser, state->buffer, state->buffer_len);
+  if (result == Response_Parse_Error)
+    scan->error_status = Request_Response_Err;
+  if (result != Response_Parse_Done)
+    return result;
+
+  size_t body_offset = scan->parser.body_offset;
+  switch (scan->parser.framing) {
+    case Response_Framing_Close:
+      scan->body_len = state->buffer_len - body_offset;
+      result = Response_Parse_Incomplete;
+      break;
 
-    // connect immediately
-    if (connect(fd, (struct sockaddr*)&sa, sizeof sa) >= 0) {
-      is_connect_ok = 1;
+    case Response_Framing_Chunked: {
+      // decode data after decoded body, and remove chunk framing
+      char* raw = state->buffer + body_offset + scan->body_len;
+      size_t raw_len = state->buffer_len - body_offset - scan->body_len;
+      size_t consumed_len = 0, decoded_len = 0;
+      result = DecodeChunked(&scan->chunked_decoder, raw, raw_len,
+                             &consumed_len, &decoded_len);
+
+      // keep data after the end of body (next pipelined response)
+      memmove(raw + decoded_len, raw + consumed_len, raw_len - consumed_len);
+      state->buffer_len -= consumed_len - decoded_len;
+      state->buffer[state->buffer_len] = 0;
+      scan->body_len += decoded_len;
+
+      if (result == Response_Parse_Error)
+        scan->error_status = Request_Response_Err;
+      if (result == Response_Parse_Done)
+        scan->response_len = body_offset + scan->body_len;
       break;
     }
 
-    // connecting
-    if (EVUTIL_SOCKET_ERROR() == EINPROGRESS ||
-        EVUTIL_SOCKET_ERROR() == EINTR) {
-      is_connect_ok = 1;
+    case Response_Framing_Length:
+    default: {
+      size_t remaining_len =
+          scan->parser.content_length - scan->body_streamed_len;
+      scan->body_len = state->buffer_len - body_offset;
+      result = Response_Parse_Incomplete;
+
+      if (scan->body_len >= remaining_len) {
+        scan->body_len = remaining_len;
+        scan->response_len = body_offset + scan->body_len;
+        result = Response_Parse_Done;
+      }
       break;
     }
   }
 
-  freeaddrinfo(addr_list);
+  if (result != Response_Parse_Error && !ScanNewBody(state))
+    result = Response_Parse_Error;
+  return result;
+}
 
-  if (!is_connect_ok) {
-    // Init -> Fail
-    StateToFail(fd, state, Request_Conn_Err);
-    return;
-  }
+//
+// HTTP/2 stream helpers
+//
 
-  // Init -> Conn
-  StateInitToConn(fd, state);
+// parse decimal number of header |value|
+size_t ParseHeaderNumber(const char* value, size_t value_len) {
+  size_t ret = 0;
+  for (size_t i = 0; i < value_len && value[i] >= '0' && value[i] <= '9'; ++i)
+    ret = ret * 10 + (size_t)(value[i] - '0');
+  return ret;
 }
 
-void DoConn(evutil_socket_t fd, short events, void* context) {
+// prepare |scan| of |state| for response of a stream, whose headers and
+// body data are passed by session (body is kept in recv |buffer| like
+// HTTP/1.1 body ended by closing)
+void InitStreamScan(RequestState* state) {
+  assert(state);
+
+  InitResponseScan(state);
+  state->scan.parser.framing = Response_Framing_Close;
+}
+
+void OnStreamHeader(const char* name,
+                    size_t name_len,
+                    const char* value,
+                    size_t value_len,
+                    void* context) {
   assert(context);
   RequestState* state = (RequestState*)context;
+  ResponseParser* parser = &state->scan.parser;
 
-  if (events & EV_TIMEOUT) {
-    // Conn -> Fail
-    StateToFail(fd, state, Request_Conn_Timeout);
+  if (name_len == sizeof HEADER_STATUS - 1 &&
+      !memcmp(name, HEADER_STATUS, name_len)) {
+    parser->status_code = (unsigned)ParseHeaderNumber(value, value_len);
     return;
   }
-  assert(events & EV_WRITE);
 
-  // check sockopt
-  int err;
-  socklen_t len = sizeof(err);
-  assert(0 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len));
-  if (err) {
-    // Conn -> Fail
-    StateToFail(fd, state, Request_Bad_Sock_Opt);
+  if (name_len == sizeof HEADER_CONTENT_LENGTH - 1 &&
+      FindrStringIgnoreCase(name, name + name_len, HEADER_CONTENT_LENGTH)) {
+    parser->has_content_length = 1;
+    parser->framing = Response_Framing_Length;
+    parser->content_length = ParseHeaderNumber(value, value_len);
     return;
   }
 
-  // Conn -> Send
-  StateConnToSend(fd, state);
+  OnResponseHeader(name, name_len, value, value_len, context);
 }
 
-void DoSend(evutil_socket_t fd, short events, void* context) {
-  assert(context);
-  RequestState* state = (RequestState*)context;
+// append body data of stream to recv |buffer|, then scan it like
+// HTTP/1.1 body, or set |error_status| if failed
+unsigned char AppendStreamBody(RequestState* state,
+                               const char* data,
+                               size_t len) {
+  assert(state);
+  assert(len <= RECV_BUFFER_SIZE);  // at most a frame
 
-  if (events & EV_TIMEOUT) {
-    // Send -> Fail
-    StateToFail(fd, state, Request_Send_Timeout);
-    return;
+  if (!ReserveRecvBuffer(state)) {
+    state->scan.error_status = Request_Out_Of_Mem;
+    return 0;
   }
-  assert(events & EV_WRITE);
+  memcpy(state->buffer + state->buffer_len, data, len);
+  state->buffer_len += len;
+  state->buffer[state->buffer_len] = 0;
 
-  size_t send_upto = strlen(state->buffer);
-  while (state->n_sent < send_upto) {
-    ssize_t result =
-        send(fd, state->buffer + state->n_sent, send_upto - state->n_sent, 0);
-    if (result < 0) {
-      // continue in next term
-      if (EVUTIL_SOCKET_ERROR() == EAGAIN) {
-        struct timeval tv = {SEND_TIMEOUT_SEC, 0};
-        event_add(state->event, &tv);
-        return;
-      }
+  state->scan.body_len = state->buffer_len;
+  return ScanNewBody(state);
+}
 
-      // Send -> Fail
-      StateToFail(fd, state, Request_Send_Err);
-      return;
-    }
-    assert(result != 0);
+// stop accepting pipelined requests on connection of |state|
+void StopPipelining(RequestState* state) {
+  assert(state);
 
-    // continue sending
-    state->n_sent += (size_t)result;
-  }
+  if (state->host)
+    ConnPoolUnsetPipeline(state->conn_key, state);
+}
 
-  // finish sending
-  assert(state->n_sent == send_upto);
+void DoInit(evutil_socket_t fd, short events, void* context);
 
-  // Send -> Recv
-  StateSendToRecv(fd, state);
+// restart state machine of |state| on a new connection
+void RestartState(RequestState* state) {
+  assert(state);
+  assert(!state->inflater);  // restart only if nothing received
+
+  state->is_reused = 0;
+  DoInit(-1, 0, state);
 }
 
-void DoRecv(evutil_socket_t fd, short events, void* context) {
-  assert(context);
-  RequestState* state = (RequestState*)context;
+// restart requests pipelined after a broken connection
+void RestartPipeline(RequestState* pipeline) {
+  while (pipeline) {
+    RequestState* next = pipeline->pipeline_next;
+    pipeline->pipeline_next = NULL;
+    pipeline->pipeline_depth = 0;
 
-  if (events & EV_TIMEOUT) {
-    // Recv -> Fail
-    StateToFail(fd, state, Request_Recv_Timeout);
-    return;
+    RestartState(pipeline);
+    pipeline = next;
   }
-  assert(events & EV_READ);
+}
 
-  char buffer[RECV_BUFFER_SIZE];
-  while (1) {
-    ssize_t result = recv(fd, buffer, sizeof(buffer) - 1, 0);
-    if (result < 0) {
-      // continue in next term
-      if (EVUTIL_SOCKET_ERROR() == EAGAIN) {
-        struct timeval tv = {RECV_TIMEOUT_SEC, 0};
-        event_add(state->event, &tv);
-        return;
-      }
+// set port of all addresses in |addr_list|
+void SetAddrListPort(HostAddrList* addr_list, unsigned short port) {
+  assert(addr_list);
 
-      // Recv -> Fail
-      StateToFail(fd, state, Request_Recv_Err);
-      return;
+  for (size_t i = 0; i < addr_list->count; ++i) {
+    struct sockaddr* addr = (struct sockaddr*)&addr_list->addrs[i];
+    if (addr->sa_family == AF_INET)
+      ((struct sockaddr_in*)addr)->sin_port = htons(port);
+    else if (addr->sa_family == AF_INET6)
+      ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+  }
+}
 
-    } else if (result == 0) {
-      // succeeded
-      break;
+//
+// connect race helpers
+//
+
+// alternate address families of |addr_list|, starting with the first one's
+// (like RFC 8305), so a broken family doesn't block the other one
+void InterleaveAddrFamilies(HostAddrList* addr_list) {
+  assert(addr_list);
+  assert(addr_list->count);
+
+  sa_family_t first_family =
+      ((const struct sockaddr*)&addr_list->addrs[0])->sa_family;
+  size_t first_indices[HOST_ADDR_LIST_SIZE], other_indices[HOST_ADDR_LIST_SIZE];
+  size_t first_count = 0, other_count = 0;
+  for (size_t i = 0; i < addr_list->count; ++i) {
+    if (((const struct sockaddr*)&addr_list->addrs[i])->sa_family ==
+        first_family)
+      first_indices[first_count++] = i;
+    else
+      other_indices[other_count++] = i;
+  }
+
+  HostAddrList ret;
+  ret.count = 0;
+  for (size_t i = 0; ret.count < addr_list->count; ++i) {
+    if (i < first_count) {
+      ret.addrs[ret.count] = addr_list->addrs[first_indices[i]];
+      ret.addr_lens[ret.count++] = addr_list->addr_lens[first_indices[i]];
+    }
+    if (i < other_count) {
+      ret.addrs[ret.count] = addr_list->addrs[other_indices[i]];
+      ret.addr_lens[ret.count++] = addr_list->addr_lens[other_indices[i]];
+    }
+  }
+  *addr_list = ret;
+}
+
+void FreeConnAttempt(ConnAttempt* attempt) {
+  assert(attempt);
+
+  free((void*)attempt);
+  --g_conn_attempt_count;
+}
+
+// close socket of |attempt|, and free it
+// (or when its pending operation is done)
+void AbortConnAttempt(ConnAttempt* attempt) {
+  assert(attempt);
+
+  attempt->state = NULL;
+  unsigned char is_pending = TransportCancel(&attempt->op);
+  TransportClose(attempt->fd);
+  if (!is_pending)
+    FreeConnAttempt(attempt);
+}
+
+// stop racing of |state|, and abort attempts except |winner|
+// (whose socket is taken by |state|, if not NULL)
+void FinishConnRace(RequestState* state, ConnAttempt* winner) {
+  assert(state);
+  assert(state->race);
+  ConnRace* race = state->race;
+
+  event_del(&race->delay_timer);
+  for (size_t i = 0; i < race->addr_list.count; ++i) {
+    if (race->attempts[i] && race->attempts[i] != winner)
+      AbortConnAttempt(race->attempts[i]);
+  }
+  if (winner) {
+    TransportReset(&winner->op);
+    FreeConnAttempt(winner);
+  }
+
+  free((void*)race);
+  state->race = NULL;
+}
+
+/*
+  State Transformation:
+
+                     DoInit   DoResolve   DoConn   DoSend   DoRecv
+                        \         \         \        \        \
+ (CreateState) --> Init --> Resolve --> Conn --> Send --> Recv --> Succ --:
+                    :         :          :        :        :              :
+                    :---------:----------:--------:--------:-----> Fail --:
+                                                                          :
+                                                            (FreeState) <-:
+
+  Keep-alive Transformation:
+
+  - Init --> Send: reuse idle connection from |ConnPoolGet|
+  - Send/Recv --> Init: reused connection was closed by peer, retry
+  - Succ: put connection back by |ConnPoolPut| if response is keep-alive
+  - Recv --> Fail: also put connection back if non-200 response is
+    keep-alive (its body is drained already)
+
+  Pipeline Transformation:
+
+  - Init --> Queued: append request to the one being sent on the same
+    connection (|ConnPoolGetPipeline|), then wait for previous response
+  - Queued --> Recv: take over connection and remaining data from
+    previous response
+  - Queued --> Init: previous request failed or closed connection, retry
+
+  Connect Racing Transformation:
+
+  - Init --> Resolve: join the lookup in flight for the same host
+    (|g_resolving_states|) instead of resolving it again
+  - Resolve --> Conn: if host has multiple addresses, start an attempt
+    (|ConnAttempt| on its own socket) every |CONN_ATTEMPT_DELAY_MS| or
+    as soon as the previous one fails
+  - Conn --> Send: take over socket of the first connected attempt,
+    and abort the others
+
+  TLS/HTTP/2 Transformation:
+
+  - Conn --> Handshake: start TLS on new connection to https host
+    (offering h2 by ALPN if HTTP/2 is on)
+  - Handshake --> Send: HTTP/1.1 is selected by ALPN (or not offered)
+  - Handshake --> Stream: h2 is selected by ALPN, then start HTTP/2
+    session (|CreateHttp2Session|) on connection, and submit a stream
+  - Conn --> Stream: start HTTP/2 session on new connection to http host
+    by prior knowledge (h2c)
+  - Init --> Stream: submit a stream to session of the same host
+    (|GetHttp2Session|) instead of connecting
+  - Stream --> Init: stream was refused or session was closed before
+    response of reused session, retry
+  - Stream --> Succ/Fail: streams never own connection, which is closed
+    by session after its streams are done
+*/
+
+// trans-state functions
+
+void StateInitToResolve(RequestState* state);
+void StateInitToSend(evutil_socket_t fd, RequestState* state);
+void StateInitToQueued(RequestState* head, RequestState* state);
+void StateQueuedToRecv(evutil_socket_t fd,
+                       RequestState* state,
+                       char* buffer,
+                       size_t buffer_len);
+void StateResolveToConn(evutil_socket_t fd, RequestState* state);
+void StateResolveToConnRace(RequestState* state,
+                            const HostAddrList* addr_list);
+void StateConnRaceToConn(evutil_socket_t fd,
+                         RequestState* state,
+                         ConnAttempt* winner);
+void StateConnToSend(evutil_socket_t fd, RequestState* state);
+void StateConnToHandshake(evutil_socket_t fd, RequestState* state);
+void StateConnToStream(evutil_socket_t fd, RequestState* state);
+void StateInitToStream(RequestState* state, Http2Session* session);
+void StateSendToRecv(evutil_socket_t fd, RequestState* state);
+void StateRecvToSucc(evutil_socket_t fd, RequestState* state);
+void StateStreamToSucc(RequestState* state);
+void StateToFail(evutil_socket_t fd, RequestState* state, RequestStatus status);
+void StateToInit(evutil_socket_t fd, RequestState* state);
+void StateStreamToInit(RequestState* state);
+
+// in-state functions
+
+void DoResolve(int result, struct evutil_addrinfo* addr_list, void* context);
+void ConnectHost(RequestState* state, const HostAddrList* addr_list);
+void DoConn(evutil_socket_t fd, short events, void* context);
+unsigned char StartConnAttempt(RequestState* state);
+void ContinueConnRace(RequestState* state);
+void DoConnAttempt(evutil_socket_t fd, short events, void* context);
+void DoConnDelay(evutil_socket_t fd, short events, void* context);
+void UseConnection(evutil_socket_t fd, RequestState* state);
+void DoHandshake(evutil_socket_t fd, short events, void* context);
+void DoSend(evutil_socket_t fd, short events, void* context);
+void DoRecv(evutil_socket_t fd, short events, void* context);
+unsigned char SubmitStream(RequestState* state, Http2Session* session);
+unsigned char DoStream(Http2StreamEvent event,
+                       const char* data,
+                       size_t len,
+                       void* context);
+
+//
+// trans-state functions
+//
+
+void StateInitToResolve(RequestState* state) {
+  assert(state);
+
+  // |host| is parsed from |url| by |Request|
+  if (!state->host) {
+    StateToFail(-1, state, Request_Bad_Hostname);
+    return;
+  }
+
+  // set up new state (socket is created after resolving)
+  TransformStateEvent(state, -1, 0, NULL, DontFree);
+  TransformStateBuffer(state, NULL, DontFree);
+
+  // try resolve |host| by cache
+  HostAddrList addr_list;
+  switch (DnsCacheLookup(state->host, &addr_list)) {
+    case Dns_Cache_Hit:
+      ConnectHost(state, &addr_list);
+      return;
+    case Dns_Cache_Bad_Host:
+      StateToFail(-1, state, Request_Bad_Hostname);
+      return;
+    case Dns_Cache_Miss:
+    default:
+      break;
+  }
+
+  // join the lookup in flight for the same |host|
+  unsigned char is_resolving = 0;
+  for (RequestState* iter = g_resolving_states; iter;
+       iter = iter->resolve_next) {
+    if (!strcmp(iter->host, state->host)) {
+      is_resolving = 1;
+      break;
+    }
+  }
+  state->resolve_next = g_resolving_states;
+  g_resolving_states = state;
+  if (is_resolving)
+    return;
+
+  // start new state
+  struct evutil_addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  // |DoResolve| may be called before returning (e.g. numeric host),
+  // so |state| must not be touched after this call
+  // no service, since port is set by scheme when connecting
+  // (explicit port of url is unsupported)
+  evdns_getaddrinfo(g_evdns_base, state->host, NULL, &hints, DoResolve,
+                    state);
+}
+
+void StateInitToSend(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+  assert(state->is_reused);
+
+  // create new buffer
+  char* new_buffer =
+      ConstructSendBuffer(&state->arena, state->url, &state->validators);
+  if (!new_buffer) {
+    StateToFail(fd, state, Request_Out_Of_Mem);
+    return;
+  }
+
+  // set up new state
+  TransformStateBuffer(state, new_buffer, DontFree);
+  if (!TransformStateEvent(state, fd, EV_WRITE, DoSend, DontFree)) {
+    StateToFail(fd, state, Request_Event_New_Err);
+    return;
+  }
+  state->n_sent = 0;
+  SetStateTimeout(state, Rtt_Conn, g_send_timeout_ms, 0);
+
+  // accept pipelined requests until sending finished
+  ConnPoolSetPipeline(state->conn_key, state);
+
+  // start new state
+  if (!WaitSend(state))
+    StateToFail(fd, state, Request_Event_New_Err);
+}
+
+void StateInitToQueued(RequestState* head, RequestState* state) {
+  assert(head);
+  assert(head->buffer);
+  assert(state);
+
+  // append request to send buffer of |head|
+  char* send_buffer =
+      ConstructSendBuffer(&state->arena, state->url, &state->validators);
+  if (!send_buffer) {
+    StateToFail(-1, state, Request_Out_Of_Mem);
+    return;
+  }
+
+  size_t head_len = strlen(head->buffer);
+  char* new_buffer =
+      (char*)ArenaAlloc(&head->arena, head_len + strlen(send_buffer) + 1);
+  if (!new_buffer) {
+    StateToFail(-1, state, Request_Out_Of_Mem);
+    return;
+  }
+  memcpy(new_buffer, head->buffer, head_len);
+  strcpy(new_buffer + head_len, send_buffer);
+  head->buffer = new_buffer;
+
+  // wait after the last request pipelined on |head|
+  RequestState* tail = head;
+  while (tail->pipeline_next)
+    tail = tail->pipeline_next;
+  tail->pipeline_next = state;
+
+  if (++head->pipeline_depth >= PIPELINE_MAX_DEPTH)
+    StopPipelining(head);
+}
+
+void StateQueuedToRecv(evutil_socket_t fd,
+                       RequestState* state,
+                       char* buffer,
+                       size_t buffer_len) {
+  assert(state);
+
+  // set up new state
+  TransformStateBuffer(state, buffer, DontFree);
+  if (!TransformStateEvent(state, fd, EV_READ, DoRecv, DontFree)) {
+    StateToFail(fd, state, Request_Event_New_Err);
+    return;
+  }
+  state->buffer_len = buffer_len;
+  state->buffer_cap = buffer_len;
+  state->is_reused = 1;
+  InitResponseScan(state);
+
+  // response may be sent before (not a round trip)
+  SetStateTimeout(state, Rtt_Response, g_recv_timeout_ms, 0);
+
+  // process data passed from previous response first
+  if (state->buffer) {
+    state->timing.ttfb_us = GetElapsedUs(&state->start_time);
+    DoRecv(fd, EV_READ, state);
+    return;
+  }
+
+  // start new state
+  if (!ReserveRecvBuffer(state)) {
+    StateToFail(fd, state, Request_Out_Of_Mem);
+    return;
+  }
+  if (!WaitRecv(state))
+    StateToFail(fd, state, Request_Event_New_Err);
+}
+
+void StateResolveToConn(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+
+  // set up new state
+  TransformStateBuffer(state, NULL, DontFree);
+  if (!TransformStateEvent(state, fd, EV_WRITE, DoConn, DontFree)) {
+    StateToFail(fd, state, Request_Event_New_Err);
+    return;
+  }
+  SetStateTimeout(state, Rtt_Conn, g_conn_timeout_ms, 1);
+
+  // start new state
+  if (!TransportWaitConnect(&state->op, &state->timeout))
+    StateToFail(fd, state, Request_Event_New_Err);
+}
+
+void StateResolveToConnRace(RequestState* state,
+                            const HostAddrList* addr_list) {
+  assert(state);
+  assert(addr_list);
+
+  ConnRace* race = (ConnRace*)malloc(sizeof(ConnRace));
+  if (!race) {
+    StateToFail(-1, state, Request_Out_Of_Mem);
+    return;
+  }
+  memset(race, 0, sizeof(ConnRace));
+  race->addr_list = *addr_list;
+  InterleaveAddrFamilies(&race->addr_list);
+  race->status = Request_Conn_Err;
+  evtimer_assign(&race->delay_timer, g_event_base, DoConnDelay, state);
+
+  // set up new state (sockets are owned by attempts)
+  TransformStateBuffer(state, NULL, DontFree);
+  state->race = race;
+  SetStateTimeout(state, Rtt_Conn, g_conn_timeout_ms, 0);
+
+  // start new state
+  ContinueConnRace(state);
+}
+
+void StateConnRaceToConn(evutil_socket_t fd,
+                         RequestState* state,
+                         ConnAttempt* winner) {
+  assert(state);
+  assert(winner);
+
+  // measure rtt by |winner| only (others start earlier)
+  state->rtt_start_time = winner->start_time;
+  AddStateRttSample(state, Rtt_Conn);
+
+  // take over socket of |winner|
+  FinishConnRace(state, winner);
+
+  UseConnection(fd, state);
+}
+
+void StateConnToSend(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+
+  // create new buffer
+  char* new_buffer =
+      ConstructSendBuffer(&state->arena, state->url, &state->validators);
+  if (!new_buffer) {
+    StateToFail(fd, state, Request_Out_Of_Mem);
+    return;
+  }
+
+  // set up new state
+  // (|op| is not assigned if connected by racing attempts)
+  TransformStateBuffer(state, new_buffer, DontFree);
+  if (!TransformStateEvent(state, fd, EV_WRITE, DoSend, MaybeFree)) {
+    StateToFail(fd, state, Request_Event_New_Err);
+    return;
+  }
+  state->n_sent = 0;
+  SetStateTimeout(state, Rtt_Conn, g_send_timeout_ms, 0);
+
+  // start new state
+  if (!WaitSend(state))
+    StateToFail(fd, state, Request_Event_New_Err);
+}
+
+void StateConnToHandshake(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+  assert(state->is_https);
+
+  // handshake is done by transport (offering h2 if HTTP/2 is on)
+  if (!TransportStartTls(fd, state->host, g_http2_mode != Http2_Off)) {
+    StateToFail(fd, state, Request_Tls_Err);
+    return;
+  }
+
+  // set up new state
+  // (|op| is not assigned if connected by racing attempts)
+  TransformStateBuffer(state, NULL, DontFree);
+  if (!TransformStateEvent(state, fd, EV_WRITE, DoHandshake, MaybeFree)) {
+    StateToFail(fd, state, Request_Event_New_Err);
+    return;
+  }
+  SetStateTimeout(state, Rtt_Conn, g_conn_timeout_ms, 0);
+
+  // start new state (writable after handshake)
+  if (!TransportWaitSend(&state->op, NULL, 0, &state->timeout))
+    StateToFail(fd, state, Request_Event_New_Err);
+}
+
+void StateConnToStream(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+  assert(state->host);
+
+  // hand off connection to new session (never put back to idle pool)
+  TransformStateEvent(state, -1, 0, NULL, MaybeFree);
+  TransformStateBuffer(state, NULL, DontFree);
+  Http2Session* session = CreateHttp2Session(
+      g_event_base, fd, state->conn_key, state->host, state->is_https);
+  if (!session) {
+    StateToFail(fd, state, Request_Out_Of_Mem);
+    return;
+  }
+
+  // start new state
+  if (!SubmitStream(state, session))
+    StateToFail(-1, state, Request_Send_Err);
+}
+
+void StateInitToStream(RequestState* state, Http2Session* session) {
+  assert(state);
+  assert(state->is_reused);
+  assert(session);
+
+  // set up new state (no socket is owned)
+  TransformStateEvent(state, -1, 0, NULL, DontFree);
+  TransformStateBuffer(state, NULL, DontFree);
+
+  // start new state
+  if (!SubmitStream(state, session))
+    StateToFail(-1, state, Request_Send_Err);
+}
+
+void StateSendToRecv(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+
+  // set up new state
+  TransformStateBuffer(state, NULL, RequireFree);
+  if (!TransformStateEvent(state, fd, EV_READ, DoRecv, RequireFree)) {
+    StateToFail(fd, state, Request_Event_New_Err);
+    return;
+  }
+  InitResponseScan(state);
+  StopPipelining(state);
+  SetStateTimeout(state, Rtt_Response, g_recv_timeout_ms, 1);
+
+  // start new state
+  if (!ReserveRecvBuffer(state)) {
+    StateToFail(fd, state, Request_Out_Of_Mem);
+    return;
+  }
+  if (!WaitRecv(state))
+    StateToFail(fd, state, Request_Event_New_Err);
+}
+
+void StateRecvToSucc(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+
+  assert(!state->pipeline_next);
+
+  // free event
+  TransformStateEvent(state, -1, 0, NULL, RequireFree);
+
+  if (fd < 0) {
+    // connection is handed off to next pipelined request
+  } else if (state->is_keep_alive) {
+    // put socket back to pool
+    ConnPoolPut(g_event_base, state->conn_key, fd);
+  } else {
+    // shutdown and close socket
+    TransportClose(fd);
+  }
+
+  // callback on terminal state (body is passed already if streamed,
+  // and there's none if not modified)
+  if (IsNotModified(state)) {
+    CallbackState(state, Request_Not_Modified, NULL);
+  } else {
+    const char* html = NULL;
+    if (!state->body_callback)
+      html = state->inflater ? GetInflatedBody(state->inflater, NULL)
+                             : state->buffer + state->scan.parser.body_offset;
+    CallbackState(state, Request_Succ, html);
+  }
+
+  // free buffer
+  TransformStateBuffer(state, NULL, RequireFree);
+
+  // clear state
+  FreeState(state);
+}
+
+void StateStreamToSucc(RequestState* state) {
+  assert(state);
+
+  // callback on terminal state (body is passed already if streamed,
+  // and there's none if not modified)
+  if (IsNotModified(state)) {
+    CallbackState(state, Request_Not_Modified, NULL);
+  } else {
+    const char* html = NULL;
+    if (!state->body_callback)
+      html = state->inflater ? GetInflatedBody(state->inflater, NULL)
+                             : state->buffer;
+    CallbackState(state, Request_Succ, html);
+  }
+
+  // free buffer
+  TransformStateBuffer(state, NULL, RequireFree);
+
+  // clear state
+  FreeState(state);
+}
+
+void StateToFail(evutil_socket_t fd,
+                 RequestState* state,
+                 RequestStatus status) {
+  assert(state);
+
+  // free buffer/event/racing attempts
+  TransformStateEvent(state, -1, 0, NULL, MaybeFree);
+  TransformStateBuffer(state, NULL, MaybeFree);
+  StopPipelining(state);
+  if (state->race)
+    FinishConnRace(state, NULL);
+
+  // shutdown and close socket (if not handed off or not created)
+  if (fd >= 0)
+    TransportClose(fd);
+
+  // retry requests pipelined after current one
+  RestartPipeline(state->pipeline_next);
+  state->pipeline_next = NULL;
+
+  // callback on terminal state
+  CallbackState(state, status, NULL);
+
+  // clear state
+  FreeState(state);
+}
+
+void StateToInit(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+  assert(state->is_reused);
+
+  // free buffer/event
+  TransformStateEvent(state, -1, 0, NULL, MaybeFree);
+  TransformStateBuffer(state, NULL, MaybeFree);
+  StopPipelining(state);
+
+  // shutdown and close stale socket
+  TransportClose(fd);
+
+  // retry current and pipelined requests on new sockets
+  RequestState* pipeline = state->pipeline_next;
+  state->pipeline_next = NULL;
+  state->pipeline_depth = 0;
+
+  RestartState(state);
+  RestartPipeline(pipeline);
+}
+
+void StateStreamToInit(RequestState* state) {
+  assert(state);
+  assert(state->is_reused);
+
+  // free buffer (connection is owned by session)
+  TransformStateBuffer(state, NULL, MaybeFree);
+
+  // retry on new socket
+  RestartState(state);
+}
+
+//
+// in-state functions
+//
+
+void DoInit(evutil_socket_t fd, short events, void* context) {
+  assert(!events);
+  assert(context);
+  RequestState* state = (RequestState*)context;
+
+  if (state->is_reused) {
+    state->timing.conn_us = GetElapsedUs(&state->start_time);
+
+    // Init -> Send
+    StateInitToSend(fd, state);
+    return;
+  }
+
+  // Init -> Resolve
+  StateInitToResolve(state);
+}
+
+void DoResolve(int result, struct evutil_addrinfo* addr_list, void* context) {
+  assert(context);
+  const char* host = ((RequestState*)context)->host;
+
+  // take out requests waiting for |host| (including |context|) first,
+  // since requests started by callbacks may resolve it again
+  RequestState* waiting_states = NULL;
+  for (RequestState** iter = &g_resolving_states; *iter;) {
+    RequestState* state = *iter;
+    if (strcmp(state->host, host)) {
+      iter = &state->resolve_next;
+      continue;
+    }
+    *iter = state->resolve_next;
+    state->resolve_next = waiting_states;
+    waiting_states = state;
+  }
+  assert(waiting_states);
+
+  // copy resolved addresses
+  HostAddrList host_addr_list;
+  host_addr_list.count = 0;
+  if (result == 0) {
+    for (struct evutil_addrinfo* rp = addr_list;
+         rp && host_addr_list.count < HOST_ADDR_LIST_SIZE; rp = rp->ai_next) {
+      if (rp->ai_addrlen > sizeof host_addr_list.addrs[0])
+        continue;
+
+      memcpy(&host_addr_list.addrs[host_addr_list.count], rp->ai_addr,
+             rp->ai_addrlen);
+      host_addr_list.addr_lens[host_addr_list.count] =
+          (socklen_t)rp->ai_addrlen;
+      ++host_addr_list.count;
+    }
+  }
+
+  if (addr_list)
+    evutil_freeaddrinfo(addr_list);
+
+  // cache non-existent host only (not timeout or server failure)
+  if (host_addr_list.count)
+    DnsCacheAdd(host, &host_addr_list);
+  else if (result == EVUTIL_EAI_NONAME)
+    DnsCacheAddBadHost(host);
+
+  while (waiting_states) {
+    RequestState* state = waiting_states;
+    waiting_states = state->resolve_next;
+    state->resolve_next = NULL;
+
+    if (!host_addr_list.count) {
+      // Resolve -> Fail
+      StateToFail(-1, state, Request_Bad_Hostname);
+      continue;
+    }
+
+    // Resolve -> Conn
+    ConnectHost(state, &host_addr_list);
+  }
+}
+
+void ConnectHost(RequestState* state, const HostAddrList* host_addr_list) {
+  assert(state);
+  assert(host_addr_list);
+
+  // addresses are cached by host, so set port by scheme of |url|
+  HostAddrList port_addr_list = *host_addr_list;
+  SetAddrListPort(&port_addr_list, state->is_https ? HTTPS_PORT : HTTP_PORT);
+  const HostAddrList* addr_list = &port_addr_list;
+
+  // race connects to all addresses
+  if (addr_list->count > 1) {
+    // Resolve -> Conn
+    StateResolveToConnRace(state, addr_list);
+    return;
+  }
+
+  // create socket for family of the only address
+  const struct sockaddr* addr = (const struct sockaddr*)&addr_list->addrs[0];
+  RequestStatus status;
+  evutil_socket_t fd = CreateSocket(addr->sa_family, &status);
+  if (fd < 0) {
+    // Resolve -> Fail
+    StateToFail(fd, state, status);
+    return;
+  }
+
+  // connect immediately or connecting
+  if (TransportConnect(&state->op, fd, addr, addr_list->addr_lens[0]) < 0 &&
+      EVUTIL_SOCKET_ERROR() != EINPROGRESS &&
+      EVUTIL_SOCKET_ERROR() != EINTR) {
+    // Resolve -> Fail
+    StateToFail(fd, state, Request_Conn_Err);
+    return;
+  }
+
+  // Resolve -> Conn
+  StateResolveToConn(fd, state);
+}
+
+void DoConn(evutil_socket_t fd, short events, void* context) {
+  assert(context);
+  RequestState* state = (RequestState*)context;
+
+  if (events & EV_TIMEOUT) {
+    // Conn -> Fail
+    OnStateTimeout(state, Rtt_Conn);
+    StateToFail(fd, state, Request_Conn_Timeout);
+    return;
+  }
+  assert(events & EV_WRITE);
+
+  // check sockopt
+  if (TransportGetConnectError(&state->op, fd)) {
+    // Conn -> Fail
+    StateToFail(fd, state, Request_Bad_Sock_Opt);
+    return;
+  }
+
+  state->timing.conn_us = GetElapsedUs(&state->start_time);
+  AddStateRttSample(state, Rtt_Conn);
+
+  UseConnection(fd, state);
+}
+
+// start attempt to the next address of race on a new socket,
+// skipping ones failed at once, or return 0 if none is started
+unsigned char StartConnAttempt(RequestState* state) {
+  assert(state);
+  assert(state->race);
+  ConnRace* race = state->race;
+
+  unsigned char ret = 0;
+  while (!ret && race->next_addr < race->addr_list.count) {
+    size_t index = race->next_addr++;
+    const struct sockaddr* addr =
+        (const struct sockaddr*)&race->addr_list.addrs[index];
+
+    evutil_socket_t attempt_fd = CreateSocket(addr->sa_family, &race->status);
+    if (attempt_fd < 0)
+      break;
+
+    ConnAttempt* attempt = (ConnAttempt*)malloc(sizeof(ConnAttempt));
+    if (!attempt) {
+      EVUTIL_CLOSESOCKET(attempt_fd);
+      race->status = Request_Out_Of_Mem;
+      break;
+    }
+    memset(attempt, 0, sizeof(ConnAttempt));
+    attempt->fd = attempt_fd;
+    attempt->state = state;
+    event_base_gettimeofday_cached(g_event_base, &attempt->start_time);
+    ++g_conn_attempt_count;
+
+    if (!TransportAssign(&attempt->op, attempt_fd, EV_WRITE, DoConnAttempt,
+                         attempt)) {
+      race->status = Request_Event_New_Err;
+      AbortConnAttempt(attempt);
+      continue;
     }
 
-    // continue recving
-    {
-      // allocate/reallocate memory of |recv_buffer|
-      size_t previous_len = 0;
-      if (!state->buffer) {
-        // init |recv_buffer| with malloc
-        state->buffer = (char*)malloc((size_t)result + 1);
-      } else {
-        // update |previous_len|
-        previous_len = strlen(state->buffer);
-
-        // realloc memory of |recv_buffer|
-        state->buffer =
-            (char*)realloc(state->buffer, previous_len + (size_t)result + 1);
+    // connect immediately or connecting
+    if (TransportConnect(&attempt->op, attempt_fd, addr,
+                         race->addr_list.addr_lens[index]) < 0 &&
+        EVUTIL_SOCKET_ERROR() != EINPROGRESS &&
+        EVUTIL_SOCKET_ERROR() != EINTR) {
+      race->status = Request_Conn_Err;
+      AbortConnAttempt(attempt);
+      continue;
+    }
+
+    if (!TransportWaitConnect(&attempt->op, &state->timeout)) {
+      race->status = Request_Event_New_Err;
+      AbortConnAttempt(attempt);
+      continue;
+    }
+
+    race->attempts[index] = attempt;
+    ++race->active_count;
+    ret = 1;
+  }
+
+  // start the next one if this one doesn't connect in time
+  if (ret && race->next_addr < race->addr_list.count) {
+    struct timeval delay;
+    SetTimeval(&delay, CONN_ATTEMPT_DELAY_MS);
+    evtimer_add(&race->delay_timer, &delay);
+  }
+  return ret;
+}
+
+// start the next attempt, or fail if all attempts failed
+void ContinueConnRace(RequestState* state) {
+  assert(state);
+  assert(state->race);
+
+  if (!StartConnAttempt(state) && !state->race->active_count) {
+    // Conn -> Fail
+    StateToFail(-1, state, state->race->status);
+  }
+}
+
+void DoConnAttempt(evutil_socket_t fd, short events, void* context) {
+  assert(context);
+  ConnAttempt* attempt = (ConnAttempt*)context;
+  RequestState* state = attempt->state;
+
+  // aborted attempt is done
+  if (!state) {
+    FreeConnAttempt(attempt);
+    return;
+  }
+  assert(state->race);
+  ConnRace* race = state->race;
+
+  if (!(events & EV_TIMEOUT)) {
+    assert(events & EV_WRITE);
+
+    // check sockopt
+    if (!TransportGetConnectError(&attempt->op, fd)) {
+      state->timing.conn_us = GetElapsedUs(&state->start_time);
+
+      StateConnRaceToConn(fd, state, attempt);
+      return;
+    }
+  }
+
+  // drop failed attempt, and try the next address at once
+  race->status = events & EV_TIMEOUT ? Request_Conn_Timeout
+                                     : Request_Bad_Sock_Opt;
+  if (events & EV_TIMEOUT)
+    OnStateTimeout(state, Rtt_Conn);
+  for (size_t i = 0; i < race->addr_list.count; ++i) {
+    if (race->attempts[i] == attempt)
+      race->attempts[i] = NULL;
+  }
+  --race->active_count;
+  AbortConnAttempt(attempt);
+
+  ContinueConnRace(state);
+}
+
+void DoConnDelay(evutil_socket_t fd, short events, void* context) {
+  (void)(fd);
+  (void)(events);
+  assert(context);
+
+  ContinueConnRace((RequestState*)context);
+}
+
+// start request on new connection by scheme and HTTP/2 mode
+void UseConnection(evutil_socket_t fd, RequestState* state) {
+  assert(state);
+
+  if (state->is_https) {
+    // Conn -> Handshake
+    StateConnToHandshake(fd, state);
+  } else if (g_http2_mode == Http2_Prior_Knowledge) {
+    // Conn -> Stream
+    StateConnToStream(fd, state);
+  } else {
+    // Conn -> Send
+    StateConnToSend(fd, state);
+  }
+}
+
+void DoHandshake(evutil_socket_t fd, short events, void* context) {
+  assert(context);
+  RequestState* state = (RequestState*)context;
+
+  if (events & EV_TIMEOUT) {
+    // Handshake -> Fail
+    OnStateTimeout(state, Rtt_Conn);
+    StateToFail(fd, state, Request_Conn_Timeout);
+    return;
+  }
+  assert(events & EV_WRITE);
+
+  // failed handshake is reported by sending
+  if (TransportIsHttp2(fd)) {
+    // Handshake -> Stream
+    StateConnToStream(fd, state);
+  } else {
+    // Handshake -> Send
+    StateConnToSend(fd, state);
+  }
+}
+
+void DoSend(evutil_socket_t fd, short events, void* context) {
+  assert(context);
+  RequestState* state = (RequestState*)context;
+
+  if (events & EV_TIMEOUT) {
+    // Send -> Fail
+    OnStateTimeout(state, Rtt_Conn);
+    StateToFail(fd, state, Request_Send_Timeout);
+    return;
+  }
+  assert(events & EV_WRITE);
+
+  size_t send_upto = strlen(state->buffer);
+  while (state->n_sent < send_upto) {
+    ssize_t result = TransportSend(&state->op, fd,
+                                   state->buffer + state->n_sent,
+                                   send_upto - state->n_sent);
+    if (result < 0) {
+      // continue in next term
+      if (EVUTIL_SOCKET_ERROR() == EAGAIN) {
+        if (!WaitSend(state))
+          StateToFail(fd, state, Request_Event_New_Err);
+        return;
       }
 
-      if (!state->buffer) {
-        // Recv -> Fail
-        StateToFail(fd, state, Request_Out_Of_Mem);
+      // pooled connection closed by peer
+      if (state->is_reused) {
+        // Send -> Init
+        StateToInit(fd, state);
         return;
       }
 
-      // make |recv_buffer| C-style string
-      state->buffer[previous_len] = 0;
+      // Send -> Fail
+      StateToFail(fd, state,
+                  EVUTIL_SOCKET_ERROR() == EPROTO ? Request_Tls_Err
+                                                  : Request_Send_Err);
+      return;
+    }
+    assert(result != 0);
+
+    // continue sending
+    state->n_sent += (size_t)result;
+  }
+
+  // finish sending
+  assert(state->n_sent == send_upto);
+
+  // Send -> Recv
+  StateSendToRecv(fd, state);
+}
+
+// submit request of |state| as a stream of |session|, or return 0 if
+// failed (|state| must not be touched after succeeded, since it may be
+// failed by closing |session|)
+unsigned char SubmitStream(RequestState* state, Http2Session* session) {
+  assert(state);
+  assert(session);
+
+  char* path = HTParse(state->url, NULL, PARSE_PATH | PARSE_PUNCTUATION);
+  if (!path)
+    return 0;
+
+  // recv |buffer| is always C-style string (empty body of Done)
+  InitStreamScan(state);
+  if (!ReserveRecvBuffer(state)) {
+    free((void*)path);
+    return 0;
+  }
+  state->buffer[0] = 0;
+  SetStateTimeout(state, Rtt_Response, g_recv_timeout_ms, 1);
+
+  // validators of cached page follow common headers
+  Http2Header headers[HTTP2_GET_HEADER_COUNT + 2];
+  size_t header_count = HTTP2_GET_HEADER_COUNT;
+  memcpy(headers, g_http2_get_headers, sizeof g_http2_get_headers);
+  if (state->validators.etag) {
+    headers[header_count].name = "if-none-match";
+    headers[header_count++].value = state->validators.etag;
+  }
+  if (state->validators.last_modified) {
+    headers[header_count].name = "if-modified-since";
+    headers[header_count++].value = state->validators.last_modified;
+  }
+
+  unsigned char ret =
+      Http2SessionSubmit(session, path, headers, header_count,
+                         OnStreamHeader, DoStream, state, &state->timeout);
+  free((void*)path);
+  return ret;
+}
+
+unsigned char DoStream(Http2StreamEvent event,
+                       const char* data,
+                       size_t len,
+                       void* context) {
+  assert(context);
+  RequestState* state = (RequestState*)context;
+
+  switch (event) {
+    case Http2_Stream_Headers:
+      // skip informational responses
+      if (state->scan.parser.status_code < 200)
+        return 1;
+
+      state->timing.ttfb_us = GetElapsedUs(&state->start_time);
+      AddStateRttSample(state, Rtt_Response);
+
+      // body of other responses is not used
+      if (state->scan.parser.status_code != 200 && !IsNotModified(state)) {
+        // Stream -> Fail
+        StateToFail(-1, state, Request_Response_Err);
+        return 0;
+      }
+      if (!CheckResponseContent(state)) {
+        // Stream -> Fail
+        StateToFail(-1, state, state->scan.error_status);
+        return 0;
+      }
+      return 1;
+
+    case Http2_Stream_Data:
+      if (!AppendStreamBody(state, data, len)) {
+        // Stream -> Fail
+        StateToFail(-1, state, state->scan.error_status);
+        return 0;
+      }
+      return 1;
+
+    case Http2_Stream_Done:
+      if (state->scan.parser.status_code != 200 && !IsNotModified(state)) {
+        // Stream -> Fail
+        StateToFail(-1, state, Request_Response_Err);
+        return 0;
+      }
+      if (!IsBodyInflated(state)) {
+        // Stream -> Fail
+        StateToFail(-1, state, Request_Decode_Err);
+        return 0;
+      }
+
+      // Stream -> Succ
+      StateStreamToSucc(state);
+      return 0;
+
+    case Http2_Stream_Refused:
+    case Http2_Stream_Send_Err:
+    case Http2_Stream_Recv_Err:
+      // session was going away or closed by peer before response
+      if (state->is_reused && state->timing.ttfb_us < 0) {
+        // Stream -> Init
+        StateStreamToInit(state);
+        return 0;
+      }
+
+      // Stream -> Fail
+      StateToFail(-1, state,
+                  event == Http2_Stream_Refused
+                      ? Request_Response_Err
+                      : event == Http2_Stream_Send_Err ? Request_Send_Err
+                                                        : Request_Recv_Err);
+      return 0;
+
+    case Http2_Stream_Tls_Err:
+      // Stream -> Fail
+      StateToFail(-1, state, Request_Tls_Err);
+      return 0;
+
+    case Http2_Stream_Timeout:
+      // Stream -> Fail
+      OnStateTimeout(state, Rtt_Response);
+      StateToFail(-1, state, Request_Recv_Timeout);
+      return 0;
+
+    case Http2_Stream_Reset:
+    default:
+      // Stream -> Fail
+      StateToFail(-1, state, Request_Response_Err);
+      return 0;
+  }
+}
+
+void DoRecv(evutil_socket_t fd, short events, void* context) {
+  assert(context);
+  RequestState* state = (RequestState*)context;
+
+  if (events & EV_TIMEOUT) {
+    // Recv -> Fail
+    OnStateTimeout(state, Rtt_Response);
+    StateToFail(fd, state, Request_Recv_Timeout);
+    return;
+  }
+  assert(events & EV_READ);
 
-      // append |buffer| to |recv_buffer|
-      strncat(state->buffer, buffer, (size_t)result);
+  // data passed from previous pipelined response may be complete already
+  // (scan it only once, since new data may be recved after it by io_uring)
+  ResponseParseResult parse_result =
+      state->buffer_len && !state->scan.parser.parsed_len
+          ? ScanResponse(state)
+          : Response_Parse_Incomplete;
+  unsigned char is_closed = 0;
+
+  while (parse_result == Response_Parse_Incomplete) {
+    // grow |buffer| before recving
+    if (!ReserveRecvBuffer(state)) {
+      // Recv -> Fail
+      StateToFail(fd, state, Request_Out_Of_Mem);
+      return;
     }
 
-    // process content length
-    {
-      // try parse |content_length| from |recv_buffer|
-      if (!state->content_length) {
-        const char* cont_len_str = strstr(state->buffer, CONTENT_LENGTH_START);
-        // try parse |content_length| after receiving full line
-        if (cont_len_str && strstr(cont_len_str, CONTENT_LENGTH_END)) {
-          size_t val = 0;
-          if (EOF != sscanf(cont_len_str, CONTENT_LENGTH_TEMPLATE, &val))
-            state->content_length = val;
-        }
+    ssize_t result = TransportRecv(&state->op, fd,
+                                   state->buffer + state->buffer_len,
+                                   state->buffer_cap - state->buffer_len);
+    if (result < 0) {
+      // continue in next term
+      if (EVUTIL_SOCKET_ERROR() == EAGAIN) {
+        if (!WaitRecv(state))
+          StateToFail(fd, state, Request_Event_New_Err);
+        return;
+      }
+
+      // pooled connection reset by peer
+      if (state->is_reused && !state->buffer_len) {
+        // Recv -> Init
+        StateToInit(fd, state);
+        return;
       }
 
-      // check length of content
-      if (state->content_length) {
-        char* cont_str = strstr(state->buffer, CONTENT_START);
-        if (cont_str) {
-          // move to the start of content data
-          cont_str += sizeof CONTENT_START - 1;
-
-          // check if recv sufficient data
-          if (cont_str && strlen(cont_str) >= state->content_length) {
-            // trunk recv buffer by |content_length|
-            cont_str[state->content_length] = 0;
-
-            // succeeded
-            break;
-          }
-        }
+      // Recv -> Fail
+      StateToFail(fd, state,
+                  EVUTIL_SOCKET_ERROR() == EPROTO ? Request_Tls_Err
+                                                  : Request_Recv_Err);
+      return;
+
+    } else if (result == 0) {
+      // pooled connection closed by peer
+      if (state->is_reused && !state->buffer_len) {
+        // Recv -> Init
+        StateToInit(fd, state);
+        return;
       }
+
+      // succeeded (connection closed, can't be reused)
+      is_closed = 1;
+      break;
     }
+
+    // continue recving
+    if (state->timing.ttfb_us < 0) {
+      state->timing.ttfb_us = GetElapsedUs(&state->start_time);
+      AddStateRttSample(state, Rtt_Response);
+    }
+    state->buffer_len += (size_t)result;
+
+    // make |buffer| C-style string
+    state->buffer[state->buffer_len] = 0;
+
+    // check if recv complete response
+    parse_result = ScanResponse(state);
   }
 
-  if (!state->buffer) {
+  if (!state->buffer_len) {
     // Recv -> Fail
     StateToFail(fd, state, Request_Recv_Err);
     return;
   }
 
-  // check response status code
-  unsigned status_code;
-  sscanf(state->buffer, RESPONSE_STATUS_TEMPLATE, &status_code);
+  if (parse_result == Response_Parse_Error) {
+    // Recv -> Fail
+    StateToFail(fd, state, state->scan.error_status);
+    return;
+  }
+
+  // status line and headers must be complete
+  if (!state->scan.parser.body_offset) {
+    // Recv -> Fail
+    StateToFail(fd, state, Request_Response_Err);
+    return;
+  }
+
+  if (is_closed)
+    state->scan.response_len = state->buffer_len;
+  size_t remaining_len = state->buffer_len - state->scan.response_len;
+
+  // reuse connection only if no extra data except pipelined responses
+  state->is_keep_alive = !is_closed && state->scan.parser.is_keep_alive &&
+                         (!remaining_len || state->pipeline_next);
+
+  // pass connection and remaining data to next pipelined request
+  RequestState* pipeline = state->pipeline_next;
+  state->pipeline_next = NULL;
+
+  evutil_socket_t pipeline_fd = -1;
+  char* pipeline_buffer = NULL;
+  if (pipeline && state->is_keep_alive) {
+    if (remaining_len) {
+      pipeline_buffer =
+          (char*)ArenaAlloc(&pipeline->arena, remaining_len + 1);
+      if (pipeline_buffer) {
+        memcpy(pipeline_buffer, state->buffer + state->scan.response_len,
+               remaining_len);
+        pipeline_buffer[remaining_len] = 0;
+      }
+    }
+    if (!remaining_len || pipeline_buffer) {
+      pipeline_fd = fd;
+      fd = -1;
+    } else {
+      // can't pass remaining data, so drop the connection
+      state->is_keep_alive = 0;
+    }
+  }
+
+  // trunk recv buffer by end of response
+  state->buffer[state->scan.response_len] = 0;
+  state->buffer_len = state->scan.response_len;
+
+  // check response status code, and end of encoded body
+  if (state->scan.parser.status_code != 200 && !IsNotModified(state)) {
+    // body is drained already, so put socket back to pool
+    if (fd >= 0 && state->is_keep_alive) {
+      TransformStateEvent(state, -1, 0, NULL, RequireFree);
+      ConnPoolPut(g_event_base, state->conn_key, fd);
+      fd = -1;
+    }
 
-  if (status_code == 200) {
+    // Recv -> Fail
+    StateToFail(fd, state, Request_Response_Err);
+  } else if (!IsBodyInflated(state)) {
+    // Recv -> Fail
+    StateToFail(fd, state, Request_Decode_Err);
+  } else {
     // Recv -> Succ
     StateRecvToSucc(fd, state);
+  }
+
+  if (pipeline_fd >= 0) {
+    // Queued -> Recv
+    StateQueuedToRecv(pipeline_fd, pipeline, pipeline_buffer, remaining_len);
   } else {
-    // Recv -> Fail
-    StateToFail(fd, state, Request_Response_Err);
+    // Queued -> Init
+    RestartPipeline(pipeline);
   }
 }
 
@@ -579,50 +2224,195 @@ void DoRecv(evutil_socket_t fd, short events, void* context) {
 // export functions
 //
 
-void Request(const char* url, request_callback_fn callback, void* context) {
+// init |g_event_base|, |g_evdns_base| and pools only once per thread
+void InitLibEvent() {
+  if (g_event_base)
+    return;
+
+  g_event_base = event_base_new();
+  assert(g_event_base);
+
+  g_evdns_base = evdns_base_new(g_event_base, 1);
+  assert(g_evdns_base);
+
+  InitTransport(g_event_base);
+
+  g_state_pool = CreateSlabPool(sizeof(RequestState) + STATE_ARENA_SIZE,
+                                STATE_POOL_SLAB_SIZE);
+  assert(g_state_pool);
+
+  g_arena_block_pool =
+      CreateArenaBlockPool(ARENA_BLOCK_SIZE, ARENA_BLOCK_POOL_SLAB_SIZE);
+  assert(g_arena_block_pool);
+}
+
+void RequestConditional(const char* url,
+                        const RequestValidators* validators,
+                        yeild_body_data_callback_fn body_callback,
+                        request_callback_fn callback,
+                        void* context) {
   assert(url);
 
-  // init |g_event_base| only once
-  if (!g_event_base) {
-    g_event_base = event_base_new();
-    assert(g_event_base);
-  }
+  InitLibEvent();
 
-  // create socket or add to pending list
-  evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (fd <= 0) {
-    if (EVUTIL_SOCKET_ERROR() == EMFILE || EVUTIL_SOCKET_ERROR() == ENFILE) {
-      // reach fd limit
-      callback(url, Request_Fd_Limit, NULL, context);
-    } else {
-      // unexpected socket error
-      callback(url, Request_Socket_Err, NULL, context);
-    }
-    return;
+  // parse |host| and |conn_key| from |url| (checked when resolving)
+  char* host = HTParse(url, NULL, PARSE_HOST);
+  char* conn_key = HTParse(url, NULL,
+                           PARSE_ACCESS | PARSE_HOST | PARSE_PUNCTUATION);
+  if (host && !conn_key) {
+    free((void*)host);
+    host = NULL;
   }
 
-  // make socket non-blocking
-  assert(0 == evutil_make_socket_nonblocking(fd));
+  // multiplex on HTTP/2 session to |conn_key|,
+  // or pipeline after the request being sent to |conn_key|,
+  // or reuse idle connection to |conn_key|,
+  // or connect after resolving (socket is created for resolved address)
+  Http2Session* session = host ? GetHttp2Session(conn_key) : NULL;
+  RequestState* head = host && !session
+                           ? (RequestState*)ConnPoolGetPipeline(conn_key)
+                           : NULL;
+  evutil_socket_t fd = -1;
+  if (!session && !head && host)
+    fd = ConnPoolGet(conn_key);
+  unsigned char is_reused = session || fd >= 0;
 
   // init state for current request
   RequestState* state = CreateState(url, callback, context);
   if (!state) {
-    EVUTIL_CLOSESOCKET(fd);
+    if (host)
+      free((void*)host);
+    if (conn_key)
+      free((void*)conn_key);
+    if (fd >= 0)
+      TransportClose(fd);
     callback(url, Request_Out_Of_Mem, NULL, context);
     return;
   }
+  state->host = host;
+  state->conn_key = conn_key;
+  state->is_https =
+      !strncmp(url, URL_HTTPS_SCHEME, sizeof URL_HTTPS_SCHEME - 1);
+  state->is_reused = is_reused;
+  state->body_callback = body_callback;
+
+  // copy validators to send
+  if (validators) {
+    if (validators->etag)
+      state->validators.etag = ArenaCopyString(&state->arena, validators->etag);
+    if (validators->last_modified)
+      state->validators.last_modified =
+          ArenaCopyString(&state->arena, validators->last_modified);
+    if ((validators->etag && !state->validators.etag) ||
+        (validators->last_modified && !state->validators.last_modified)) {
+      StateToFail(fd, state, Request_Out_Of_Mem);
+      return;
+    }
+  }
+
+  if (session) {
+    state->timing.conn_us = GetElapsedUs(&state->start_time);
+
+    // Init -> Stream
+    StateInitToStream(state, session);
+    return;
+  }
+
+  if (head) {
+    // Init -> Queued
+    StateInitToQueued(head, state);
+    return;
+  }
 
   // start state machine
   DoInit(fd, 0, state);
 }
 
+void RequestStream(const char* url,
+                   yeild_body_data_callback_fn body_callback,
+                   request_callback_fn callback,
+                   void* context) {
+  RequestConditional(url, NULL, body_callback, callback, context);
+}
+
+void Request(const char* url, request_callback_fn callback, void* context) {
+  RequestStream(url, NULL, callback, context);
+}
+
+const RequestTiming* GetRequestTiming() {
+  return g_callback_timing;
+}
+
+const RequestValidators* GetResponseValidators() {
+  return g_callback_validators;
+}
+
+struct event_base* GetLibEventBase() {
+  InitLibEvent();
+  return g_event_base;
+}
+
+void SetRequestTimeout(unsigned conn_timeout_ms,
+                       unsigned send_timeout_ms,
+                       unsigned recv_timeout_ms) {
+  g_conn_timeout_ms = conn_timeout_ms;
+  g_send_timeout_ms = send_timeout_ms;
+  g_recv_timeout_ms = recv_timeout_ms;
+}
+
+unsigned char SetRequestTimeoutRange(unsigned min_timeout_ms,
+                                     unsigned max_timeout_ms) {
+  return SetRttTimeoutRange(min_timeout_ms, max_timeout_ms);
+}
+
+void SetRequestMaxBodySize(size_t max_body_size) {
+  g_max_body_size = max_body_size ? max_body_size : DEFAULT_MAX_BODY_SIZE;
+}
+
+void SetRequestHttp2Mode(Http2Mode mode) {
+  g_http2_mode = mode;
+}
+
 void DispatchLibEvent() {
-  if (g_event_base)
-    event_base_dispatch(g_event_base);
+  if (!g_event_base)
+    return;
+
+  // |g_evdns_base| keeps its nameserver events pending,
+  // so loop until all requests (and aborted connect attempts, and
+  // closed HTTP/2 sessions) are done instead of |event_base_dispatch|
+  // submit operations queued by callbacks in batch before each loop
+  while (g_request_state_count || g_conn_attempt_count ||
+         GetHttp2ClosingSessionCount()) {
+    FlushTransport();
+    event_base_loop(g_event_base, EVLOOP_ONCE);
+  }
+
+  // submit closing sockets of the last requests
+  FlushTransport();
 }
 
 void FreeLibEvent() {
-  if (g_event_base)
+  // close idle sessions, and wait for their pending operations
+  CloseHttp2Sessions();
+  DispatchLibEvent();
+
+  ConnPoolClear();
+  if (g_evdns_base)
+    evdns_base_free(g_evdns_base, 0);
+  if (g_event_base) {
+    FreeTransport();
     event_base_free(g_event_base);
+  }
   assert(g_request_state_count == 0);
+  assert(g_conn_attempt_count == 0);
+
+  if (g_state_pool)
+    FreeSlabPool(g_state_pool);
+  if (g_arena_block_pool)
+    FreeSlabPool(g_arena_block_pool);
+
+  g_evdns_base = NULL;
+  g_event_base = NULL;
+  g_state_pool = NULL;
+  g_arena_block_pool = NULL;
 }
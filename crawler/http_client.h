@@ -5,12 +5,16 @@
 #ifndef HTTP_CLIENT
 #define HTTP_CLIENT
 
+#include <stddef.h>
+
+struct event_base;
+
 typedef enum {
   Request_Fd_Limit,       // socket errno == EMFILE || ENFILE
   Request_Socket_Err,     // unknown socket() errors
   Request_Out_Of_Mem,     // out of memory
-  Request_Event_New_Err,  // event_new() failed
-  Request_Bad_Hostname,   // invalid host or failed in getaddrinfo()
+  Request_Event_New_Err,  // event_assign() or transport wait failed
+  Request_Bad_Hostname,   // invalid host or failed in evdns_getaddrinfo()
   Request_Conn_Err,       // unknown connect() errors
   Request_Conn_Timeout,   // connect() timeout
   Request_Bad_Sock_Opt,   // invalid sockopt
@@ -20,16 +24,98 @@ typedef enum {
   Request_Recv_Timeout,   // recv() timeout
   Request_Succ,           // HTTP response 200
   Request_Response_Err,   // HTTP response not 200
+  Request_Decode_Err,     // failed to decode content
+  Request_Too_Large,      // content exceeds the size limit
+  Request_Not_Html,       // content type is not html
+  Request_Tls_Err,        // TLS setup or handshake failed
+  Request_Not_Modified,   // HTTP response 304 to conditional request
 } RequestStatus;
 
+typedef enum {
+  Http2_Off,              // HTTP/1.1 only
+  Http2_Tls,              // negotiate h2 by ALPN over TLS
+  Http2_Prior_Knowledge,  // also h2c (without upgrade) for http urls
+} Http2Mode;
+
 // async once callback
 typedef void (*request_callback_fn)(const char* url,
                                     RequestStatus status,
                                     const char* html,
                                     void* context);
 
+// async multi callback
+typedef void (*yeild_body_data_callback_fn)(const char* url,
+                                            const char* data,
+                                            size_t len,
+                                            void* context);
+
+// elapsed time of a request since it started (-1 if not reached)
+typedef struct {
+  long conn_us;  // connection established (or taken from pool)
+  long ttfb_us;  // first byte of response received
+} RequestTiming;
+
+// validators of a page (NULL if not given)
+typedef struct {
+  const char* etag;           // ETag (sent as If-None-Match)
+  const char* last_modified;  // Last-Modified (sent as If-Modified-Since)
+} RequestValidators;
+
 void Request(const char* url, request_callback_fn callback, void* context);
 
+// same as |Request|, but pass body of HTTP 200 response to |body_callback|
+// piece by piece while receiving (then |callback| gets NULL |html|)
+void RequestStream(const char* url,
+                   yeild_body_data_callback_fn body_callback,
+                   request_callback_fn callback,
+                   void* context);
+
+// same as |RequestStream|, but only fetch the page if it's changed since
+// |validators| (from the last response), or |callback| gets
+// |Request_Not_Modified| (and NULL |html|)
+void RequestConditional(const char* url,
+                        const RequestValidators* validators,
+                        yeild_body_data_callback_fn body_callback,
+                        request_callback_fn callback,
+                        void* context);
+
+// set timeouts of connecting, sending and recving (5s by default),
+// which apply to states started after calling, until rtt of host is
+// measured (call before any other thread starts requests)
+void SetRequestTimeout(unsigned conn_timeout_ms,
+                       unsigned send_timeout_ms,
+                       unsigned recv_timeout_ms);
+
+// set range of timeouts adapted by smoothed rtt and its variance of
+// each host (1s ~ 30s by default, 0 to keep default),
+// or return 0 if it's empty
+// (call before any other thread starts requests)
+unsigned char SetRequestTimeoutRange(unsigned min_timeout_ms,
+                                     unsigned max_timeout_ms);
+
+// set size limit of body (64MB by default, 0 to keep default), checked by
+// Content-Length before recving body, or by body recved and inflated
+// (call before any other thread starts requests)
+void SetRequestMaxBodySize(size_t max_body_size);
+
+// set when to use HTTP/2 (|Http2_Tls| by default), which multiplexes
+// requests to the same host as streams of one connection
+// (call before any other thread starts requests)
+void SetRequestHttp2Mode(Http2Mode mode);
+
+// timing of the request being called back
+// (only valid inside |request_callback_fn|, NULL if not started)
+const RequestTiming* GetRequestTiming();
+
+// validators of response of the request being called back
+// (only valid inside |request_callback_fn|, NULL if not started)
+const RequestValidators* GetResponseValidators();
+
+// event base of current thread (requests of each thread are
+// dispatched by its own event base)
+struct event_base* GetLibEventBase();
+
+// dispatch until all requests of current thread are done
 void DispatchLibEvent();
 void FreeLibEvent();
 
@@ -0,0 +1,215 @@
+// Slab pool and arena allocators
+//   by BOT Man & ZhangHan, 2018
+
+#include "mem_pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// align all objects/allocations for any type
+#define MEM_ALIGN 16
+#define ALIGN_UP(len) (((len) + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1))
+
+//
+// slab pool
+//
+
+typedef struct _Slab {
+  struct _Slab* next;
+} Slab;
+
+typedef struct _FreeObject {
+  struct _FreeObject* next;
+} FreeObject;
+
+struct _SlabPool {
+  size_t object_size;
+  size_t objects_per_slab;
+
+  // allocated slabs and recycled objects
+  Slab* slabs;
+  FreeObject* free_objects;
+};
+
+// objects follow slab header
+#define SLAB_HEADER_SIZE ALIGN_UP(sizeof(Slab))
+
+SlabPool* CreateSlabPool(size_t object_size, size_t objects_per_slab) {
+  assert(object_size);
+  assert(objects_per_slab);
+
+  SlabPool* ret = (SlabPool*)malloc(sizeof(SlabPool));
+  if (!ret)
+    return NULL;
+
+  ret->object_size = ALIGN_UP(object_size);
+  ret->objects_per_slab = objects_per_slab;
+  ret->slabs = NULL;
+  ret->free_objects = NULL;
+  return ret;
+}
+
+void FreeSlabPool(SlabPool* pool) {
+  assert(pool);
+
+  while (pool->slabs) {
+    Slab* next = pool->slabs->next;
+    free((void*)pool->slabs);
+    pool->slabs = next;
+  }
+  free((void*)pool);
+}
+
+// allocate a new slab and put all its objects to free list
+unsigned char GrowSlabPool(SlabPool* pool) {
+  Slab* slab = (Slab*)malloc(SLAB_HEADER_SIZE +
+                             pool->object_size * pool->objects_per_slab);
+  if (!slab)
+    return 0;
+
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  char* objects = (char*)slab + SLAB_HEADER_SIZE;
+  for (size_t i = pool->objects_per_slab; i > 0; --i) {
+    FreeObject* object = (FreeObject*)(objects + pool->object_size * (i - 1));
+    object->next = pool->free_objects;
+    pool->free_objects = object;
+  }
+  return 1;
+}
+
+void* SlabPoolAlloc(SlabPool* pool) {
+  assert(pool);
+
+  if (!pool->free_objects && !GrowSlabPool(pool))
+    return NULL;
+
+  FreeObject* object = pool->free_objects;
+  pool->free_objects = object->next;
+  return (void*)object;
+}
+
+void SlabPoolFree(SlabPool* pool, void* object) {
+  assert(pool);
+  assert(object);
+
+  FreeObject* free_object = (FreeObject*)object;
+  free_object->next = pool->free_objects;
+  pool->free_objects = free_object;
+}
+
+//
+// arena
+//
+
+typedef struct _ArenaBlock {
+  struct _ArenaBlock* next;
+  size_t cap;
+} ArenaBlock;
+
+// data follow block header
+#define BLOCK_HEADER_SIZE ALIGN_UP(sizeof(ArenaBlock))
+
+SlabPool* CreateArenaBlockPool(size_t block_cap, size_t blocks_per_slab) {
+  return CreateSlabPool(BLOCK_HEADER_SIZE + block_cap, blocks_per_slab);
+}
+
+void InitArena(Arena* arena,
+               char* first_block,
+               size_t first_block_cap,
+               SlabPool* block_pool,
+               size_t block_pool_cap) {
+  assert(arena);
+  assert(first_block || !first_block_cap);
+  assert(!block_pool || block_pool_cap);
+
+  arena->first_block = first_block;
+  arena->first_block_cap = first_block_cap;
+  arena->block_pool = block_pool;
+  arena->block_pool_cap = block_pool_cap;
+  arena->blocks = NULL;
+  arena->block = first_block;
+  arena->block_len = 0;
+  arena->block_cap = first_block_cap;
+}
+
+void FreeArena(Arena* arena) {
+  assert(arena);
+
+  ArenaBlock* block = (ArenaBlock*)arena->blocks;
+  while (block) {
+    ArenaBlock* next = block->next;
+    if (arena->block_pool && block->cap == arena->block_pool_cap)
+      SlabPoolFree(arena->block_pool, (void*)block);
+    else
+      free((void*)block);
+    block = next;
+  }
+
+  InitArena(arena, arena->first_block, arena->first_block_cap,
+            arena->block_pool, arena->block_pool_cap);
+}
+
+void* ArenaAlloc(Arena* arena, size_t len) {
+  assert(arena);
+
+  len = ALIGN_UP(len ? len : 1);
+  if (arena->block_cap - arena->block_len < len) {
+    unsigned char is_pool_fit =
+        arena->block_pool && len <= arena->block_pool_cap;
+
+    // take block from pool if fit, or allocate exact size from heap
+    ArenaBlock* block =
+        is_pool_fit ? (ArenaBlock*)SlabPoolAlloc(arena->block_pool)
+                    : (ArenaBlock*)malloc(BLOCK_HEADER_SIZE + len);
+    if (!block)
+      return NULL;
+
+    block->next = (ArenaBlock*)arena->blocks;
+    block->cap = is_pool_fit ? arena->block_pool_cap : len;
+    arena->blocks = block;
+
+    // keep using current block if the new one is used up at once
+    if (!is_pool_fit)
+      return (char*)block + BLOCK_HEADER_SIZE;
+
+    arena->block = (char*)block + BLOCK_HEADER_SIZE;
+    arena->block_len = 0;
+    arena->block_cap = block->cap;
+  }
+
+  void* ret = arena->block + arena->block_len;
+  arena->block_len += len;
+  return ret;
+}
+
+char* ArenaCopyString(Arena* arena, const char* src) {
+  assert(src);
+
+  size_t len = strlen(src);
+  char* ret = (char*)ArenaAlloc(arena, len + 1);
+  if (!ret)
+    return NULL;
+
+  memcpy(ret, src, len + 1);
+  return ret;
+}
+
+unsigned char IsArenaOwned(const Arena* arena, const void* ptr) {
+  assert(arena);
+  const char* p = (const char*)ptr;
+
+  if (arena->first_block && p >= arena->first_block &&
+      p < arena->first_block + arena->first_block_cap)
+    return 1;
+
+  for (const ArenaBlock* block = (const ArenaBlock*)arena->blocks; block;
+       block = block->next) {
+    const char* data = (const char*)block + BLOCK_HEADER_SIZE;
+    if (p >= data && p < data + block->cap)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+// Slab pool and arena allocators
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef MEM_POOL
+#define MEM_POOL
+
+#include <stddef.h>
+
+// fixed-size objects carved from slabs, and recycled by a free list
+
+struct _SlabPool;
+typedef struct _SlabPool SlabPool;
+
+SlabPool* CreateSlabPool(size_t object_size, size_t objects_per_slab);
+void FreeSlabPool(SlabPool* pool);
+
+void* SlabPoolAlloc(SlabPool* pool);
+void SlabPoolFree(SlabPool* pool, void* object);
+
+// bump allocator freeing all allocations at once,
+// starting from |first_block|, then blocks from |block_pool| (if fit)
+// or from heap
+
+typedef struct {
+  // given first block
+  char* first_block;
+  size_t first_block_cap;
+
+  // blocks to allocate later
+  SlabPool* block_pool;
+  size_t block_pool_cap;
+
+  // allocated blocks (linked list, the latest first)
+  void* blocks;
+
+  // current block and its used/allocated length
+  char* block;
+  size_t block_len;
+  size_t block_cap;
+} Arena;
+
+// pool of blocks holding |block_cap| bytes for |InitArena|
+SlabPool* CreateArenaBlockPool(size_t block_cap, size_t blocks_per_slab);
+
+void InitArena(Arena* arena,
+               char* first_block,
+               size_t first_block_cap,
+               SlabPool* block_pool,
+               size_t block_pool_cap);
+void FreeArena(Arena* arena);
+
+void* ArenaAlloc(Arena* arena, size_t len);
+char* ArenaCopyString(Arena* arena, const char* src);
+unsigned char IsArenaOwned(const Arena* arena, const void* ptr);
+
+#endif  // MEM_POOL
@@ -0,0 +1,237 @@
+// Process-wide url -> validators & links cache for recrawls
+//   by BOT Man & ZhangHan, 2018
+
+#include "page_cache.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// use C++ fstream to load/save cache file
+#include <fstream>
+
+// use C++ string, vector & map to store pages
+#include <map>
+#include <string>
+#include <vector>
+
+// use C++ mutex to share cache between threads
+#include <mutex>
+
+// lines of cache file: a page line followed by its validator/link lines
+#define PAGE_CACHE_PAGE_PREFIX "P "
+#define PAGE_CACHE_ETAG_PREFIX "E "
+#define PAGE_CACHE_LAST_MODIFIED_PREFIX "M "
+#define PAGE_CACHE_LINK_PREFIX "L "
+#define PAGE_CACHE_PREFIX_LEN 2
+
+typedef std::vector<std::string> PageLinks;
+
+struct CachedPage {
+  // empty if not given
+  std::string etag;
+  std::string last_modified;
+
+  PageLinks links;
+};
+
+// url -> cached page
+typedef std::map<std::string, CachedPage> PageCacheMap;
+
+// url -> links of page being fetched
+typedef std::map<std::string, PageLinks> PendingLinkMap;
+
+PageCacheMap& g_page_cache_map() {
+  static PageCacheMap page_cache_map;
+  return page_cache_map;
+}
+
+PendingLinkMap& g_pending_link_map() {
+  static PendingLinkMap pending_link_map;
+  return pending_link_map;
+}
+
+// guard maps above and stats below
+std::mutex& g_page_cache_lock() {
+  static std::mutex page_cache_lock;
+  return page_cache_lock;
+}
+
+size_t g_page_cache_not_modified_count;
+size_t g_page_cache_fetched_count;
+
+// copy |str| to C-style string (free it by caller), or NULL if empty
+char* CopyCachedString(const std::string& str) {
+  if (str.empty())
+    return NULL;
+
+  char* ret = (char*)malloc(str.size() + 1);
+  if (ret)
+    memcpy(ret, str.c_str(), str.size() + 1);
+  return ret;
+}
+
+// |str| can be stored in a line of cache file
+bool IsCacheableLine(const std::string& str) {
+  return str.find_first_of("\r\n") == std::string::npos;
+}
+
+unsigned char LoadPageCache(const char* path) {
+  assert(path);
+
+  std::ifstream file(path);
+  if (!file)
+    return 1;
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  CachedPage* page = NULL;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.size() <= PAGE_CACHE_PREFIX_LEN)
+      continue;
+
+    std::string prefix = line.substr(0, PAGE_CACHE_PREFIX_LEN);
+    std::string value = line.substr(PAGE_CACHE_PREFIX_LEN);
+    if (prefix == PAGE_CACHE_PAGE_PREFIX)
+      page = &g_page_cache_map()[value];
+    else if (!page)
+      continue;  // skip lines of unknown page
+    else if (prefix == PAGE_CACHE_ETAG_PREFIX)
+      page->etag = value;
+    else if (prefix == PAGE_CACHE_LAST_MODIFIED_PREFIX)
+      page->last_modified = value;
+    else if (prefix == PAGE_CACHE_LINK_PREFIX)
+      page->links.push_back(value);
+  }
+  return !file.bad();
+}
+
+unsigned char SavePageCache(const char* path) {
+  assert(path);
+
+  std::ofstream file(path);
+  if (!file)
+    return 0;
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  for (PageCacheMap::const_iterator iter = g_page_cache_map().begin();
+       iter != g_page_cache_map().end(); ++iter) {
+    const CachedPage& page = iter->second;
+    file << PAGE_CACHE_PAGE_PREFIX << iter->first << '\n';
+    if (!page.etag.empty())
+      file << PAGE_CACHE_ETAG_PREFIX << page.etag << '\n';
+    if (!page.last_modified.empty())
+      file << PAGE_CACHE_LAST_MODIFIED_PREFIX << page.last_modified << '\n';
+    for (PageLinks::const_iterator link = page.links.begin();
+         link != page.links.end(); ++link)
+      file << PAGE_CACHE_LINK_PREFIX << *link << '\n';
+  }
+  file.flush();
+  return file.good();
+}
+
+unsigned char PageCacheGetValidators(const char* url,
+                                     char** etag,
+                                     char** last_modified) {
+  assert(url);
+  assert(etag);
+  assert(last_modified);
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  PageCacheMap::const_iterator iter = g_page_cache_map().find(url);
+  if (iter == g_page_cache_map().end())
+    return 0;
+
+  *etag = CopyCachedString(iter->second.etag);
+  *last_modified = CopyCachedString(iter->second.last_modified);
+  return 1;
+}
+
+unsigned char PageCacheYieldLinks(const char* url,
+                                  yeild_page_link_callback_fn callback,
+                                  void* context) {
+  assert(url);
+  assert(callback);
+
+  // copy links, since |callback| may add links to cache
+  PageLinks links;
+  {
+    std::lock_guard<std::mutex> lock(g_page_cache_lock());
+    PageCacheMap::const_iterator iter = g_page_cache_map().find(url);
+    if (iter == g_page_cache_map().end())
+      return 0;
+
+    links = iter->second.links;
+    ++g_page_cache_not_modified_count;
+  }
+
+  for (PageLinks::const_iterator link = links.begin(); link != links.end();
+       ++link)
+    callback(link->c_str(), context);
+  return 1;
+}
+
+void PageCacheAddLink(const char* url, const char* link) {
+  assert(url);
+  assert(link);
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  g_pending_link_map()[url].push_back(link);
+}
+
+void PageCacheCommit(const char* url,
+                     const char* etag,
+                     const char* last_modified) {
+  assert(url);
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  PendingLinkMap::iterator pending = g_pending_link_map().find(url);
+
+  // drop pages which can't be revalidated (or stored)
+  CachedPage page;
+  page.etag = etag ? etag : "";
+  page.last_modified = last_modified ? last_modified : "";
+  if ((page.etag.empty() && page.last_modified.empty()) ||
+      !IsCacheableLine(url) || !IsCacheableLine(page.etag) ||
+      !IsCacheableLine(page.last_modified)) {
+    g_page_cache_map().erase(url);
+    if (pending != g_pending_link_map().end())
+      g_pending_link_map().erase(pending);
+    return;
+  }
+
+  if (pending != g_pending_link_map().end()) {
+    for (PageLinks::const_iterator link = pending->second.begin();
+         link != pending->second.end(); ++link) {
+      if (IsCacheableLine(*link))
+        page.links.push_back(*link);
+    }
+    g_pending_link_map().erase(pending);
+  }
+  g_page_cache_map()[url] = page;
+  ++g_page_cache_fetched_count;
+}
+
+void PageCacheAbort(const char* url) {
+  assert(url);
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  g_pending_link_map().erase(url);
+}
+
+void PageCacheRemove(const char* url) {
+  assert(url);
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  g_page_cache_map().erase(url);
+  g_pending_link_map().erase(url);
+}
+
+void GetPageCacheStats(size_t* not_modified_count, size_t* fetched_count) {
+  assert(not_modified_count);
+  assert(fetched_count);
+
+  std::lock_guard<std::mutex> lock(g_page_cache_lock());
+  *not_modified_count = g_page_cache_not_modified_count;
+  *fetched_count = g_page_cache_fetched_count;
+}
@@ -0,0 +1,62 @@
+// Process-wide url -> validators & links cache for recrawls
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef PAGE_CACHE
+#define PAGE_CACHE
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// validators (ETag / Last-Modified) and links of pages fetched by the
+// last crawl, saved to a file, so later crawls revalidate pages by
+// conditional GET, and reuse links of pages not modified;
+// links of a page being fetched are pending until it's committed
+
+// sync multi callback
+typedef void (*yeild_page_link_callback_fn)(const char* link, void* context);
+
+// load pages saved by |SavePageCache| from |path| (a missing file is an
+// empty cache), or return 0 if failed
+unsigned char LoadPageCache(const char* path);
+
+// save all cached pages to |path|, or return 0 if failed
+unsigned char SavePageCache(const char* path);
+
+// copy validators of cached |url| (free them by caller, NULL if not
+// given), or return 0 if not cached
+unsigned char PageCacheGetValidators(const char* url,
+                                     char** etag,
+                                     char** last_modified);
+
+// pass links of cached |url| (not modified) to |callback|,
+// or return 0 if not cached
+unsigned char PageCacheYieldLinks(const char* url,
+                                  yeild_page_link_callback_fn callback,
+                                  void* context);
+
+// add |link| to pending links of |url|
+void PageCacheAddLink(const char* url, const char* link);
+
+// cache |url| with its pending links and validators (drop it if no
+// validator is given)
+void PageCacheCommit(const char* url,
+                     const char* etag,
+                     const char* last_modified);
+
+// drop pending links of |url| (keep it cached)
+void PageCacheAbort(const char* url);
+
+// drop |url| and its pending links
+void PageCacheRemove(const char* url);
+
+// count of pages not modified (links reused) and fetched (committed)
+void GetPageCacheStats(size_t* not_modified_count, size_t* fetched_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PAGE_CACHE
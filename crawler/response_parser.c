@@ -0,0 +1,420 @@
+// Parse http response headers and chunked body incrementally
+//   by BOT Man & ZhangHan, 2018
+
+#include "response_parser.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "string_helper.h"
+
+#define HTTP_VERSION_PREFIX "HTTP/1."
+
+#define HEADER_CONTENT_LENGTH "Content-Length"
+#define HEADER_TRANSFER_ENCODING "Transfer-Encoding"
+#define HEADER_CONNECTION "Connection"
+
+#define VALUE_CHUNKED "chunked"
+#define VALUE_CLOSE "close"
+#define VALUE_KEEP_ALIVE "keep-alive"
+
+enum {
+  State_Version,       // "HTTP/1."
+  State_Minor,         // minor version digit
+  State_Before_Code,   // spaces before status code
+  State_Code,          // status code digits
+  State_Reason,        // reason phrase until LF
+  State_Line_Start,    // start of header line or end of headers
+  State_Headers_Lf,    // LF after the last empty line
+  State_Name,          // header name until ':'
+  State_Before_Value,  // spaces before header value
+  State_Value,         // header value until LF
+  State_Skip_Line,     // malformed header line until LF
+  State_Done,
+  State_Error,
+};
+
+unsigned char IsTokenEqual(const char* beg, size_t len, const char* str) {
+  return len == strlen(str) && FindrStringIgnoreCase(beg, beg + len, str);
+}
+
+// return 0 if framing header is malformed
+unsigned char ProcessHeader(ResponseParser* parser,
+                            const char* name,
+                            size_t name_len,
+                            const char* value,
+                            size_t value_len) {
+  const char* value_end = value + value_len;
+
+  // headers of interim responses are not used
+  if (parser->status_code >= 100 && parser->status_code < 200)
+    return 1;
+
+  if (IsTokenEqual(name, name_len, HEADER_CONTENT_LENGTH)) {
+    size_t content_length = 0;
+    for (const char* p = value; p < value_end && isdigit((unsigned char)*p);
+         ++p) {
+      size_t digit = (size_t)(*p - '0');
+      if (content_length > (SIZE_MAX - digit) / 10)
+        return 0;
+      content_length = content_length * 10 + digit;
+    }
+
+    parser->has_content_length = 1;
+    parser->content_length = content_length;
+  } else if (IsTokenEqual(name, name_len, HEADER_TRANSFER_ENCODING)) {
+    if (FindrStringIgnoreCase(value, value_end, VALUE_CHUNKED))
+      parser->is_chunked = 1;
+  } else if (IsTokenEqual(name, name_len, HEADER_CONNECTION)) {
+    if (FindrStringIgnoreCase(value, value_end, VALUE_CLOSE))
+      parser->is_connection_close = 1;
+    if (FindrStringIgnoreCase(value, value_end, VALUE_KEEP_ALIVE))
+      parser->is_connection_keep_alive = 1;
+  }
+
+  if (parser->callback)
+    parser->callback(name, name_len, value, value_len, parser->context);
+  return 1;
+}
+
+// headers end before |body_offset|, then return next state
+int FinishHeaders(ResponseParser* parser, size_t body_offset) {
+  // skip interim responses (e.g. 100 Continue, 103 Early Hints),
+  // and parse the final one following them
+  // (101 Switching Protocols is never requested)
+  unsigned code = parser->status_code;
+  if (code >= 100 && code < 200) {
+    if (code == 101)
+      return State_Error;
+
+    parser->status_line_beg = body_offset;
+    parser->http_minor_version = 0;
+    parser->status_code = 0;
+    return State_Version;
+  }
+
+  // responses without body
+  unsigned char has_no_body = code == 204 || code == 304;
+
+  if (has_no_body) {
+    parser->framing = Response_Framing_Length;
+    parser->content_length = 0;
+  } else if (parser->is_chunked) {
+    parser->framing = Response_Framing_Chunked;
+  } else if (parser->has_content_length) {
+    parser->framing = Response_Framing_Length;
+  } else {
+    parser->framing = Response_Framing_Close;
+  }
+
+  // HTTP/1.1 keeps connection alive by default, but HTTP/1.0 doesn't
+  if (parser->is_connection_close)
+    parser->is_keep_alive = 0;
+  else if (parser->http_minor_version >= 1)
+    parser->is_keep_alive = 1;
+  else
+    parser->is_keep_alive = parser->is_connection_keep_alive;
+
+  parser->is_keep_alive &= parser->framing != Response_Framing_Close;
+
+  parser->body_offset = body_offset;
+  return State_Done;
+}
+
+void InitResponseParser(ResponseParser* parser,
+                        yeild_response_header_callback_fn callback,
+                        void* context) {
+  assert(parser);
+
+  memset(parser, 0, sizeof(ResponseParser));
+  parser->state = State_Version;
+  parser->callback = callback;
+  parser->context = context;
+}
+
+ResponseParseResult ParseResponse(ResponseParser* parser,
+                                  const char* data,
+                                  size_t len) {
+  assert(parser);
+  assert(data || !len);
+
+  size_t i = parser->parsed_len;
+  for (; i < len && parser->state != State_Done &&
+         parser->state != State_Error;
+       ++i) {
+    char ch = data[i];
+
+    switch (parser->state) {
+      case State_Version:
+        if (ch == HTTP_VERSION_PREFIX[i - parser->status_line_beg])
+          parser->state = i - parser->status_line_beg + 1 <
+                                  sizeof HTTP_VERSION_PREFIX - 1
+                              ? State_Version
+                              : State_Minor;
+        else
+          parser->state = State_Error;
+        break;
+
+      case State_Minor:
+        if (isdigit((unsigned char)ch)) {
+          parser->http_minor_version = (unsigned)(ch - '0');
+          parser->state = State_Before_Code;
+        } else
+          parser->state = State_Error;
+        break;
+
+      case State_Before_Code:
+        if (isdigit((unsigned char)ch)) {
+          parser->status_code = (unsigned)(ch - '0');
+          parser->state = State_Code;
+        } else if (ch == ' ')
+          parser->state = State_Before_Code;
+        else
+          parser->state = State_Error;
+        break;
+
+      case State_Code:
+        if (isdigit((unsigned char)ch)) {
+          // at most 3 digits
+          if (parser->status_code >= 100)
+            parser->state = State_Error;
+          else
+            parser->status_code =
+                parser->status_code * 10 + (unsigned)(ch - '0');
+        } else if (ch == '\n')
+          parser->state = State_Line_Start;
+        else
+          parser->state = State_Reason;
+        break;
+
+      case State_Reason:
+        if (ch == '\n')
+          parser->state = State_Line_Start;
+        else
+          parser->state = State_Reason;
+        break;
+
+      case State_Line_Start:
+        if (ch == '\r')
+          parser->state = State_Headers_Lf;
+        else if (ch == '\n')
+          parser->state = FinishHeaders(parser, i + 1);
+        else if (ch == ':' || ch == ' ' || ch == '\t')
+          parser->state = State_Skip_Line;
+        else {
+          parser->token_beg = i;
+          parser->state = State_Name;
+        }
+        break;
+
+      case State_Headers_Lf:
+        if (ch == '\n')
+          parser->state = FinishHeaders(parser, i + 1);
+        else
+          parser->state = State_Error;
+        break;
+
+      case State_Name:
+        if (ch == ':') {
+          parser->token_end = i;
+          parser->state = State_Before_Value;
+        } else if (ch == '\n')
+          parser->state = State_Line_Start;
+        else
+          parser->state = State_Name;
+        break;
+
+      case State_Before_Value:
+        if (ch == ' ' || ch == '\t')
+          break;
+        parser->value_beg = i;
+        parser->state = State_Value;
+        // fall through
+
+      case State_Value:
+        if (ch == '\n') {
+          // trim trailing CR and spaces
+          size_t value_end = i;
+          while (value_end > parser->value_beg &&
+                 (data[value_end - 1] == '\r' || data[value_end - 1] == ' ' ||
+                  data[value_end - 1] == '\t'))
+            --value_end;
+
+          parser->state =
+              ProcessHeader(parser, data + parser->token_beg,
+                            parser->token_end - parser->token_beg,
+                            data + parser->value_beg,
+                            value_end - parser->value_beg)
+                  ? State_Line_Start
+                  : State_Error;
+        }
+        break;
+
+      case State_Skip_Line:
+        if (ch == '\n')
+          parser->state = State_Line_Start;
+        break;
+    }
+  }
+  parser->parsed_len = i;
+
+  if (parser->state == State_Error)
+    return Response_Parse_Error;
+  if (parser->state != State_Done)
+    return Response_Parse_Incomplete;
+  return Response_Parse_Done;
+}
+
+enum {
+  Chunk_Size,          // hex digits of chunk size
+  Chunk_Ext,           // chunk extension until LF
+  Chunk_Size_Lf,       // LF after chunk size line
+  Chunk_Data,          // |chunk_len| bytes of data
+  Chunk_Data_Cr,       // CR after chunk data
+  Chunk_Data_Lf,       // LF after chunk data
+  Chunk_Trailer,       // start of trailer line or end of body
+  Chunk_Trailer_Line,  // trailer line until LF
+  Chunk_Last_Lf,       // LF after the last empty line
+  Chunk_Done,
+  Chunk_Error,
+};
+
+int HexDigitValue(char ch) {
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F')
+    return ch - 'A' + 10;
+  return -1;
+}
+
+void InitChunkedDecoder(ChunkedDecoder* decoder) {
+  assert(decoder);
+
+  memset(decoder, 0, sizeof(ChunkedDecoder));
+  decoder->state = Chunk_Size;
+}
+
+ResponseParseResult DecodeChunked(ChunkedDecoder* decoder,
+                                  char* data,
+                                  size_t len,
+                                  size_t* consumed_len,
+                                  size_t* decoded_len) {
+  assert(decoder);
+  assert(data || !len);
+  assert(consumed_len);
+  assert(decoded_len);
+
+  size_t i = 0;
+  size_t n_decoded = 0;
+  while (i < len && decoder->state != Chunk_Done &&
+         decoder->state != Chunk_Error) {
+    char ch = data[i];
+
+    switch (decoder->state) {
+      case Chunk_Size: {
+        int digit = HexDigitValue(ch);
+        if (digit >= 0) {
+          if (decoder->chunk_len > (SIZE_MAX - (size_t)digit) / 16)
+            decoder->state = Chunk_Error;
+          else
+            decoder->chunk_len = decoder->chunk_len * 16 + (size_t)digit;
+        } else if (ch == ';' || ch == ' ' || ch == '\t')
+          decoder->state = Chunk_Ext;
+        else if (ch == '\r')
+          decoder->state = Chunk_Size_Lf;
+        else if (ch == '\n')
+          decoder->state = decoder->chunk_len ? Chunk_Data : Chunk_Trailer;
+        else
+          decoder->state = Chunk_Error;
+        ++i;
+        break;
+      }
+
+      case Chunk_Ext:
+        if (ch == '\n')
+          decoder->state = decoder->chunk_len ? Chunk_Data : Chunk_Trailer;
+        ++i;
+        break;
+
+      case Chunk_Size_Lf:
+        if (ch == '\n')
+          decoder->state = decoder->chunk_len ? Chunk_Data : Chunk_Trailer;
+        else
+          decoder->state = Chunk_Error;
+        ++i;
+        break;
+
+      case Chunk_Data: {
+        // move as much data of current chunk as possible
+        size_t n_copy = len - i;
+        if (n_copy > decoder->chunk_len)
+          n_copy = decoder->chunk_len;
+
+        if (n_decoded != i)
+          memmove(data + n_decoded, data + i, n_copy);
+        n_decoded += n_copy;
+        i += n_copy;
+
+        decoder->chunk_len -= n_copy;
+        if (!decoder->chunk_len)
+          decoder->state = Chunk_Data_Cr;
+        break;
+      }
+
+      case Chunk_Data_Cr:
+        if (ch == '\r')
+          decoder->state = Chunk_Data_Lf;
+        else if (ch == '\n')
+          decoder->state = Chunk_Size;
+        else
+          decoder->state = Chunk_Error;
+        ++i;
+        break;
+
+      case Chunk_Data_Lf:
+        if (ch == '\n')
+          decoder->state = Chunk_Size;
+        else
+          decoder->state = Chunk_Error;
+        ++i;
+        break;
+
+      case Chunk_Trailer:
+        if (ch == '\r')
+          decoder->state = Chunk_Last_Lf;
+        else if (ch == '\n')
+          decoder->state = Chunk_Done;
+        else
+          decoder->state = Chunk_Trailer_Line;
+        ++i;
+        break;
+
+      case Chunk_Trailer_Line:
+        if (ch == '\n')
+          decoder->state = Chunk_Trailer;
+        ++i;
+        break;
+
+      case Chunk_Last_Lf:
+        if (ch == '\n')
+          decoder->state = Chunk_Done;
+        else
+          decoder->state = Chunk_Error;
+        ++i;
+        break;
+    }
+  }
+
+  *consumed_len = i;
+  *decoded_len = n_decoded;
+
+  if (decoder->state == Chunk_Error)
+    return Response_Parse_Error;
+  if (decoder->state != Chunk_Done)
+    return Response_Parse_Incomplete;
+  return Response_Parse_Done;
+}
@@ -0,0 +1,93 @@
+// Parse http response headers and chunked body incrementally
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef RESPONSE_PARSER
+#define RESPONSE_PARSER
+
+#include <stddef.h>
+
+// sync multi callback
+typedef void (*yeild_response_header_callback_fn)(const char* name,
+                                                  size_t name_len,
+                                                  const char* value,
+                                                  size_t value_len,
+                                                  void* context);
+
+typedef enum {
+  Response_Parse_Incomplete,  // need more data
+  Response_Parse_Done,        // headers are complete
+  Response_Parse_Error,       // malformed status line or framing
+} ResponseParseResult;
+
+typedef enum {
+  Response_Framing_Length,   // body length is |content_length|
+  Response_Framing_Chunked,  // chunked transfer encoding
+  Response_Framing_Close,    // body ends when connection closed
+} ResponseFraming;
+
+typedef struct {
+  // dfa state and length of parsed data (resume from here)
+  int state;
+  size_t parsed_len;
+
+  // offset of current status line (after skipped interim responses)
+  size_t status_line_beg;
+
+  // offsets of current token in data
+  size_t token_beg;
+  size_t token_end;
+  size_t value_beg;
+
+  // optional callback for each header
+  yeild_response_header_callback_fn callback;
+  void* context;
+
+  // parsed status line
+  unsigned http_minor_version;
+  unsigned status_code;
+
+  // parsed framing headers
+  unsigned char has_content_length;
+  unsigned char is_chunked;
+  unsigned char is_connection_close;
+  unsigned char is_connection_keep_alive;
+
+  // results (valid when done)
+  ResponseFraming framing;
+  size_t content_length;
+  size_t body_offset;
+  unsigned char is_keep_alive;
+} ResponseParser;
+
+void InitResponseParser(ResponseParser* parser,
+                        yeild_response_header_callback_fn callback,
+                        void* context);
+
+// |data| must start with all data fed before (e.g. the whole recv buffer),
+// since only new bytes after |parsed_len| are parsed,
+// and header offsets refer to |data|
+ResponseParseResult ParseResponse(ResponseParser* parser,
+                                  const char* data,
+                                  size_t len);
+
+typedef struct {
+  // dfa state
+  int state;
+
+  // remaining data length of current chunk
+  size_t chunk_len;
+} ChunkedDecoder;
+
+void InitChunkedDecoder(ChunkedDecoder* decoder);
+
+// decode chunked body in place: read |len| bytes from |data|, and write
+// decoded bytes to |data| (never ahead of reading);
+// set |consumed_len| (less than |len| only if done, remaining data belongs
+// to next response) and |decoded_len|
+ResponseParseResult DecodeChunked(ChunkedDecoder* decoder,
+                                  char* data,
+                                  size_t len,
+                                  size_t* consumed_len,
+                                  size_t* decoded_len);
+
+#endif  // RESPONSE_PARSER
@@ -0,0 +1,123 @@
+// Retry queue with backoff
+//   by BOT Man & ZhangHan, 2018
+
+#include "retry_queue.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// use C++ string, map, priority_queue & random to store retries
+#include <functional>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define DEFAULT_MAX_RETRY_COUNT 3
+#define INITIAL_RETRY_BACKOFF_MS 500
+#define MAX_RETRY_BACKOFF_MS 30000
+
+// url -> retries used (only for urls failed before)
+typedef std::map<std::string, unsigned> RetryCountMap;
+
+// (retry time, url) with the earliest on top
+typedef std::pair<unsigned long long, std::string> RetryEntry;
+
+typedef std::priority_queue<RetryEntry,
+                            std::vector<RetryEntry>,
+                            std::greater<RetryEntry>>
+    RetryHeap;
+
+// retry settings (shared by all threads)
+unsigned g_max_retry_count = DEFAULT_MAX_RETRY_COUNT;
+
+// retries are per thread, since hosts are routed to threads
+
+RetryCountMap& g_retry_count_map() {
+  static thread_local RetryCountMap retry_count_map;
+  return retry_count_map;
+}
+
+RetryHeap& g_retry_heap() {
+  static thread_local RetryHeap retry_heap;
+  return retry_heap;
+}
+
+std::minstd_rand& g_retry_random() {
+  static thread_local std::minstd_rand retry_random(std::random_device{}());
+  return retry_random;
+}
+
+// half of backoff doubled by |retry_count|, plus random jitter of the rest
+// (to spread retries of urls failed at the same time)
+unsigned GetRetryDelayMs(unsigned retry_count) {
+  assert(retry_count);
+
+  unsigned backoff_ms = INITIAL_RETRY_BACKOFF_MS;
+  for (unsigned i = 1; i < retry_count && backoff_ms < MAX_RETRY_BACKOFF_MS;
+       ++i)
+    backoff_ms *= 2;
+  if (backoff_ms > MAX_RETRY_BACKOFF_MS)
+    backoff_ms = MAX_RETRY_BACKOFF_MS;
+
+  unsigned half_ms = backoff_ms / 2;
+  return half_ms + (unsigned)(g_retry_random()() % (backoff_ms - half_ms + 1));
+}
+
+void SetRetryBudget(unsigned max_retry_count) {
+  g_max_retry_count = max_retry_count;
+}
+
+unsigned char RetryQueuePush(const char* url, unsigned long long now_ms) {
+  assert(url);
+
+  RetryCountMap::iterator iter =
+      g_retry_count_map().insert(std::make_pair(url, 0u)).first;
+  if (iter->second >= g_max_retry_count) {
+    g_retry_count_map().erase(iter);
+    return 0;
+  }
+
+  ++iter->second;
+  g_retry_heap().push(
+      std::make_pair(now_ms + GetRetryDelayMs(iter->second), iter->first));
+  return 1;
+}
+
+char* RetryQueuePop(unsigned long long now_ms, long long* wait_ms) {
+  assert(wait_ms);
+
+  RetryHeap& heap = g_retry_heap();
+  if (heap.empty()) {
+    *wait_ms = -1;
+    return NULL;
+  }
+  if (heap.top().first > now_ms) {
+    *wait_ms = (long long)(heap.top().first - now_ms);
+    return NULL;
+  }
+
+  const std::string& url = heap.top().second;
+  char* ret = (char*)malloc(url.size() + 1);
+  assert(ret);
+  memcpy(ret, url.c_str(), url.size() + 1);
+  heap.pop();
+
+  *wait_ms = 0;
+  return ret;
+}
+
+void RetryQueueForget(const char* url) {
+  assert(url);
+
+  // most urls never failed, skip the lookup then
+  if (!g_retry_count_map().empty())
+    g_retry_count_map().erase(url);
+}
+
+size_t GetRetryQueueUrlCount() {
+  return g_retry_heap().size();
+}
@@ -0,0 +1,40 @@
+// Retry queue with backoff
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef RETRY_QUEUE
+#define RETRY_QUEUE
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// urls failed transiently wait here until their retry time,
+// with jittered exponential backoff (from 500 ms, doubled until 30 s)
+// and a per-url budget;
+// queues are per thread (hosts are routed to threads)
+
+// set max retries of each url (3 by default, 0 to disable retries)
+// (call before any thread retries urls)
+void SetRetryBudget(unsigned max_retry_count);
+
+// queue |url| to retry later,
+// or return 0 if it runs out of its budget (forget it then)
+unsigned char RetryQueuePush(const char* url, unsigned long long now_ms);
+
+// pop a url (free it by caller) whose retry time is up at |now_ms|,
+// or return NULL and set |wait_ms| to time until the next one is due
+// (-1 if queue is empty)
+char* RetryQueuePop(unsigned long long now_ms, long long* wait_ms);
+
+// |url| finished without retrying, forget its retry count
+void RetryQueueForget(const char* url);
+
+size_t GetRetryQueueUrlCount();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // RETRY_QUEUE
@@ -0,0 +1,139 @@
+// Per-host round-trip time estimator
+//   by BOT Man & ZhangHan, 2018
+
+#include "rtt_estimator.h"
+
+#include <assert.h>
+
+// use C++ string & map to store estimators of hosts
+#include <map>
+#include <string>
+
+#define DEFAULT_MIN_TIMEOUT_MS 1000
+#define DEFAULT_MAX_TIMEOUT_MS 30000
+#define RTT_GAIN 0.125     // alpha of srtt
+#define RTTVAR_GAIN 0.25   // beta of rttvar
+#define RTTVAR_FACTOR 4    // K of rto
+#define BACKOFF_DECAY_SAMPLE_COUNT 16  // halve backoff after that
+
+// estimator of one kind of round trip
+struct RttState {
+  // smoothed rtt and its variance (in microseconds)
+  double srtt_us = 0;
+  double rttvar_us = 0;
+  bool has_sample = false;
+
+  // doubled expired timeout (as a floor of timeout), halved after
+  // every |BACKOFF_DECAY_SAMPLE_COUNT| samples
+  unsigned backoff_ms = 0;
+  size_t backoff_sample_count = 0;
+
+  // max of srtt + K * rttvar and |backoff_ms|
+  // (0 if neither measured nor timed out)
+  unsigned timeout_ms = 0;
+};
+
+struct HostRtt {
+  RttState states[Rtt_Response + 1];
+};
+
+// host -> estimators of host
+typedef std::map<std::string, HostRtt> HostRttMap;
+
+// timeout range (shared by all threads)
+unsigned g_min_timeout_ms = DEFAULT_MIN_TIMEOUT_MS;
+unsigned g_max_timeout_ms = DEFAULT_MAX_TIMEOUT_MS;
+
+// estimators are per thread, since hosts are routed to threads
+
+HostRttMap& g_host_rtt_map() {
+  static thread_local HostRttMap host_rtt_map;
+  return host_rtt_map;
+}
+
+RttState& GetRttState(const char* host, RttKind kind) {
+  assert(host);
+  assert(kind == Rtt_Conn || kind == Rtt_Response);
+
+  return g_host_rtt_map()[host].states[kind];
+}
+
+// round up |timeout_ms| to min * 2^n within range
+// (only a few distinct ones, to be common timeouts of libevent)
+unsigned RoundTimeoutMs(double timeout_ms) {
+  unsigned ret = g_min_timeout_ms;
+  while (ret < timeout_ms && ret < g_max_timeout_ms)
+    ret *= 2;
+  return ret < g_max_timeout_ms ? ret : g_max_timeout_ms;
+}
+
+unsigned char SetRttTimeoutRange(unsigned min_timeout_ms,
+                                 unsigned max_timeout_ms) {
+  if (!min_timeout_ms)
+    min_timeout_ms = DEFAULT_MIN_TIMEOUT_MS;
+  if (!max_timeout_ms)
+    max_timeout_ms = DEFAULT_MAX_TIMEOUT_MS;
+  if (min_timeout_ms > max_timeout_ms)
+    return 0;
+
+  g_min_timeout_ms = min_timeout_ms;
+  g_max_timeout_ms = max_timeout_ms;
+  return 1;
+}
+
+void UpdateTimeout(RttState& state) {
+  double timeout_ms = state.backoff_ms;
+  if (state.has_sample &&
+      timeout_ms < (state.srtt_us + RTTVAR_FACTOR * state.rttvar_us) / 1000)
+    timeout_ms = (state.srtt_us + RTTVAR_FACTOR * state.rttvar_us) / 1000;
+  state.timeout_ms = RoundTimeoutMs(timeout_ms);
+}
+
+void AddRttSample(RttState& state, double sample) {
+  if (!state.has_sample) {
+    state.srtt_us = sample;
+    state.rttvar_us = sample / 2;
+    state.has_sample = true;
+  } else {
+    double delta = state.srtt_us > sample ? state.srtt_us - sample
+                                          : sample - state.srtt_us;
+    state.rttvar_us += RTTVAR_GAIN * (delta - state.rttvar_us);
+    state.srtt_us += RTT_GAIN * (sample - state.srtt_us);
+  }
+
+  // keep backoff for a while, since response time differs by urls,
+  // and fast ones don't mean slow ones finish in time
+  if (state.backoff_ms &&
+      ++state.backoff_sample_count >= BACKOFF_DECAY_SAMPLE_COUNT) {
+    state.backoff_ms /= 2;
+    state.backoff_sample_count = 0;
+  }
+  UpdateTimeout(state);
+}
+
+void RttAddSample(const char* host, RttKind kind, long sample_us) {
+  if (sample_us < 0)
+    return;
+
+  AddRttSample(GetRttState(host, kind), (double)sample_us);
+}
+
+void RttOnTimeout(const char* host, RttKind kind, unsigned timeout_ms) {
+  RttState& state = GetRttState(host, kind);
+
+  // back off once for waits expired together (by the same timeout)
+  if (state.timeout_ms > timeout_ms)
+    return;
+
+  // round trip takes at least |timeout_ms|, keep it in variance
+  state.backoff_ms = RoundTimeoutMs((double)timeout_ms * 2);
+  state.backoff_sample_count = 0;
+  AddRttSample(state, (double)timeout_ms * 1000);
+}
+
+unsigned GetRttTimeoutMs(const char* host, RttKind kind, unsigned default_ms) {
+  HostRttMap::const_iterator iter = g_host_rtt_map().find(host);
+  if (iter == g_host_rtt_map().end() || !iter->second.states[kind].timeout_ms)
+    return default_ms;
+  return iter->second.states[kind].timeout_ms;
+}
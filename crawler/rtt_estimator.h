@@ -0,0 +1,44 @@
+// Per-host round-trip time estimator
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef RTT_ESTIMATOR
+#define RTT_ESTIMATOR
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// smoothed rtt and its variance of each host (like TCP RTO, RFC 6298),
+// to derive timeouts of waiting it: srtt + 4 * rttvar, but at least
+// double of the expired one (decayed by later samples);
+// estimators are per thread (hosts are routed to threads)
+
+typedef enum {
+  Rtt_Conn,      // connect() round trip (also for send() progress)
+  Rtt_Response,  // request sent -> first byte of response
+} RttKind;
+
+// set range of timeouts (1s ~ 30s by default, 0 to keep default),
+// or return 0 if it's empty
+// (call before any thread estimates rtt)
+unsigned char SetRttTimeoutRange(unsigned min_timeout_ms,
+                                 unsigned max_timeout_ms);
+
+// add a measured round trip of |kind| to |host|
+void RttAddSample(const char* host, RttKind kind, long sample_us);
+
+// waiting |kind| of |host| timed out after |timeout_ms|,
+// back off its timeout
+void RttOnTimeout(const char* host, RttKind kind, unsigned timeout_ms);
+
+// timeout of waiting |kind| of |host| (|default_ms| if not measured yet),
+// rounded up to min timeout * 2^n to keep few distinct timeouts
+unsigned GetRttTimeoutMs(const char* host, RttKind kind, unsigned default_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // RTT_ESTIMATOR
@@ -5,6 +5,7 @@
 #include "string_helper.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -36,3 +37,23 @@ char* CopynString(const char* src, size_t len) {
 
   return ret;
 }
+
+const char* FindrStringIgnoreCase(const char* beg,
+                                  const char* end,
+                                  const char* sub) {
+  if (!beg || !end || !sub)
+    return NULL;
+
+  size_t sub_len = strlen(sub);
+  for (const char* p = beg; p + sub_len <= end; ++p) {
+    size_t i = 0;
+    while (i < sub_len &&
+           tolower((unsigned char)p[i]) == tolower((unsigned char)sub[i]))
+      ++i;
+
+    if (i == sub_len)
+      return p;
+  }
+
+  return NULL;
+}
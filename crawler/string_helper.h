@@ -11,4 +11,8 @@ char* CopyString(const char* src);
 char* CopyrString(const char* beg, const char* end);
 char* CopynString(const char* src, size_t len);
 
+const char* FindrStringIgnoreCase(const char* beg,
+                                  const char* end,
+                                  const char* sub);
+
 #endif  // STRING_HELPER
@@ -0,0 +1,109 @@
+// Per-host TLS session cache
+//   by BOT Man & ZhangHan, 2018
+
+#include "tls_session_cache.h"
+
+#include <assert.h>
+
+// use C++ atomic, string, deque & map to store sessions
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+
+#define TLS_SESSION_CACHE_MAX_HOST_COUNT 4096
+#define TLS_SESSION_CACHE_MAX_PER_HOST 4
+
+// sessions of a host (refs owned by cache), the latest at back
+typedef std::deque<SSL_SESSION*> TlsSessionList;
+
+// host -> sessions of host
+typedef std::map<std::string, TlsSessionList> TlsSessionMap;
+
+// sessions are per thread, since hosts are routed to threads
+
+TlsSessionMap& g_tls_session_map() {
+  static thread_local TlsSessionMap tls_session_map;
+  return tls_session_map;
+}
+
+// handshake stats (shared by all threads)
+std::atomic<size_t> g_tls_resumed_count(0);
+std::atomic<size_t> g_tls_full_count(0);
+
+void FreeTlsSessionList(TlsSessionList& sessions) {
+  for (TlsSessionList::iterator iter = sessions.begin();
+       iter != sessions.end(); ++iter)
+    SSL_SESSION_free(*iter);
+  sessions.clear();
+}
+
+SSL_SESSION* TlsSessionCacheGet(const char* host) {
+  assert(host);
+
+  TlsSessionMap::iterator iter = g_tls_session_map().find(host);
+  if (iter == g_tls_session_map().end())
+    return NULL;
+
+  // drop sessions used up (e.g. TLS 1.3 tickets offered once)
+  TlsSessionList& sessions = iter->second;
+  while (!sessions.empty() && !SSL_SESSION_is_resumable(sessions.back())) {
+    SSL_SESSION_free(sessions.back());
+    sessions.pop_back();
+  }
+  if (sessions.empty()) {
+    g_tls_session_map().erase(iter);
+    return NULL;
+  }
+
+  // TLS 1.3 tickets should be used once (RFC 8446), so take it away,
+  // unless it's the last one (reused, which most servers accept)
+  SSL_SESSION* ret = sessions.back();
+  if (sessions.size() > 1 &&
+      SSL_SESSION_get_protocol_version(ret) >= TLS1_3_VERSION)
+    sessions.pop_back();
+  else
+    SSL_SESSION_up_ref(ret);
+  return ret;
+}
+
+void TlsSessionCachePut(const char* host, SSL_SESSION* session) {
+  assert(host);
+  assert(session);
+
+  // drop sessions of any host if reach limits
+  TlsSessionMap& map = g_tls_session_map();
+  if (map.size() >= TLS_SESSION_CACHE_MAX_HOST_COUNT && !map.count(host)) {
+    FreeTlsSessionList(map.begin()->second);
+    map.erase(map.begin());
+  }
+
+  // drop the oldest session of |host| if reach limits
+  TlsSessionList& sessions = map[host];
+  sessions.push_back(session);
+  if (sessions.size() > TLS_SESSION_CACHE_MAX_PER_HOST) {
+    SSL_SESSION_free(sessions.front());
+    sessions.pop_front();
+  }
+}
+
+void TlsSessionCacheClear() {
+  for (TlsSessionMap::iterator iter = g_tls_session_map().begin();
+       iter != g_tls_session_map().end(); ++iter)
+    FreeTlsSessionList(iter->second);
+  g_tls_session_map().clear();
+}
+
+void TlsSessionCacheOnHandshake(unsigned char is_resumed) {
+  if (is_resumed)
+    ++g_tls_resumed_count;
+  else
+    ++g_tls_full_count;
+}
+
+void GetTlsSessionCacheStats(size_t* resumed_count, size_t* full_count) {
+  if (resumed_count)
+    *resumed_count = g_tls_resumed_count;
+  if (full_count)
+    *full_count = g_tls_full_count;
+}
@@ -0,0 +1,40 @@
+// Per-host TLS session cache
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef TLS_SESSION_CACHE
+#define TLS_SESSION_CACHE
+
+#include <stddef.h>
+
+// For SSL_SESSION
+#include <openssl/ssl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the latest sessions (tickets) issued by each host, to resume handshakes
+// of later connections to it (a few are kept, since TLS 1.3 tickets are
+// used only once);
+// caches are per thread (hosts are routed to threads)
+
+// take the latest resumable session of |host| (free it by caller),
+// or return NULL
+SSL_SESSION* TlsSessionCacheGet(const char* host);
+
+// take over |session| issued by |host|
+void TlsSessionCachePut(const char* host, SSL_SESSION* session);
+
+// free all sessions cached by current thread
+void TlsSessionCacheClear();
+
+// count a handshake finished (shared by all threads)
+void TlsSessionCacheOnHandshake(unsigned char is_resumed);
+
+void GetTlsSessionCacheStats(size_t* resumed_count, size_t* full_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // TLS_SESSION_CACHE
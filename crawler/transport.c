@@ -0,0 +1,1001 @@
+// Pluggable socket transport (libevent or io_uring, optionally over TLS)
+//   by BOT Man & ZhangHan, 2018
+
+#include "transport.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// For close
+#include <unistd.h>
+
+// For evbuffer_get_length
+#include <event2/buffer.h>
+// For bufferevent functions
+#include <event2/bufferevent.h>
+// For bufferevent_openssl_socket_new
+#include <event2/bufferevent_ssl.h>
+// For SSL functions
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#ifdef __linux__
+// For io_uring structs and opcodes (no liburing needed)
+#include <linux/io_uring.h>
+// For mmap
+#include <sys/mman.h>
+// For eventfd
+#include <sys/eventfd.h>
+// For syscall numbers
+#include <sys/syscall.h>
+#endif
+
+#include "string_helper.h"
+#include "tls_session_cache.h"
+
+#define TIMEOUT_CACHE_SIZE 8
+#define RING_ENTRIES 4096
+
+// protocols offered by ALPN if HTTP/2 is enabled (length-prefixed)
+#define ALPN_PROTOS "\x02h2\x08http/1.1"
+#define ALPN_HTTP2 "h2"
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL  // don't raise SIGPIPE if peer closed
+#else
+#define SEND_FLAGS 0
+#endif
+
+// user_data of operations without callback (linked timeout and close)
+#define NO_CALLBACK_USER_DATA 0
+
+// requested transport type (set by |SetTransportType|, shared)
+TransportType g_transport_type = Transport_Libevent;
+
+// whether to verify TLS peers (set by |SetTransportTlsVerify|, shared)
+unsigned char g_is_tls_verified = 1;
+
+// event base and actual transport type of current thread
+__thread struct event_base* g_transport_base;
+__thread TransportType g_thread_transport_type;
+
+// timeouts registered as common timeouts of |g_transport_base|
+typedef struct {
+  struct timeval timeout;
+  const struct timeval* common_timeout;
+} TimeoutCacheEntry;
+
+__thread TimeoutCacheEntry g_timeout_cache[TIMEOUT_CACHE_SIZE];
+__thread size_t g_timeout_cache_count;
+
+//
+// libevent backend
+//
+
+// register |tv| as common timeout of |g_transport_base|,
+// which re-arm events in O(1) queues instead of O(log n) min-heap
+// (fallback to |tv| if cache or common timeouts are full)
+const struct timeval* GetCommonTimeout(const struct timeval* tv) {
+  assert(g_transport_base);
+  assert(tv);
+
+  for (size_t i = 0; i < g_timeout_cache_count; ++i) {
+    if (evutil_timercmp(&g_timeout_cache[i].timeout, tv, ==))
+      return g_timeout_cache[i].common_timeout;
+  }
+
+  const struct timeval* ret =
+      event_base_init_common_timeout(g_transport_base, tv);
+  if (!ret)
+    return tv;
+
+  if (g_timeout_cache_count < TIMEOUT_CACHE_SIZE) {
+    g_timeout_cache[g_timeout_cache_count].timeout = *tv;
+    g_timeout_cache[g_timeout_cache_count].common_timeout = ret;
+    ++g_timeout_cache_count;
+  }
+  return ret;
+}
+
+unsigned char LibeventWait(TransportOp* op, const struct timeval* timeout) {
+  assert(op->has_event);
+  return event_add(&op->event, GetCommonTimeout(timeout)) == 0;
+}
+
+//
+// TLS layer (over libevent openssl bufferevent)
+//
+
+typedef struct {
+  struct bufferevent* bev;
+
+  // sni and key of session cache
+  char* host;
+
+  // op waiting for recv or handshake (NULL if none)
+  TransportOp* op;
+
+  // handshake is done, peer closed, or errno of failure
+  unsigned char is_connected;
+  unsigned char is_eof;
+  int error;
+} TlsConn;
+
+// context of TLS connections (created when the first one starts)
+__thread SSL_CTX* g_ssl_ctx;
+
+// fd -> TLS connection on it (NULL for plain sockets)
+__thread TlsConn** g_tls_conns;
+__thread size_t g_tls_conn_cap;
+
+TlsConn* GetTlsConn(evutil_socket_t fd) {
+  assert(fd >= 0);
+  return (size_t)fd < g_tls_conn_cap ? g_tls_conns[fd] : NULL;
+}
+
+// store |conn| as connection on |fd| (growing |g_tls_conns|)
+unsigned char SetTlsConn(evutil_socket_t fd, TlsConn* conn) {
+  assert(fd >= 0);
+
+  if ((size_t)fd >= g_tls_conn_cap) {
+    size_t new_cap = g_tls_conn_cap ? g_tls_conn_cap : 64;
+    while (new_cap <= (size_t)fd)
+      new_cap *= 2;
+
+    TlsConn** new_conns =
+        (TlsConn**)realloc(g_tls_conns, new_cap * sizeof(TlsConn*));
+    if (!new_conns)
+      return 0;
+    memset(new_conns + g_tls_conn_cap, 0,
+           (new_cap - g_tls_conn_cap) * sizeof(TlsConn*));
+    g_tls_conns = new_conns;
+    g_tls_conn_cap = new_cap;
+  }
+
+  g_tls_conns[fd] = conn;
+  return 1;
+}
+
+// keep session (ticket) issued by host of |ssl| to resume later
+int OnNewTlsSession(SSL* ssl, SSL_SESSION* session) {
+  TlsConn* conn = (TlsConn*)SSL_get_app_data(ssl);
+  if (!conn)
+    return 0;
+
+  TlsSessionCachePut(conn->host, session);
+  return 1;  // take over |session|
+}
+
+SSL_CTX* CreateSslCtx() {
+  SSL_CTX* ret = SSL_CTX_new(TLS_client_method());
+  if (!ret)
+    return NULL;
+
+  // verify certificates by trusted CAs of system (host name is set for
+  // each connection), or accept any (like curl -k)
+  if (g_is_tls_verified) {
+    SSL_CTX_set_verify(ret, SSL_VERIFY_PEER, NULL);
+    if (!SSL_CTX_set_default_verify_paths(ret)) {
+      SSL_CTX_free(ret);
+      return NULL;
+    }
+  } else {
+    SSL_CTX_set_verify(ret, SSL_VERIFY_NONE, NULL);
+  }
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // most servers close without close_notify, which is taken as eof
+  // (instead of an error making the session not resumable)
+  SSL_CTX_set_options(ret, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  // pass new sessions to |g_tls_session_map| instead of internal cache
+  SSL_CTX_set_session_cache_mode(
+      ret, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ret, OnNewTlsSession);
+  return ret;
+}
+
+// wake op waiting for recv (or handshake)
+void WakeTlsConn(TlsConn* conn) {
+  assert(conn);
+
+  if (conn->op)
+    event_active(&conn->op->event, conn->op->events, 1);
+}
+
+void OnTlsConnRead(struct bufferevent* bev, void* context) {
+  (void)(bev);
+  assert(context);
+
+  WakeTlsConn((TlsConn*)context);
+}
+
+void OnTlsConnEvent(struct bufferevent* bev, short events, void* context) {
+  assert(context);
+  TlsConn* conn = (TlsConn*)context;
+
+  if (events & BEV_EVENT_CONNECTED) {
+    conn->is_connected = 1;
+    TlsSessionCacheOnHandshake(
+        (unsigned char)SSL_session_reused(bufferevent_openssl_get_ssl(bev)));
+    if (conn->op && conn->op->events == EV_WRITE)
+      WakeTlsConn(conn);
+    return;
+  }
+
+  if (events & BEV_EVENT_EOF) {
+    conn->is_eof = 1;
+  } else if (events & BEV_EVENT_ERROR) {
+    // closing without close_notify after handshake (without TLS error)
+    // is also taken as eof, if not ignored by openssl
+    int error = EVUTIL_SOCKET_ERROR();
+    if (bufferevent_get_openssl_error(bev) || !conn->is_connected)
+      conn->error = EPROTO;
+    else if (error == ECONNRESET || error == EPIPE || error == ETIMEDOUT)
+      conn->error = error;
+    else
+      conn->is_eof = 1;
+  }
+  WakeTlsConn(conn);
+}
+
+void FreeTlsConn(TlsConn* conn) {
+  assert(conn);
+
+  if (conn->bev) {
+    // drop callbacks which may be deferred after freeing |conn|
+    bufferevent_setcb(conn->bev, NULL, NULL, NULL, NULL);
+    bufferevent_free(conn->bev);
+  }
+  if (conn->host)
+    free((void*)conn->host);
+  free((void*)conn);
+}
+
+unsigned char TlsWait(TransportOp* op, const struct timeval* timeout) {
+  assert(op->has_event);
+  assert(op->is_tls);
+
+  TlsConn* conn = GetTlsConn(op->fd);
+  assert(conn);
+  if (event_add(&op->event, GetCommonTimeout(timeout)) < 0)
+    return 0;
+
+  // sending never blocks after handshake (data is buffered by |bev|)
+  if (op->events == EV_WRITE &&
+      (conn->is_connected || conn->is_eof || conn->error)) {
+    event_active(&op->event, EV_WRITE, 1);
+    return 1;
+  }
+
+  conn->op = op;
+  if (op->events == EV_READ &&
+      (evbuffer_get_length(bufferevent_get_input(conn->bev)) ||
+       conn->is_eof || conn->error))
+    WakeTlsConn(conn);
+  return 1;
+}
+
+ssize_t TlsSend(evutil_socket_t fd, const char* data, size_t len) {
+  TlsConn* conn = GetTlsConn(fd);
+  assert(conn);
+
+  if (conn->error || conn->is_eof) {
+    errno = conn->error ? conn->error : EPIPE;
+    return -1;
+  }
+  if (bufferevent_write(conn->bev, data, len) < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return (ssize_t)len;
+}
+
+ssize_t TlsRecv(evutil_socket_t fd, char* buffer, size_t len) {
+  TlsConn* conn = GetTlsConn(fd);
+  assert(conn);
+
+  size_t read_len = bufferevent_read(conn->bev, buffer, len);
+  if (read_len)
+    return (ssize_t)read_len;
+
+  if (conn->error) {
+    errno = conn->error;
+    return -1;
+  }
+  if (conn->is_eof)
+    return 0;
+
+  errno = EAGAIN;
+  return -1;
+}
+
+//
+// io_uring backend
+//
+
+#ifdef __linux__
+
+typedef struct {
+  int ring_fd;
+
+  // submission queue (|sq_local_tail| includes unsubmitted entries)
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  struct io_uring_sqe* sqes;
+
+  // completion queue
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // mapped regions of |ring_fd|
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // signaled by kernel on completion, and watched by |g_transport_base|
+  int event_fd;
+  struct event event;
+} IoUring;
+
+__thread IoUring* g_io_uring;
+
+int IoUringSetup(unsigned entries, struct io_uring_params* params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int IoUringEnter(int ring_fd, unsigned to_submit) {
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+}
+
+int IoUringRegister(int ring_fd, unsigned opcode, void* arg, unsigned nr) {
+  return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr);
+}
+
+// check all opcodes used by |IoUringWait| and |TransportClose|
+unsigned char IsIoUringSupported(int ring_fd) {
+  size_t probe_size = sizeof(struct io_uring_probe) +
+                      IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = (struct io_uring_probe*)malloc(probe_size);
+  if (!probe)
+    return 0;
+  memset(probe, 0, probe_size);
+
+  unsigned char ret = 0;
+  if (IoUringRegister(ring_fd, IORING_REGISTER_PROBE, probe,
+                      IORING_OP_LAST) >= 0) {
+    const unsigned char required_ops[] = {
+        IORING_OP_CONNECT, IORING_OP_SEND,         IORING_OP_RECV,
+        IORING_OP_CLOSE,   IORING_OP_LINK_TIMEOUT,
+    };
+    ret = 1;
+    for (size_t i = 0; i < sizeof required_ops; ++i) {
+      unsigned char opcode = required_ops[i];
+      if (opcode > probe->last_op ||
+          !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED))
+        ret = 0;
+    }
+  }
+
+  free((void*)probe);
+  return ret;
+}
+
+void FreeIoUring(IoUring* ring) {
+  assert(ring);
+
+  if (ring->event_fd >= 0) {
+    event_del(&ring->event);
+    close(ring->event_fd);
+  }
+  if (ring->sqes)
+    munmap((void*)ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->ring_fd >= 0)
+    close(ring->ring_fd);
+  free((void*)ring);
+}
+
+void OnIoUringEvent(evutil_socket_t fd, short events, void* context);
+
+IoUring* CreateIoUring(struct event_base* base) {
+  IoUring* ret = (IoUring*)malloc(sizeof(IoUring));
+  if (!ret)
+    return NULL;
+  memset(ret, 0, sizeof(IoUring));
+  ret->event_fd = -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+  ret->ring_fd = IoUringSetup(RING_ENTRIES, &params);
+  if (ret->ring_fd < 0 || !IsIoUringSupported(ret->ring_fd)) {
+    FreeIoUring(ret);
+    return NULL;
+  }
+
+  // map sq/cq rings (in one region if supported) and sqes
+  ret->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ret->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ret->cq_ring_size > ret->sq_ring_size)
+      ret->sq_ring_size = ret->cq_ring_size;
+    ret->cq_ring_size = ret->sq_ring_size;
+  }
+  ret->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  void* sq_ring = mmap(NULL, ret->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ret->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    FreeIoUring(ret);
+    return NULL;
+  }
+  ret->sq_ring = sq_ring;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ret->cq_ring = sq_ring;
+  } else {
+    void* cq_ring = mmap(NULL, ret->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ret->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      FreeIoUring(ret);
+      return NULL;
+    }
+    ret->cq_ring = cq_ring;
+  }
+
+  void* sqes = mmap(NULL, ret->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ret->ring_fd,
+                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    FreeIoUring(ret);
+    return NULL;
+  }
+  ret->sqes = (struct io_uring_sqe*)sqes;
+
+  char* sq_ptr = (char*)ret->sq_ring;
+  ret->sq_head = (unsigned*)(sq_ptr + params.sq_off.head);
+  ret->sq_tail = (unsigned*)(sq_ptr + params.sq_off.tail);
+  ret->sq_mask = (unsigned*)(sq_ptr + params.sq_off.ring_mask);
+  ret->sq_array = (unsigned*)(sq_ptr + params.sq_off.array);
+  ret->sq_entries = params.sq_entries;
+  ret->sq_local_tail = *ret->sq_tail;
+
+  char* cq_ptr = (char*)ret->cq_ring;
+  ret->cq_head = (unsigned*)(cq_ptr + params.cq_off.head);
+  ret->cq_tail = (unsigned*)(cq_ptr + params.cq_off.tail);
+  ret->cq_mask = (unsigned*)(cq_ptr + params.cq_off.ring_mask);
+  ret->cqes = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+
+  // wake up |base| when completion is posted
+  ret->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ret->event_fd < 0) {
+    FreeIoUring(ret);
+    return NULL;
+  }
+  if (IoUringRegister(ret->ring_fd, IORING_REGISTER_EVENTFD, &ret->event_fd,
+                      1) < 0 ||
+      event_assign(&ret->event, base, ret->event_fd, EV_READ | EV_PERSIST,
+                   OnIoUringEvent, ret) < 0 ||
+      event_add(&ret->event, NULL) < 0) {
+    close(ret->event_fd);
+    ret->event_fd = -1;
+    FreeIoUring(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+// submit all queued entries (kept queued to retry later if failed)
+void SubmitIoUring(IoUring* ring) {
+  assert(ring);
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned to_submit =
+      ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (to_submit)
+    (void)(IoUringEnter(ring->ring_fd, to_submit));
+}
+
+// ensure |count| free entries (submit queued ones if full)
+unsigned char ReserveIoUringSqes(IoUring* ring, unsigned count) {
+  assert(ring);
+
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head + count > ring->sq_entries) {
+    SubmitIoUring(ring);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head + count > ring->sq_entries)
+      return 0;
+  }
+  return 1;
+}
+
+// take next free entry (reserved by |ReserveIoUringSqes|)
+struct io_uring_sqe* NextIoUringSqe(IoUring* ring) {
+  unsigned index = ring->sq_local_tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ++ring->sq_local_tail;
+
+  struct io_uring_sqe* ret = &ring->sqes[index];
+  memset(ret, 0, sizeof(struct io_uring_sqe));
+  return ret;
+}
+
+void OnIoUringEvent(evutil_socket_t fd, short events, void* context) {
+  assert(events & EV_READ);
+  assert(context);
+  IoUring* ring = (IoUring*)context;
+
+  // reset eventfd counter
+  eventfd_t value;
+  (void)(eventfd_read(fd, &value));
+
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    TransportOp* op = (TransportOp*)(uintptr_t)cqe->user_data;
+    int result = cqe->res;
+
+    // release entry before callback (which may submit new entries)
+    ++head;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (!op)
+      continue;
+    assert(op->is_pending);
+    op->is_pending = 0;
+
+    // canceled by linked timeout
+    if (result == -ECANCELED) {
+      op->callback(op->fd, EV_TIMEOUT, op->context);
+      continue;
+    }
+
+    op->has_result = 1;
+    op->result = result;
+    op->callback(op->fd, op->events, op->context);
+  }
+}
+
+// submit |opcode| on |op| with linked timeout
+unsigned char IoUringWait(TransportOp* op,
+                          unsigned char opcode,
+                          const void* data,
+                          size_t len,
+                          const struct timeval* timeout) {
+  assert(g_io_uring);
+  assert(op->has_event);
+  assert(!op->is_pending);
+  assert(timeout);
+
+  if (!ReserveIoUringSqes(g_io_uring, 2))
+    return 0;
+
+  struct io_uring_sqe* sqe = NextIoUringSqe(g_io_uring);
+  sqe->opcode = opcode;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->fd = op->fd;
+  sqe->user_data = (uint64_t)(uintptr_t)op;
+  if (opcode == IORING_OP_CONNECT) {
+    sqe->addr = (uint64_t)(uintptr_t)&op->addr;
+    sqe->off = op->addr_len;
+  } else {
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = opcode == IORING_OP_SEND ? SEND_FLAGS : 0;
+  }
+
+  struct __kernel_timespec* timeout_spec =
+      (struct __kernel_timespec*)op->timeout_spec;
+  timeout_spec->tv_sec = timeout->tv_sec;
+  timeout_spec->tv_nsec = (long long)timeout->tv_usec * 1000;
+
+  struct io_uring_sqe* timeout_sqe = NextIoUringSqe(g_io_uring);
+  timeout_sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  timeout_sqe->fd = -1;
+  timeout_sqe->addr = (uint64_t)(uintptr_t)timeout_spec;
+  timeout_sqe->len = 1;
+  timeout_sqe->user_data = NO_CALLBACK_USER_DATA;
+
+  op->is_pending = 1;
+  op->has_result = 0;
+  op->data = data;
+  return 1;
+}
+
+// take result of done operation (or fail with |wait_errno|)
+int TakeIoUringResult(TransportOp* op, int wait_errno) {
+  assert(!op->is_pending);
+
+  if (!op->has_result) {
+    errno = wait_errno;
+    return -1;
+  }
+
+  op->has_result = 0;
+  if (op->result < 0) {
+    // retry interrupted operation
+    errno = op->result == -EINTR ? wait_errno : -op->result;
+    return -1;
+  }
+  return op->result;
+}
+
+#endif  // __linux__
+
+//
+// export functions
+//
+
+void SetTransportType(TransportType type) {
+  g_transport_type = type;
+}
+
+TransportType GetTransportType() {
+  return g_transport_base ? g_thread_transport_type : g_transport_type;
+}
+
+void SetTransportTlsVerify(unsigned char is_verified) {
+  g_is_tls_verified = is_verified;
+}
+
+void InitTransport(struct event_base* base) {
+  assert(base);
+  assert(!g_transport_base);
+
+  g_transport_base = base;
+  g_thread_transport_type = Transport_Libevent;
+  g_timeout_cache_count = 0;
+
+#ifdef __linux__
+  if (g_transport_type == Transport_Io_Uring) {
+    g_io_uring = CreateIoUring(base);
+    if (g_io_uring)
+      g_thread_transport_type = Transport_Io_Uring;
+  }
+#endif
+}
+
+void FreeTransport() {
+  // TLS connections are closed already (e.g. pooled ones)
+  for (size_t i = 0; i < g_tls_conn_cap; ++i)
+    assert(!g_tls_conns[i]);
+  if (g_tls_conns)
+    free((void*)g_tls_conns);
+  g_tls_conns = NULL;
+  g_tls_conn_cap = 0;
+
+  if (g_ssl_ctx)
+    SSL_CTX_free(g_ssl_ctx);
+  g_ssl_ctx = NULL;
+  TlsSessionCacheClear();
+
+#ifdef __linux__
+  if (g_io_uring) {
+    // close sockets queued by |TransportClose|
+    SubmitIoUring(g_io_uring);
+    FreeIoUring(g_io_uring);
+  }
+  g_io_uring = NULL;
+#endif
+
+  g_transport_base = NULL;
+  g_timeout_cache_count = 0;
+}
+
+void FlushTransport() {
+#ifdef __linux__
+  if (g_io_uring)
+    SubmitIoUring(g_io_uring);
+#endif
+}
+
+unsigned char TransportAssign(TransportOp* op,
+                              evutil_socket_t fd,
+                              short events,
+                              event_callback_fn callback,
+                              void* context) {
+  assert(op);
+  assert(!op->has_event);
+  assert(events == EV_READ || events == EV_WRITE);
+  assert(callback);
+
+  op->fd = fd;
+  op->events = events;
+  op->callback = callback;
+  op->context = context;
+  op->is_tls = fd >= 0 && GetTlsConn(fd);
+
+  if (op->is_tls) {
+    // TLS: only time out, or get woken up by its bufferevent
+    if (event_assign(&op->event, g_transport_base, fd, 0, callback,
+                     context) < 0)
+      return 0;
+  } else if (g_thread_transport_type == Transport_Libevent &&
+             event_assign(&op->event, g_transport_base, fd, events, callback,
+                          context) < 0) {
+    return 0;
+  }
+
+  op->has_event = 1;
+  return 1;
+}
+
+void TransportReset(TransportOp* op) {
+  assert(op);
+  assert(!op->is_pending);
+
+  if (op->has_event &&
+      (g_thread_transport_type == Transport_Libevent || op->is_tls))
+    event_del(&op->event);
+  if (op->is_tls) {
+    TlsConn* conn = GetTlsConn(op->fd);
+    if (conn && conn->op == op)
+      conn->op = NULL;
+  }
+  op->has_event = 0;
+  op->has_result = 0;
+}
+
+unsigned char TransportCancel(TransportOp* op) {
+  assert(op);
+
+#ifdef __linux__
+  // disconnect socket (also connecting one) to fail operation early
+  if (op->is_pending) {
+    shutdown(op->fd, SHUT_RDWR);
+    return 1;
+  }
+#endif
+  TransportReset(op);
+  return 0;
+}
+
+unsigned char TransportWaitConnect(TransportOp* op,
+                                   const struct timeval* timeout) {
+  assert(op);
+  assert(op->events == EV_WRITE);
+  assert(!op->is_tls);
+
+#ifdef __linux__
+  if (g_io_uring)
+    return IoUringWait(op, IORING_OP_CONNECT, NULL, 0, timeout);
+#endif
+  return LibeventWait(op, timeout);
+}
+
+unsigned char TransportWaitSend(TransportOp* op,
+                                const char* data,
+                                size_t len,
+                                const struct timeval* timeout) {
+  assert(op);
+  assert(op->events == EV_WRITE);
+
+  if (op->is_tls)
+    return TlsWait(op, timeout);
+#ifdef __linux__
+  if (g_io_uring)
+    return IoUringWait(op, IORING_OP_SEND, data, len, timeout);
+#endif
+  (void)(data);
+  (void)(len);
+  return LibeventWait(op, timeout);
+}
+
+unsigned char TransportWaitRecv(TransportOp* op,
+                                char* buffer,
+                                size_t len,
+                                const struct timeval* timeout) {
+  assert(op);
+  assert(op->events == EV_READ);
+
+  if (op->is_tls)
+    return TlsWait(op, timeout);
+#ifdef __linux__
+  if (g_io_uring)
+    return IoUringWait(op, IORING_OP_RECV, buffer, len, timeout);
+#endif
+  (void)(buffer);
+  (void)(len);
+  return LibeventWait(op, timeout);
+}
+
+int TransportConnect(TransportOp* op,
+                     evutil_socket_t fd,
+                     const struct sockaddr* addr,
+                     socklen_t addr_len) {
+  assert(op);
+  assert(addr);
+
+#ifdef __linux__
+  // connect by |TransportWaitConnect| later
+  if (g_io_uring) {
+    if (addr_len > sizeof op->addr) {
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy(&op->addr, addr, addr_len);
+    op->addr_len = addr_len;
+    errno = EINPROGRESS;
+    return -1;
+  }
+#endif
+  return connect(fd, addr, addr_len);
+}
+
+int TransportGetConnectError(TransportOp* op, evutil_socket_t fd) {
+  assert(op);
+
+#ifdef __linux__
+  if (g_io_uring)
+    return TakeIoUringResult(op, EINPROGRESS) < 0 ? errno : 0;
+#endif
+  int err;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    return errno;
+  return err;
+}
+
+ssize_t TransportSend(TransportOp* op,
+                      evutil_socket_t fd,
+                      const char* data,
+                      size_t len) {
+  assert(op);
+
+  if (op->is_tls)
+    return TlsSend(fd, data, len);
+#ifdef __linux__
+  // |data| may be copied (with the same prefix) when pipelining
+  if (g_io_uring)
+    return TakeIoUringResult(op, EAGAIN);
+#endif
+  return send(fd, data, len, SEND_FLAGS);
+}
+
+ssize_t TransportRecv(TransportOp* op,
+                      evutil_socket_t fd,
+                      char* buffer,
+                      size_t len) {
+  assert(op);
+
+  if (op->is_tls)
+    return TlsRecv(fd, buffer, len);
+#ifdef __linux__
+  if (g_io_uring) {
+    assert(!op->has_result || op->data == buffer);
+    return TakeIoUringResult(op, EAGAIN);
+  }
+#endif
+  return recv(fd, buffer, len, 0);
+}
+
+void TransportClose(evutil_socket_t fd) {
+  assert(fd >= 0);
+
+  // TLS: close by freeing its bufferevent
+  TlsConn* conn = GetTlsConn(fd);
+  if (conn) {
+    // send close_notify (without waiting for peer's), so the session
+    // is still resumable by servers
+    if (conn->is_connected && !conn->is_eof && !conn->error)
+      SSL_shutdown(bufferevent_openssl_get_ssl(conn->bev));
+
+    g_tls_conns[fd] = NULL;
+    shutdown(fd, SHUT_RDWR);
+    FreeTlsConn(conn);
+    return;
+  }
+
+#ifdef __linux__
+  // close in the next batch (fallback to close now if ring is full)
+  if (g_io_uring && ReserveIoUringSqes(g_io_uring, 1)) {
+    struct io_uring_sqe* sqe = NextIoUringSqe(g_io_uring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = NO_CALLBACK_USER_DATA;
+    return;
+  }
+#endif
+  shutdown(fd, SHUT_RDWR);
+  EVUTIL_CLOSESOCKET(fd);
+}
+
+unsigned char TransportStartTls(evutil_socket_t fd,
+                                const char* host,
+                                unsigned char is_http2_offered) {
+  assert(g_transport_base);
+  assert(fd >= 0);
+  assert(host);
+  assert(!GetTlsConn(fd));
+
+  if (!g_ssl_ctx)
+    g_ssl_ctx = CreateSslCtx();
+  if (!g_ssl_ctx)
+    return 0;
+
+  TlsConn* conn = (TlsConn*)malloc(sizeof(TlsConn));
+  if (!conn)
+    return 0;
+  memset(conn, 0, sizeof(TlsConn));
+
+  SSL* ssl = SSL_new(g_ssl_ctx);
+  conn->host = CopyString(host);
+  if (!ssl || !conn->host || !SetTlsConn(fd, conn)) {
+    if (ssl)
+      SSL_free(ssl);
+    FreeTlsConn(conn);
+    return 0;
+  }
+
+  // check certificate against |host| (ip address or dns name)
+  if (g_is_tls_verified &&
+      !X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host) &&
+      !SSL_set1_host(ssl, host)) {
+    SSL_free(ssl);
+    g_tls_conns[fd] = NULL;
+    FreeTlsConn(conn);
+    return 0;
+  }
+
+  // resume the last session of |host| if any
+  SSL_set_app_data(ssl, conn);
+  SSL_set_tlsext_host_name(ssl, host);
+  if (is_http2_offered)
+    SSL_set_alpn_protos(ssl, (const unsigned char*)ALPN_PROTOS,
+                        sizeof ALPN_PROTOS - 1);
+  SSL_SESSION* session = TlsSessionCacheGet(host);
+  if (session) {
+    SSL_set_session(ssl, session);
+    SSL_SESSION_free(session);
+  }
+
+  // |bev| owns |ssl| and |fd| since now
+  // (|ssl| is freed by it if failed, since BEV_OPT_CLOSE_ON_FREE)
+  conn->bev = bufferevent_openssl_socket_new(
+      g_transport_base, fd, ssl, BUFFEREVENT_SSL_CONNECTING,
+      BEV_OPT_CLOSE_ON_FREE);
+  if (!conn->bev) {
+    g_tls_conns[fd] = NULL;
+    FreeTlsConn(conn);
+    return 0;
+  }
+  bufferevent_setcb(conn->bev, OnTlsConnRead, NULL, OnTlsConnEvent, conn);
+  bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+  return 1;
+}
+
+unsigned char TransportIsHttp2(evutil_socket_t fd) {
+  assert(fd >= 0);
+
+  TlsConn* conn = GetTlsConn(fd);
+  if (!conn || !conn->is_connected)
+    return 0;
+
+  const unsigned char* proto = NULL;
+  unsigned proto_len = 0;
+  SSL_get0_alpn_selected(bufferevent_openssl_get_ssl(conn->bev), &proto,
+                         &proto_len);
+  return proto_len == sizeof ALPN_HTTP2 - 1 &&
+         !memcmp(proto, ALPN_HTTP2, proto_len);
+}
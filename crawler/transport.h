@@ -0,0 +1,132 @@
+// Pluggable socket transport (libevent or io_uring, optionally over TLS)
+//   by BOT Man & ZhangHan, 2018
+
+#ifndef TRANSPORT
+#define TRANSPORT
+
+#include <stddef.h>
+
+// For libevent types
+#include <event2/event.h>
+// For struct event (embedded in TransportOp)
+#include <event2/event_struct.h>
+// For sockaddr_storage
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  Transport_Libevent,  // wait readiness by libevent, then call syscalls
+  Transport_Io_Uring,  // submit syscalls to io_uring in batch
+} TransportType;
+
+// socket operation of one request (like an event)
+typedef struct {
+  evutil_socket_t fd;
+  short events;
+  event_callback_fn callback;
+  void* context;
+
+  // libevent: wait for readiness of |fd|
+  // (TLS: wait for buffered data of |fd|, whatever the transport type)
+  struct event event;
+  unsigned char has_event;
+  unsigned char is_tls;
+
+  // io_uring: operation submitted, or its result not taken yet
+  unsigned char is_pending;
+  unsigned char has_result;
+  int result;
+  const void* data;
+
+  // io_uring: address to connect, and timeout (__kernel_timespec)
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  long long timeout_spec[2];
+} TransportOp;
+
+// use |type| for threads calling |InitTransport| later
+// (io_uring falls back to libevent if not supported)
+void SetTransportType(TransportType type);
+TransportType GetTransportType();
+
+// verify certificates of TLS peers (on by default) for threads starting
+// TLS later, or accept any (e.g. self-signed) if |is_verified| is 0
+void SetTransportTlsVerify(unsigned char is_verified);
+
+// init transport of current thread, which dispatches by |base|
+void InitTransport(struct event_base* base);
+void FreeTransport();
+
+// submit operations queued since last time (before dispatching |base|)
+void FlushTransport();
+
+// like event_assign, but |events| is EV_READ or EV_WRITE only
+unsigned char TransportAssign(TransportOp* op,
+                              evutil_socket_t fd,
+                              short events,
+                              event_callback_fn callback,
+                              void* context);
+// like event_del (must not be called while io_uring operation pending)
+void TransportReset(TransportOp* op);
+
+// abort waiting of |op| (like event_del), or return 1 if io_uring
+// operation is pending (its socket is shut down to complete it soon,
+// and |callback| is still called then)
+unsigned char TransportCancel(TransportOp* op);
+
+// like event_add, call |callback| when |fd| is ready (libevent),
+// or when the operation is done (io_uring), or |timeout|
+unsigned char TransportWaitConnect(TransportOp* op,
+                                   const struct timeval* timeout);
+unsigned char TransportWaitSend(TransportOp* op,
+                                const char* data,
+                                size_t len,
+                                const struct timeval* timeout);
+unsigned char TransportWaitRecv(TransportOp* op,
+                                char* buffer,
+                                size_t len,
+                                const struct timeval* timeout);
+
+// like non-blocking syscalls (return -1 and set errno if failed),
+// but take the result of done operation instead (io_uring),
+// or fail with EINPROGRESS/EAGAIN to wait for it
+int TransportConnect(TransportOp* op,
+                     evutil_socket_t fd,
+                     const struct sockaddr* addr,
+                     socklen_t addr_len);
+int TransportGetConnectError(TransportOp* op, evutil_socket_t fd);
+ssize_t TransportSend(TransportOp* op,
+                      evutil_socket_t fd,
+                      const char* data,
+                      size_t len);
+ssize_t TransportRecv(TransportOp* op,
+                      evutil_socket_t fd,
+                      char* buffer,
+                      size_t len);
+
+// shutdown and close |fd| (maybe asynchronously)
+void TransportClose(evutil_socket_t fd);
+
+// wrap connected |fd| in TLS (with SNI of |host|, verifying certificate
+// of |host|, resuming its cached session, and offering h2 by ALPN if
+// |is_http2_offered|), which is sent and recved through a libevent
+// openssl bufferevent until closed;
+// waiting for send is done after handshake, and TLS errors (including
+// verification failure) fail send/recv with EPROTO
+// (ops of |fd| must be assigned after calling, and SIGPIPE must be
+// ignored by process, since openssl writes |fd| without MSG_NOSIGNAL)
+unsigned char TransportStartTls(evutil_socket_t fd,
+                                const char* host,
+                                unsigned char is_http2_offered);
+
+// if h2 is selected by ALPN on TLS |fd| (after handshake)
+unsigned char TransportIsHttp2(evutil_socket_t fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // TRANSPORT
@@ -10,6 +10,9 @@
 #include <map>
 #include <string>
 
+// use C++ mutex to connect urls from several threads
+#include <mutex>
+
 // url -> url's index
 typedef std::map<std::string, size_t> IndexMap;
 
@@ -26,6 +29,12 @@ UrlMap& g_url_map() {
   return url_map;
 }
 
+// guard maps above and |yield_unique_index|
+std::mutex& g_url_map_lock() {
+  static std::mutex url_map_lock;
+  return url_map_lock;
+}
+
 size_t yield_unique_index() {
   static size_t index = 0;
   return ++index;
@@ -42,11 +51,13 @@ size_t GetIndex(const std::string& url) {
 }
 
 void ConnectUrls(const char* src, const char* dst) {
+  std::lock_guard<std::mutex> lock(g_url_map_lock());
   g_url_map().emplace(GetIndex(src), GetIndex(dst));
 }
 
 void YieldUrlConnectionIndex(yeild_url_connection_index_callback_fn callback,
                              void* context) {
+  std::lock_guard<std::mutex> lock(g_url_map_lock());
   for (IndexMap::const_iterator iter = g_index_map().begin();
        iter != g_index_map().end(); ++iter) {
     callback(iter->first.c_str(), iter->second, context);
@@ -55,6 +66,7 @@ void YieldUrlConnectionIndex(yeild_url_connection_index_callback_fn callback,
 
 void YieldUrlConnectionPair(yeild_url_connection_pair_callback_fn callback,
                             void* context) {
+  std::lock_guard<std::mutex> lock(g_url_map_lock());
   for (UrlMap::const_iterator iter = g_url_map().begin();
        iter != g_url_map().end(); ++iter) {
     callback(iter->first, iter->second, context);
@@ -0,0 +1,134 @@
+#!/bin/bash
+# Crawl www/ over HTTP/2 (h2c and h2 by ALPN), and check multiplexing,
+# fallback to HTTP/1.1 and timeout of stalled streams
+#   usage: sudo test/test_http2.sh [CRAWLER] (ports 80, 443, 8080 must be
+#          free)
+#   requires: nghttpd & nghttpx (of nghttp2), openssl and python3
+
+cd "$(dirname "$0")/.." || exit 1
+CRAWLER=${1:-./crawler.out}
+NGHTTPD=${NGHTTPD:-nghttpd}
+NGHTTPX=${NGHTTPX:-nghttpx}
+TMP_DIR=$(mktemp -d)
+SERVER_PIDS=
+FAILED=0
+
+cleanup() {
+  [ -n "$SERVER_PIDS" ] && kill $SERVER_PIDS 2>/dev/null
+  rm -rf "$TMP_DIR"
+}
+trap cleanup EXIT
+
+# stop servers started before
+stop_servers() {
+  [ -n "$SERVER_PIDS" ] && kill $SERVER_PIDS 2>/dev/null && wait $SERVER_PIDS
+  SERVER_PIDS=
+}
+
+# run server $2... in background, and wait for port $1
+start_server() {
+  local port=$1
+  shift
+  "$@" > /dev/null 2>&1 &
+  SERVER_PIDS="$SERVER_PIDS $!"
+  for _ in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$port") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "failed to start server on port $port" >&2
+  exit 1
+}
+
+# crawl $4 with options $5..., and expect $2 pages of its host crawled,
+# and stats line of HTTP/2 matching $3 (or no HTTP/2 if empty)
+check() {
+  local name=$1 expected=$2 http2=$3 url=$4
+  shift 4
+  timeout 60 "$CRAWLER" "$@" "$url" > "$TMP_DIR/out.txt" 2> "$TMP_DIR/err.txt"
+  local pages result
+  pages=$(grep -c "^[0-9]*[[:space:]]*$url" "$TMP_DIR/out.txt")
+  result="$pages pages"
+  if [ "$pages" != "$expected" ]; then
+    result="$result, expected $expected"
+  elif [ -n "$http2" ] && ! grep -q "^http2: $http2$" "$TMP_DIR/err.txt"; then
+    result="$result, expected http2: $http2"
+  elif [ -z "$http2" ] && grep -q "^http2:" "$TMP_DIR/err.txt"; then
+    result="$result, expected no http2"
+  else
+    echo "PASS: $name ($result)"
+    return 0
+  fi
+  echo "FAIL: $name ($result)"
+  sed 's/^/  /' "$TMP_DIR/err.txt"
+  FAILED=1
+  return 1
+}
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+  -addext subjectAltName=DNS:localhost \
+  -keyout "$TMP_DIR/tls.key" -out "$TMP_DIR/tls.crt" 2>/dev/null || exit 1
+
+# all pages are streams of one session (by a single worker)
+start_server 80 "$NGHTTPD" --no-tls -d www 80
+start_server 443 "$NGHTTPD" -d www 443 "$TMP_DIR/tls.key" "$TMP_DIR/tls.crt"
+check "h2c by prior knowledge" 4 "4 streams on 1 sessions" \
+  http://localhost/ --http2=h2c
+check "h2 by ALPN" 4 "4 streams on 1 sessions" \
+  https://localhost/ --insecure
+stop_servers
+
+# serve www/ over TLS without ALPN, so h2 is never selected
+start_server 443 python3 -c '
+import functools, http.server, ssl, sys
+class Handler(http.server.SimpleHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+server = http.server.ThreadingHTTPServer(
+    ("127.0.0.1", 443), functools.partial(Handler, directory="www"))
+context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+context.load_cert_chain(sys.argv[1], sys.argv[2])
+server.socket = context.wrap_socket(server.socket, server_side=True)
+server.serve_forever()
+' "$TMP_DIR/tls.crt" "$TMP_DIR/tls.key"
+check "fallback to HTTP/1.1 by ALPN" 4 "" https://localhost/ --insecure
+stop_servers
+
+# proxy h2c to a backend, whose /hang never responds, so the stalled
+# stream is reset by its own timeout while the others are done
+start_server 8080 python3 -c '
+import http.server, time
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    def log_message(self, *args):
+        pass
+    def do_GET(self):
+        if self.path == "/hang":
+            time.sleep(60)
+            return
+        links = "".join("<a href=\"/page%d\">%d</a>" % (i, i)
+                        for i in range(10))
+        body = ("<html>%s<a href=\"/hang\">hang</a></html>" % links).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "text/html")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+http.server.ThreadingHTTPServer.daemon_threads = True
+http.server.ThreadingHTTPServer(("127.0.0.1", 8080), Handler).serve_forever()
+'
+start_server 80 "$NGHTTPX" "--frontend=127.0.0.1,80;no-tls" \
+  --backend=127.0.0.1,8080 --workers=1
+SECONDS=0
+if check "stalled stream times out" 12 "12 streams on 1 sessions" \
+  http://localhost/ --http2=h2c --timeout=1000 --min-timeout=1000 \
+  --max-timeout=1000 --max-retries=0; then
+  # 11 is Request_Recv_Timeout
+  if ! grep -q "^failed to fetch http://localhost/hang (11)$" \
+    "$TMP_DIR/err.txt" || [ "$SECONDS" -ge 10 ]; then
+    echo "FAIL: stalled stream times out (not failed in ${SECONDS}s)"
+    sed 's/^/  /' "$TMP_DIR/err.txt"
+    FAILED=1
+  fi
+fi
+
+exit $FAILED
@@ -0,0 +1,357 @@
+// Feed split and boundary inputs to response parser, chunked decoder and
+// body inflater
+//   by BOT Man & ZhangHan, 2018
+//
+//   usage: clang++ test/test_parsers.c crawler/response_parser.c
+//            crawler/body_inflater.c crawler/string_helper.c -I crawler
+//            -lz -o test_parsers.out && ./test_parsers.out
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// For deflate functions
+#include <zlib.h>
+
+#include "body_inflater.h"
+#include "response_parser.h"
+
+unsigned char g_is_failed;
+
+void Check(const char* name, unsigned char is_passed) {
+  printf("%s: %s\n", is_passed ? "PASS" : "FAIL", name);
+  if (!is_passed)
+    g_is_failed = 1;
+}
+
+//
+// response parser
+//
+
+// parse |data| recved one byte at a time (so every split is resumed),
+// and check it gets the same result as parsing it at once
+ResponseParseResult ParseSplitResponse(ResponseParser* parser,
+                                       const char* data) {
+  size_t len = strlen(data);
+
+  ResponseParser whole_parser;
+  InitResponseParser(&whole_parser, NULL, NULL);
+  ResponseParseResult whole_result = ParseResponse(&whole_parser, data, len);
+
+  InitResponseParser(parser, NULL, NULL);
+  ResponseParseResult ret = Response_Parse_Incomplete;
+  for (size_t i = 1; i <= len && ret == Response_Parse_Incomplete; ++i)
+    ret = ParseResponse(parser, data, i);
+
+  if (ret != whole_result ||
+      parser->status_code != whole_parser.status_code ||
+      parser->body_offset != whole_parser.body_offset)
+    return Response_Parse_Error;
+  return ret;
+}
+
+void TestResponseParser() {
+  ResponseParser parser;
+
+  const char* response =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 5\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "hello";
+  Check("headers split at every byte",
+        ParseSplitResponse(&parser, response) == Response_Parse_Done &&
+            parser.status_code == 200 &&
+            parser.framing == Response_Framing_Length &&
+            parser.content_length == 5 && !parser.is_keep_alive &&
+            parser.body_offset == strlen(response) - 5);
+
+  const char* continue_response =
+      "HTTP/1.1 100 Continue\r\n"
+      "Content-Length: 9\r\n"
+      "\r\n"
+      "HTTP/1.1 103 Early Hints\r\n"
+      "Link: </style.css>; rel=preload\r\n"
+      "\r\n"
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "\r\n";
+  Check("100 Continue followed by 200",
+        ParseSplitResponse(&parser, continue_response) ==
+                Response_Parse_Done &&
+            parser.status_code == 200 &&
+            parser.framing == Response_Framing_Chunked &&
+            parser.is_keep_alive &&
+            parser.body_offset == strlen(continue_response));
+
+  Check("headers of 100 Continue are not used",
+        ParseSplitResponse(&parser,
+                           "HTTP/1.1 100 Continue\r\n"
+                           "Content-Length: 9\r\n"
+                           "\r\n"
+                           "HTTP/1.1 200 OK\r\n"
+                           "\r\n") == Response_Parse_Done &&
+            parser.framing == Response_Framing_Close);
+
+  Check("101 Switching Protocols is rejected",
+        ParseSplitResponse(&parser,
+                           "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: h2c\r\n"
+                           "\r\n") == Response_Parse_Error);
+
+  Check("status code of 4 digits is rejected",
+        ParseSplitResponse(&parser, "HTTP/1.1 2000 OK\r\n\r\n") ==
+            Response_Parse_Error);
+
+  char max_response[64];
+  snprintf(max_response, sizeof max_response,
+           "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n",
+           (unsigned long)(size_t)-1);
+  Check("max Content-Length",
+        ParseSplitResponse(&parser, max_response) == Response_Parse_Done &&
+            parser.content_length == (size_t)-1);
+
+  Check("overflowing Content-Length is rejected",
+        ParseSplitResponse(&parser,
+                           "HTTP/1.1 200 OK\r\n"
+                           "Content-Length: 184467440737095516150\r\n"
+                           "\r\n") == Response_Parse_Error);
+}
+
+//
+// chunked decoder
+//
+
+// decode |body| recved by two reads split at |split| into |decoded|,
+// and set |consumed_len| of both reads
+ResponseParseResult DecodeSplitChunked(const char* body,
+                                       size_t split,
+                                       char* decoded,
+                                       size_t* decoded_len,
+                                       size_t* consumed_len) {
+  size_t len = strlen(body);
+  char* buffer = (char*)malloc(len + 1);
+  if (!buffer)
+    return Response_Parse_Error;
+
+  ChunkedDecoder decoder;
+  InitChunkedDecoder(&decoder);
+  *decoded_len = 0;
+  *consumed_len = 0;
+
+  ResponseParseResult ret = Response_Parse_Incomplete;
+  size_t read_begs[] = {0, split}, read_ends[] = {split, len};
+  for (size_t i = 0; i < 2 && ret == Response_Parse_Incomplete; ++i) {
+    // decode in place of recv buffer
+    size_t read_len = read_ends[i] - read_begs[i];
+    memcpy(buffer, body + read_begs[i], read_len);
+
+    size_t n_consumed = 0, n_decoded = 0;
+    ret = DecodeChunked(&decoder, buffer, read_len, &n_consumed, &n_decoded);
+    memcpy(decoded + *decoded_len, buffer, n_decoded);
+    *decoded_len += n_decoded;
+    *consumed_len += n_consumed;
+  }
+
+  free((void*)buffer);
+  return ret;
+}
+
+void TestChunkedDecoder() {
+  char decoded[256];
+  size_t decoded_len = 0, consumed_len = 0;
+
+  const char* body =
+      "1a;name=value\r\n"
+      "abcdefghijklmnopqrstuvwxyz\r\n"
+      "5\r\n"
+      "hello\r\n"
+      "0\r\n"
+      "Trailer: value\r\n"
+      "\r\n"
+      "HTTP/1.1";
+  const char* expected = "abcdefghijklmnopqrstuvwxyzhello";
+  size_t body_len = strlen(body) - strlen("HTTP/1.1");
+  unsigned char is_passed = 1;
+  for (size_t split = 0; split <= strlen(body); ++split) {
+    if (DecodeSplitChunked(body, split, decoded, &decoded_len,
+                           &consumed_len) != Response_Parse_Done ||
+        decoded_len != strlen(expected) ||
+        memcmp(decoded, expected, decoded_len) || consumed_len != body_len)
+      is_passed = 0;
+  }
+  Check("chunk-size line split at every byte", is_passed);
+
+  is_passed = 1;
+  const char* max_body = "ffffffffffffffff\r\n";
+  for (size_t split = 0; split <= strlen(max_body); ++split) {
+    if (DecodeSplitChunked(max_body, split, decoded, &decoded_len,
+                           &consumed_len) != Response_Parse_Incomplete)
+      is_passed = 0;
+  }
+  Check("max hex chunk size", sizeof(size_t) != 8 || is_passed);
+
+  is_passed = 1;
+  const char* oversize_body = "10000000000000000\r\n";
+  for (size_t split = 0; split <= strlen(oversize_body); ++split) {
+    if (DecodeSplitChunked(oversize_body, split, decoded, &decoded_len,
+                           &consumed_len) != Response_Parse_Error)
+      is_passed = 0;
+  }
+  Check("oversize hex chunk size is rejected",
+        sizeof(size_t) != 8 || is_passed);
+}
+
+//
+// body inflater
+//
+
+// compress |data| by |window_bits| of zlib (free it by caller),
+// or return NULL if failed
+char* CompressBody(const char* data,
+                   size_t len,
+                   int window_bits,
+                   size_t* compressed_len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t cap = deflateBound(&stream, (uLong)len);
+  char* ret = (char*)malloc(cap);
+  if (ret) {
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef*)ret;
+    stream.avail_out = (uInt)cap;
+    if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+      *compressed_len = cap - stream.avail_out;
+    } else {
+      free((void*)ret);
+      ret = NULL;
+    }
+  }
+  deflateEnd(&stream);
+  return ret;
+}
+
+// inflate |data| recved by two reads split at |split|, and check the
+// stream is ended (like at end of body) and inflated to |expected|
+unsigned char IsSplitInflated(ContentEncoding encoding,
+                              const char* data,
+                              size_t len,
+                              size_t split,
+                              const char* expected,
+                              size_t expected_len) {
+  BodyInflater* inflater = CreateBodyInflater(encoding, expected_len);
+  if (!inflater)
+    return 0;
+
+  unsigned char ret =
+      InflateBody(inflater, data, split) <= Inflate_Done &&
+      InflateBody(inflater, data + split, len - split) <= Inflate_Done &&
+      InflateBody(inflater, NULL, 0) == Inflate_Done;
+  if (ret) {
+    size_t inflated_len = 0;
+    const char* inflated = GetInflatedBody(inflater, &inflated_len);
+    ret = inflated_len == expected_len &&
+          !memcmp(inflated, expected, expected_len);
+  }
+  FreeBodyInflater(inflater);
+  return ret;
+}
+
+void TestBodyInflater() {
+  // larger than buffer of inflater, so output is drained by several rounds
+  size_t body_len = 1 << 20;
+  char* body = (char*)malloc(body_len);
+  if (!body) {
+    Check("allocate body", 0);
+    return;
+  }
+  for (size_t i = 0; i < body_len; ++i)
+    body[i] = "<a href=\"/page\">page</a>\n"[i % 26];
+
+  size_t gzip_len = 0, zlib_len = 0, raw_len = 0;
+  char* gzip_body = CompressBody(body, body_len, 15 + 16, &gzip_len);
+  char* zlib_body = CompressBody(body, body_len, 15, &zlib_len);
+  char* raw_body = CompressBody(body, body_len, -15, &raw_len);
+  if (!gzip_body || !zlib_body || !raw_body) {
+    Check("compress body", 0);
+  } else {
+    Check("gzip inflated by one read",
+          IsSplitInflated(Content_Encoding_Gzip, gzip_body, gzip_len, 0, body,
+                          body_len));
+    Check("zlib deflate inflated by one read",
+          IsSplitInflated(Content_Encoding_Deflate, zlib_body, zlib_len, 0,
+                          body, body_len));
+    Check("raw deflate inflated by one read",
+          IsSplitInflated(Content_Encoding_Deflate, raw_body, raw_len, 0, body,
+                          body_len));
+
+    unsigned char is_passed = 1;
+    for (size_t split = 1; split < gzip_len; ++split) {
+      if (!IsSplitInflated(Content_Encoding_Gzip, gzip_body, gzip_len, split,
+                           body, body_len))
+        is_passed = 0;
+    }
+    Check("gzip split at every byte", is_passed);
+
+    // CRC32 and ISIZE of gzip trailer are missing
+    is_passed = 1;
+    for (size_t cut = 1; cut <= 8; ++cut) {
+      for (size_t split = 0; split <= gzip_len - cut; split += 7) {
+        if (IsSplitInflated(Content_Encoding_Gzip, gzip_body, gzip_len - cut,
+                            split, body, body_len))
+          is_passed = 0;
+      }
+    }
+    Check("gzip truncated at trailer is not ended", is_passed);
+
+    BodyInflater* inflater =
+        CreateBodyInflater(Content_Encoding_Gzip, body_len - 1);
+    Check("inflated size limit",
+          inflater &&
+              InflateBody(inflater, gzip_body, gzip_len) == Inflate_Too_Large);
+    if (inflater)
+      FreeBodyInflater(inflater);
+
+    // a few bytes of raw deflate (without trailer) fill up the first 16KB
+    // buffer of inflater, so the rest is held by zlib after all input
+    size_t uniform_len = 16384 + 100, uniform_raw_len = 0;
+    char* uniform = (char*)malloc(uniform_len);
+    char* uniform_raw = NULL;
+    if (uniform) {
+      memset(uniform, 'x', uniform_len);
+      uniform_raw = CompressBody(uniform, uniform_len, -15, &uniform_raw_len);
+    }
+    Check("pending output drained after all input",
+          uniform_raw &&
+              IsSplitInflated(Content_Encoding_Deflate, uniform_raw,
+                              uniform_raw_len, 0, uniform, uniform_len));
+    free((void*)uniform_raw);
+    free((void*)uniform);
+
+    // magic of gzip header is broken
+    gzip_body[0] = 'x';
+    inflater = CreateBodyInflater(Content_Encoding_Gzip, body_len);
+    Check("corrupted gzip is rejected",
+          inflater &&
+              InflateBody(inflater, gzip_body, gzip_len) == Inflate_Data_Err);
+    if (inflater)
+      FreeBodyInflater(inflater);
+  }
+
+  free((void*)gzip_body);
+  free((void*)zlib_body);
+  free((void*)raw_body);
+  free((void*)body);
+}
+
+int main() {
+  TestResponseParser();
+  TestChunkedDecoder();
+  TestBodyInflater();
+  return g_is_failed;
+}
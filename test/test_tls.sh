@@ -0,0 +1,85 @@
+#!/bin/bash
+# Crawl www/ over TLS, and check certificates are verified by default
+#   usage: sudo test/test_tls.sh [CRAWLER] (port 443 must be free)
+#   requires: openssl and python3
+
+cd "$(dirname "$0")/.." || exit 1
+CRAWLER=${1:-./crawler.out}
+TMP_DIR=$(mktemp -d)
+SERVER_PID=
+FAILED=0
+
+cleanup() {
+  [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+  rm -rf "$TMP_DIR"
+}
+trap cleanup EXIT
+
+# serve www/ over TLS (HTTP/1.x only) by certificate $1 and key $2
+start_server() {
+  [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID"
+  python3 -c '
+import functools, http.server, ssl, sys
+class Handler(http.server.SimpleHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+server = http.server.ThreadingHTTPServer(
+    ("127.0.0.1", 443), functools.partial(Handler, directory="www"))
+context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+context.load_cert_chain(sys.argv[1], sys.argv[2])
+server.socket = context.wrap_socket(server.socket, server_side=True)
+server.serve_forever()
+' "$1" "$2" &
+  SERVER_PID=$!
+  for _ in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/443) 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "failed to start server on port 443" >&2
+  exit 1
+}
+
+# crawl $2 with options $3..., and expect $1 pages of its host crawled
+check() {
+  local name=$1 expected=$2 url=$3
+  shift 3
+  timeout 60 "$CRAWLER" "$@" "$url" > "$TMP_DIR/out.txt" 2> "$TMP_DIR/err.txt"
+  local pages
+  pages=$(grep -c "^[0-9]*[[:space:]]*$url" "$TMP_DIR/out.txt")
+  if [ "$pages" = "$expected" ]; then
+    echo "PASS: $name ($pages pages)"
+  else
+    echo "FAIL: $name ($pages pages, expected $expected)"
+    sed 's/^/  /' "$TMP_DIR/err.txt"
+    FAILED=1
+  fi
+}
+
+# self-signed certificate, and certificate of localhost signed by a CA
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+  -addext subjectAltName=DNS:localhost \
+  -keyout "$TMP_DIR/self.key" -out "$TMP_DIR/self.crt" 2>/dev/null
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=crawler-test-ca \
+  -keyout "$TMP_DIR/ca.key" -out "$TMP_DIR/ca.crt" 2>/dev/null
+openssl req -newkey rsa:2048 -nodes -subj /CN=localhost \
+  -keyout "$TMP_DIR/host.key" -out "$TMP_DIR/host.csr" 2>/dev/null
+printf 'subjectAltName=DNS:localhost\n' > "$TMP_DIR/host.ext"
+openssl x509 -req -days 1 -in "$TMP_DIR/host.csr" -CA "$TMP_DIR/ca.crt" \
+  -CAkey "$TMP_DIR/ca.key" -CAcreateserial -extfile "$TMP_DIR/host.ext" \
+  -out "$TMP_DIR/host.crt" 2>/dev/null || exit 1
+
+start_server "$TMP_DIR/self.crt" "$TMP_DIR/self.key"
+check "self-signed is rejected" 0 https://localhost/
+check "self-signed is accepted by --insecure" 4 https://localhost/ --insecure
+
+# trust the CA instead of system ones (by default verify paths of openssl)
+start_server "$TMP_DIR/host.crt" "$TMP_DIR/host.key"
+SSL_CERT_FILE="$TMP_DIR/ca.crt" \
+  check "CA-signed is verified" 4 https://localhost/
+SSL_CERT_FILE="$TMP_DIR/ca.crt" \
+  check "CA-signed of other host is rejected" 0 https://127.0.0.1/
+SSL_CERT_FILE="$TMP_DIR/ca.crt" \
+  check "CA-signed of other host is accepted by --insecure" 4 \
+  https://127.0.0.1/ --insecure
+
+exit $FAILED